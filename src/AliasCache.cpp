@@ -0,0 +1,195 @@
+#include "AliasCache.hpp"
+
+#include <cstring>
+
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "CacheFile.hpp"
+
+using namespace llvm;
+using namespace pmfix;
+using namespace pmfix::utils;
+
+constexpr char AliasCacheHeader::MAGIC[8];
+constexpr uint32_t AliasCacheHeader::VERSION;
+
+AliasCache::AliasCache(Module &m, const std::string &dir) : m_(m) {
+    scan();
+
+    SmallString<32> digest = hash_.digest();
+    SmallString<128> path(dir);
+    sys::path::append(path, Twine(digest) + ".pmfxals");
+    path_ = path.str();
+}
+
+void AliasCache::scan(void) {
+    // The results depend on every operand, so hash all of it.
+    SmallVector<char, 0> bitcode;
+    raw_svector_ostream os(bitcode);
+    WriteBitcodeToFile(m_, os);
+
+    MD5 hash;
+    hash.update(StringRef(bitcode.data(), bitcode.size()));
+    hash.final(hash_);
+
+    auto number = [&] (const Value *v) {
+        if (ordinals_.insert({v, (uint32_t)values_.size()}).second) {
+            values_.push_back(v);
+        }
+    };
+
+    for (const GlobalVariable &g : m_.globals()) number(&g);
+    for (const GlobalAlias &a : m_.aliases()) number(&a);
+    for (const Function &f : m_) number(&f);
+
+    for (const Function &f : m_) {
+        for (const Argument &a : f.args()) number(&a);
+        for (const BasicBlock &b : f) {
+            for (const Instruction &i : b) {
+                number(&i);
+                for (const Value *op : i.operand_values()) {
+                    if (isa<Constant>(op)) number(op);
+                }
+            }
+        }
+    }
+}
+
+bool AliasCache::load(std::vector<const Value*> &allocSites) {
+    auto bufOrErr = MemoryBuffer::getFile(path_, -1,
+                                          /*RequiresNullTerminator=*/false);
+    if (!bufOrErr) return false;
+    std::unique_ptr<MemoryBuffer> buf = std::move(bufOrErr.get());
+
+    if (buf->getBufferSize() < sizeof(AliasCacheHeader)) return false;
+    auto *header = reinterpret_cast<const AliasCacheHeader*>(
+        buf->getBufferStart());
+
+    if (memcmp(header->magic, AliasCacheHeader::MAGIC,
+               sizeof(AliasCacheHeader::MAGIC)) ||
+        header->version != AliasCacheHeader::VERSION ||
+        memcmp(header->hash, hash_.Bytes.data(), sizeof(header->hash)) ||
+        header->numValues != values_.size()) {
+        errs() << "Ignoring stale alias results " << path_ << "\n";
+        return false;
+    }
+
+    ArrayRef<uint32_t> sites;
+    ArrayRef<AliasCacheValue> entries;
+    ArrayRef<uint32_t> members;
+    if (!section(*buf, header->allocSitesOffset, header->numAllocSites, sites) ||
+        !section(*buf, header->valuesOffset, header->numValues, entries) ||
+        !section(*buf, header->membersOffset, header->numMembers, members)) {
+        errs() << "Malformed alias results " << path_ << "!\n";
+        return false;
+    }
+
+    for (const AliasCacheValue &e : entries) {
+        if (!sliceFits(e.firstMember, e.numMembers, members.size())) {
+            errs() << "Malformed alias results " << path_ << "!\n";
+            return false;
+        }
+    }
+
+    for (uint32_t ord : members) {
+        if (ord >= values_.size()) {
+            errs() << "Malformed alias results " << path_ << "!\n";
+            return false;
+        }
+    }
+
+    std::vector<const Value*> loadedSites;
+    for (uint32_t ord : sites) {
+        if (ord >= values_.size()) {
+            errs() << "Malformed alias results " << path_ << "!\n";
+            return false;
+        }
+        loadedSites.push_back(values_[ord]);
+    }
+
+    allocSites = std::move(loadedSites);
+    entries_ = entries;
+    members_ = members;
+    buf_ = std::move(buf);
+    return true;
+}
+
+bool AliasCache::lookup(const Value *v, bool &known, 
+                        std::vector<const Value*> &ptsSet) const {
+    assert(buf_ && "not loaded!");
+    auto it = ordinals_.find(v);
+    if (it == ordinals_.end()) return false;
+
+    const AliasCacheValue &e = entries_[it->second];
+    known = e.flags & AliasCacheValue::KNOWN;
+    for (uint32_t ord : members_.slice(e.firstMember, e.numMembers)) {
+        ptsSet.push_back(values_[ord]);
+    }
+
+    return true;
+}
+
+bool AliasCache::save(AndersenAAWrapperPass &anders,
+                      const std::vector<const Value*> &allocSites) const {
+    std::vector<uint32_t> sites;
+    for (const Value *v : allocSites) {
+        auto it = ordinals_.find(v);
+        if (it == ordinals_.end()) {
+            errs() << "Not caching alias results, allocation site " << *v 
+                << " is not in the module walk\n";
+            return false;
+        }
+        sites.push_back(it->second);
+    }
+
+    std::vector<AliasCacheValue> entries(values_.size());
+    std::vector<uint32_t> members;
+    std::vector<const Value*> ptsSet;
+    for (size_t k = 0; k < values_.size(); ++k) {
+        const Value *v = values_[k];
+        AliasCacheValue &e = entries[k];
+        e.firstMember = members.size();
+        e.numMembers = 0;
+        e.flags = 0;
+        // Nothing to ask about, the analysis only has nodes for pointers.
+        if (!v->getType()->isPointerTy()) continue;
+
+        ptsSet.clear();
+        if (!anders.getResult().getPointsToSet(v, ptsSet)) continue;
+
+        e.flags = AliasCacheValue::KNOWN;
+        for (const Value *pv : ptsSet) {
+            auto it = ordinals_.find(pv);
+            if (it == ordinals_.end()) {
+                errs() << "Not caching alias results, " << *pv 
+                    << " is not in the module walk\n";
+                return false;
+            }
+            members.push_back(it->second);
+        }
+        e.numMembers = members.size() - e.firstMember;
+    }
+
+    AliasCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, AliasCacheHeader::MAGIC, sizeof(header.magic));
+    header.version = AliasCacheHeader::VERSION;
+    memcpy(header.hash, hash_.Bytes.data(), sizeof(header.hash));
+
+    std::string out(sizeof(header), '\0');
+    header.numAllocSites = sites.size();
+    header.allocSitesOffset = out.size();
+    putArray(out, sites);
+    header.numValues = entries.size();
+    header.valuesOffset = out.size();
+    putArray(out, entries);
+    header.numMembers = members.size();
+    header.membersOffset = out.size();
+    putArray(out, members);
+    memcpy(&out[0], &header, sizeof(header));
+
+    return writeFileAtomically(path_, out, "alias results");
+}
@@ -0,0 +1,122 @@
+#pragma once
+/**
+ * On-disk cache of the Andersen points-to results for a module.
+ *
+ * Solving the constraints is the largest fixed cost of a repair, and we
+ * usually repair the same bitcode against many traces and settings. So the 
+ * first run saves the points-to set of every pointer in the module, with 
+ * values as ordinals in a fixed walk of the module (see scan()), and later
+ * runs answer queries from the file without running the analysis at all.
+ *
+ * The file is keyed by a hash of the module's bitcode. Only the whole-module
+ * Andersen's run is cached; -trace-aa, -reduced-aa, -demand-aa, -parallel-aa
+ * and -mmap-aa use the in-tree analyses instead and never touch the file.
+ *
+ * Layout (all little-endian, every section 8-byte aligned):
+ *
+ *  [AliasCacheHeader]
+ *  [uint32_t allocation site ordinals x numAllocSites]
+ *  [AliasCacheValue x numValues]
+ *  [uint32_t points-to set members x numMembers]
+ */
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "AndersenAA.h"
+
+namespace pmfix {
+
+struct AliasCacheHeader {
+    static constexpr char MAGIC[8] = {'P', 'M', 'F', 'X', 'A', 'L', 'S', '\0'};
+    static constexpr uint32_t VERSION = 1;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    // Module hash, see AliasCache.
+    uint8_t hash[16];
+    uint64_t numAllocSites;
+    uint64_t allocSitesOffset;
+    uint64_t numValues;
+    uint64_t valuesOffset;
+    uint64_t numMembers;
+    uint64_t membersOffset;
+};
+static_assert(sizeof(AliasCacheHeader) == 80, "header layout changed!");
+
+/**
+ * The points-to set of a value. Its index in the file is its ordinal.
+ */
+struct AliasCacheValue {
+    enum Flags : uint32_t { 
+        // The analysis has a points-to set for the value (it may be empty).
+        KNOWN = 1 
+    };
+
+    uint64_t firstMember;
+    uint32_t numMembers;
+    uint32_t flags;
+};
+static_assert(sizeof(AliasCacheValue) == 16, "value layout changed!");
+
+class AliasCache {
+private:
+    llvm::Module &m_;
+
+    // The values of the module in walk order, and back.
+    std::vector<const llvm::Value*> values_;
+    llvm::DenseMap<const llvm::Value*, uint32_t> ordinals_;
+
+    llvm::MD5::MD5Result hash_;
+    std::string path_;
+
+    // After a successful load().
+    std::unique_ptr<llvm::MemoryBuffer> buf_;
+    llvm::ArrayRef<AliasCacheValue> entries_;
+    llvm::ArrayRef<uint32_t> members_;
+
+    /**
+     * Numbers the values of the module: globals, then each function with 
+     * its arguments, instructions and the constants they use.
+     */
+    void scan(void);
+
+public:
+    /**
+     * Cache files live in the given directory, named after the module hash.
+     */
+    AliasCache(llvm::Module &m, const std::string &dir);
+
+    const std::string &path(void) const { return path_; }
+
+    /**
+     * Map the cache file, and get the allocation sites from it. Returns 
+     * false if there is no usable cache file for this module.
+     */
+    bool load(std::vector<const llvm::Value*> &allocSites);
+
+    /**
+     * After load(): if v is in the file, sets known as the analysis would 
+     * return it and fills in v's points-to set. Returns false if the file 
+     * doesn't cover v.
+     */
+    bool lookup(const llvm::Value *v, bool &known, 
+                std::vector<const llvm::Value*> &ptsSet) const;
+
+    /**
+     * Query the analysis for every pointer value of the module and write the
+     * results out. Returns false (with a message) on failure.
+     */
+    bool save(AndersenAAWrapperPass &anders,
+              const std::vector<const llvm::Value*> &allocSites) const;
+};
+
+}
@@ -0,0 +1,186 @@
+#include "BinaryTrace.hpp"
+
+#include <cstring>
+#include <fstream>
+#include <limits>
+
+#include "llvm/Support/Compression.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "CacheFile.hpp"
+
+using namespace llvm;
+using namespace pmfix;
+using namespace pmfix::utils;
+
+constexpr char BinaryTraceHeader::MAGIC[8];
+constexpr uint32_t BinaryTraceHeader::VERSION;
+
+#pragma region BinaryTraceFile
+
+bool BinaryTraceFile::isBinaryTrace(const std::string &path) {
+    char magic[sizeof(BinaryTraceHeader::MAGIC)] = {0};
+    std::ifstream in(path, std::ios::binary);
+    if (!in.read(magic, sizeof(magic))) return false;
+    return !memcmp(magic, BinaryTraceHeader::MAGIC, sizeof(magic));
+}
+
+std::unique_ptr<BinaryTraceFile> BinaryTraceFile::create(const std::string &path) {
+    // No null terminator needed, which lets large files get mmap'd.
+    auto bufOrErr = MemoryBuffer::getFile(path, -1,
+                                          /*RequiresNullTerminator=*/false);
+    if (!bufOrErr) {
+        errs() << "Could not open binary trace " << path << ": "
+            << bufOrErr.getError().message() << "\n";
+        return nullptr;
+    }
+
+    std::unique_ptr<BinaryTraceFile> file(
+        new BinaryTraceFile(std::move(bufOrErr.get())));
+    if (!file->validate()) {
+        errs() << "Malformed binary trace " << path << "!\n";
+        return nullptr;
+    }
+
+    return file;
+}
+
+bool BinaryTraceFile::validate(void) {
+    if (buffer_->getBufferSize() < sizeof(BinaryTraceHeader)) return false;
+    header_ = reinterpret_cast<const BinaryTraceHeader*>(
+        buffer_->getBufferStart());
+
+    if (memcmp(header_->magic, BinaryTraceHeader::MAGIC,
+               sizeof(BinaryTraceHeader::MAGIC))) {
+        return false;
+    }
+
+    if (header_->version != BinaryTraceHeader::VERSION) {
+        errs() << "Binary trace version " << header_->version
+            << ", expected " << BinaryTraceHeader::VERSION << "\n";
+        return false;
+    }
+
+    // There's one more string offset than strings.
+    if (header_->numStrings == std::numeric_limits<uint64_t>::max()) return false;
+    if (!section(*buffer_, header_->stringsOffset, header_->numStrings + 1, stringOffsets_) ||
+        !section(*buffer_, header_->locationsOffset, header_->numLocations, locations_) ||
+        !section(*buffer_, header_->stacksOffset, header_->numStacks, stacks_) ||
+        !section(*buffer_, header_->framesOffset, header_->numFrames, frames_) ||
+        !section(*buffer_, header_->blocksOffset, header_->numBlocks, blocks_)) {
+        return false;
+    }
+
+    // String bytes directly follow the offset table, which section() 
+    // checked is in the file.
+    uint64_t size = buffer_->getBufferSize();
+    uint64_t dataStart = header_->stringsOffset +
+        stringOffsets_.size() * sizeof(uint64_t);
+    if (stringOffsets_.back() > size - dataStart) return false;
+    stringData_ = buffer_->getBufferStart() + dataStart;
+
+    // Every string has at least its NUL, so the offsets strictly increase.
+    for (size_t i = 0; i + 1 < stringOffsets_.size(); ++i) {
+        if (stringOffsets_[i] >= stringOffsets_[i + 1]) return false;
+    }
+
+    for (const BinaryLocation &bl : locations_) {
+        if (bl.function >= header_->numStrings) return false;
+        if (bl.file >= header_->numStrings) return false;
+    }
+
+    for (const BinaryStack &bs : stacks_) {
+        if (bs.firstFrame > frames_.size() || 
+            bs.numFrames > frames_.size() - bs.firstFrame) return false;
+    }
+
+    for (uint32_t loc : frames_) {
+        if (loc >= locations_.size()) return false;
+    }
+
+    uint64_t nevents = 0;
+    for (const BinaryBlock &bb : blocks_) {
+        if (bb.firstEvent != nevents) return false;
+        if (bb.offset > size || bb.size > size - bb.offset) return false;
+        if (bb.numEvents > header_->numEvents - nevents) return false;
+        // Also keeps the inflated size of compressed blocks from wrapping.
+        if (bb.numEvents > std::numeric_limits<uint64_t>::max() / 
+                           sizeof(BinaryEvent)) {
+            return false;
+        }
+        if (!compressed() && bb.size != bb.numEvents * sizeof(BinaryEvent)) {
+            return false;
+        }
+        nevents += bb.numEvents;
+    }
+
+    if (compressed() && !zlib::isAvailable()) {
+        errs() << "Binary trace is compressed, but LLVM was built without zlib!\n";
+        return false;
+    }
+
+    return nevents == header_->numEvents;
+}
+
+StringRef BinaryTraceFile::string(uint32_t idx) const {
+    assert(idx + 1 < stringOffsets_.size() && "bad string index!");
+    uint64_t start = stringOffsets_[idx];
+    uint64_t end = stringOffsets_[idx + 1];
+    // Each string is NUL terminated in the file, which is not part of it.
+    return StringRef(stringData_ + start, end - start - 1);
+}
+
+LocationInfo BinaryTraceFile::location(uint32_t idx) const {
+    const BinaryLocation &bl = locations_[idx];
+    LocationInfo li;
+    li.function = string(bl.function);
+    li.file = string(bl.file);
+    li.line = bl.line;
+    return li;
+}
+
+ArrayRef<uint32_t> BinaryTraceFile::stack(uint32_t idx) const {
+    const BinaryStack &bs = stacks_[idx];
+    return frames_.slice(bs.firstFrame, bs.numFrames);
+}
+
+ArrayRef<BinaryEvent> BinaryTraceFile::block(
+    size_t idx, std::vector<BinaryEvent> &scratch) const {
+
+    const BinaryBlock &bb = blocks_[idx];
+    StringRef raw(buffer_->getBufferStart() + bb.offset, bb.size);
+
+    ArrayRef<BinaryEvent> events;
+    if (!compressed()) {
+        bool ok = section(*buffer_, bb.offset, bb.numEvents, events);
+        assert(ok && "validated on open!");
+        (void)ok;
+    } else {
+        scratch.resize(bb.numEvents);
+        size_t outSize = bb.numEvents * sizeof(BinaryEvent);
+        Error err = zlib::uncompress(raw, (char*)scratch.data(), outSize);
+        if (err || outSize != bb.numEvents * sizeof(BinaryEvent)) {
+            errs() << "Could not inflate trace block " << idx << ": "
+                << toString(std::move(err)) << "\n";
+            report_fatal_error("corrupt binary trace block");
+        }
+        events = makeArrayRef(scratch);
+    }
+
+    // The events index the tables, so check them before anyone does.
+    for (const BinaryEvent &be : events) {
+        if (be.type > TraceEvent::REQUIRED_FLUSH ||
+            be.location >= locations_.size() || be.stack >= stacks_.size()) {
+            errs() << "Bad event in trace block " << idx << ": type " 
+                << (unsigned)be.type << ", location " << be.location 
+                << ", stack " << be.stack << "\n";
+            report_fatal_error("corrupt binary trace block");
+        }
+    }
+
+    return events;
+}
+
+#pragma endregion
@@ -0,0 +1,196 @@
+#pragma once
+/**
+ * Compact binary trace format.
+ *
+ * YAML traces are nice for debugging, but on multi-million event traces the
+ * parse (and the DOM it builds) costs more than the repair itself. This format
+ * is a fixed-size record per event plus shared string/location/stack tables,
+ * so it can be read straight out of a memory-mapped file.
+ *
+ * Layout (all little-endian, every section 8-byte aligned):
+ *
+ *  [BinaryTraceHeader]
+ *  [uint64_t string offsets (numStrings + 1)][string bytes, NUL separated]
+ *  [BinaryLocation x numLocations]
+ *  [BinaryStack x numStacks]
+ *  [uint32_t location ids x numFrames]
+ *  [BinaryBlock x numBlocks]
+ *  [event blocks: BinaryEvent arrays, zlib compressed if COMPRESSED is set]
+ *
+ * The writer lives in tools/Reports.py (BinaryTraceWriter); keep the two in sync.
+ */
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include "BugReports.hpp"
+
+namespace pmfix {
+
+struct BinaryTraceHeader {
+    static constexpr char MAGIC[8] = {'P', 'M', 'F', 'X', 'T', 'R', 'C', '\0'};
+    static constexpr uint32_t VERSION = 1;
+
+    enum Flags : uint32_t {
+        NONE = 0,
+        // Event blocks are individually zlib compressed.
+        COMPRESSED = 1u << 0,
+    };
+
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    // TraceEvent::Source
+    uint32_t source;
+    // Nominal number of events per block (the last block may be shorter).
+    uint32_t eventsPerBlock;
+    uint64_t numEvents;
+    uint64_t numStrings;
+    uint64_t stringsOffset;
+    uint64_t numLocations;
+    uint64_t locationsOffset;
+    uint64_t numStacks;
+    uint64_t stacksOffset;
+    uint64_t numFrames;
+    uint64_t framesOffset;
+    uint64_t numBlocks;
+    uint64_t blocksOffset;
+};
+static_assert(sizeof(BinaryTraceHeader) == 112, "header layout changed!");
+
+/**
+ * Source location, as indices into the string table.
+ */
+struct BinaryLocation {
+    uint32_t function;
+    uint32_t file;
+    int64_t line;
+};
+static_assert(sizeof(BinaryLocation) == 16, "location layout changed!");
+
+/**
+ * A call stack is a run of location ids in the frame table, innermost first.
+ */
+struct BinaryStack {
+    uint64_t firstFrame;
+    uint32_t numFrames;
+    uint32_t reserved;
+};
+static_assert(sizeof(BinaryStack) == 16, "stack layout changed!");
+
+struct BinaryBlock {
+    // File offset and (possibly compressed) size of the block data.
+    uint64_t offset;
+    uint64_t size;
+    uint64_t firstEvent;
+    uint64_t numEvents;
+};
+static_assert(sizeof(BinaryBlock) == 32, "block layout changed!");
+
+struct BinaryEvent {
+    enum Flags : uint8_t {
+        IS_BUG = 1u << 0,
+    };
+
+    // TraceEvent::Type
+    uint8_t type;
+    uint8_t flags;
+    uint16_t reserved0;
+    uint32_t location;
+    uint32_t stack;
+    uint32_t reserved1;
+    uint64_t timestamp;
+    // Only ASSERT_ORDERED uses the second address.
+    uint64_t address;
+    uint64_t length;
+    uint64_t addressB;
+    uint64_t lengthB;
+
+    bool isBug() const { return flags & IS_BUG; }
+};
+static_assert(sizeof(BinaryEvent) == 56, "event layout changed!");
+
+/**
+ * Read-only view of a binary trace file. The file is mapped, not read, so the
+ * tables are used in place. Uncompressed event blocks are also used in place;
+ * compressed blocks are inflated one at a time on request.
+ */
+class BinaryTraceFile {
+private:
+    std::unique_ptr<llvm::MemoryBuffer> buffer_;
+    const BinaryTraceHeader *header_ = nullptr;
+
+    llvm::ArrayRef<uint64_t> stringOffsets_;
+    const char *stringData_ = nullptr;
+    llvm::ArrayRef<BinaryLocation> locations_;
+    llvm::ArrayRef<BinaryStack> stacks_;
+    llvm::ArrayRef<uint32_t> frames_;
+    llvm::ArrayRef<BinaryBlock> blocks_;
+
+    BinaryTraceFile(std::unique_ptr<llvm::MemoryBuffer> buffer)
+        : buffer_(std::move(buffer)) {}
+
+    /**
+     * Sanity checks all the section bounds. Returns false (with a message) on
+     * a truncated or foreign file.
+     */
+    bool validate(void);
+
+public:
+    /**
+     * Returns true if the file starts with the binary trace magic.
+     */
+    static bool isBinaryTrace(const std::string &path);
+
+    /**
+     * Maps the given file. Returns nullptr if the file could not be opened or
+     * is not a valid binary trace.
+     */
+    static std::unique_ptr<BinaryTraceFile> create(const std::string &path);
+
+    TraceEvent::Source source(void) const
+        { return (TraceEvent::Source)header_->source; }
+
+    bool compressed(void) const
+        { return header_->flags & BinaryTraceHeader::COMPRESSED; }
+
+    size_t numEvents(void) const { return header_->numEvents; }
+
+    size_t numLocations(void) const { return locations_.size(); }
+
+    size_t numStacks(void) const { return stacks_.size(); }
+
+    size_t numBlocks(void) const { return blocks_.size(); }
+
+    llvm::StringRef string(uint32_t idx) const;
+
+    LocationInfo location(uint32_t idx) const;
+
+    const BinaryLocation &rawLocation(uint32_t idx) const
+        { return locations_[idx]; }
+
+    /**
+     * Location ids of the given stack, innermost frame first.
+     */
+    llvm::ArrayRef<uint32_t> stack(uint32_t idx) const;
+
+    const BinaryBlock &blockInfo(size_t idx) const { return blocks_[idx]; }
+
+    /**
+     * Get the events of the given block. For uncompressed traces this points
+     * straight into the mapping and scratch is untouched; otherwise the block
+     * is inflated into scratch, so the result is only valid until scratch is
+     * reused. A block that doesn't inflate, or has events that don't index
+     * the tables, is a fatal error.
+     */
+    llvm::ArrayRef<BinaryEvent> block(size_t idx,
+                                      std::vector<BinaryEvent> &scratch) const;
+};
+
+}
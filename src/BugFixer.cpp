@@ -5,7 +5,8 @@
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/DebugInfoMetadata.h"
 #include "llvm/IR/IRBuilder.h"
-#include "llvm/Transforms/Utils/Cloning.h"
+
+#include "PointsToModel.hpp"
 
 using namespace pmfix;
 using namespace llvm;
@@ -26,17 +27,37 @@ cl::opt<bool> ExtraDumb("extra-dumb",
 
 static cl::alias IntraOnly("intra-only", cl::aliasopt(ExtraDumb));
 
-cl::opt<std::string> SummaryFile("fix-summary-file", cl::init("fix_summary.txt"),
-    cl::desc("Where to output the fix summary"));
-
 cl::opt<bool> TraceAlias("trace-aa", cl::init(false),
-    cl::desc("Use the trace based alias analysis instead of Andersen's"));
+    cl::desc("Only analyze the functions the trace reaches. Solved with the "
+             "in-tree inclusion solver (see -parallel-aa), not Andersen's"));
 
 cl::opt<bool> ReducedAlias("reduced-aa", cl::init(false),
-    cl::desc("Use the reduced alloc based alias analysis instead of Andersen's"));
+    cl::desc("Leave stack objects out of the alias analysis. Solved with the "
+             "in-tree inclusion solver (see -parallel-aa), not Andersen's"));
 
 cl::opt<bool> EnableMmapAA("mmap-aa", cl::init(false),
-    cl::desc("Use the mmap based alias analysis instead of Andersen's"));
+    cl::desc("Use the mmap based alias analysis instead of Andersen's. Only "
+             "tracks which pointers are derived from PM mappings. Can't be "
+             "combined with -trace-aa or -reduced-aa, and takes precedence "
+             "over -demand-aa and -parallel-aa"));
+
+cl::opt<bool> DemandAlias("demand-aa", cl::init(false),
+    cl::desc("Only solve the pointers the fixer asks about, rather than "
+             "running Andersen's over the whole module"));
+
+cl::opt<bool> ParallelAlias("parallel-aa", cl::init(false),
+    cl::desc("Solve the whole-module points-to analysis in-tree, on "
+             "-fixer-threads threads, instead of with Andersen's. Unlike "
+             "Andersen's, pointers from inttoptr point to nothing, and "
+             "pointers swapped in by atomicrmw xchg aren't tracked"));
+
+cl::opt<bool> VerifyParallelAlias("verify-parallel-aa", cl::init(false),
+    cl::desc("Implies -parallel-aa. Also solve it serially and check that "
+             "the two solutions are identical"));
+
+cl::opt<bool> PerfFixes("perf-fixes", cl::init(false),
+    cl::desc("Also fix redundant flushes (REQUIRED_FLUSH bugs), by removing "
+             "them or guarding them on the paths where they're redundant"));
 
 #pragma region BugFixer
 
@@ -141,14 +162,14 @@ bool BugFixer::addFixToMapping(const FixLoc &fl, FixDesc desc) {
  * 
  * 3. It is missing a flush AND a fence.
  */
-bool BugFixer::handleAssertPersisted(const TraceEvent &te, int bug_index) {
+bool BugFixer::handleAssertPersisted(TraceInfo &trace, const TraceEvent &te, 
+                                     int bug_index) {
     bool missingFlush = false;
     bool missingFence = true;
     // Need this so we know where the eventual fixes will go.
     std::list<int> opIndices;
     // For cumulative stores.
-    AddressInfo addrInfo;
-    std::list<AddressInfo> unadded;
+    AddressSet coverage;
     // errs() << "\t\tCHECK: " << te.addresses.front().str() << "\n";
 
     /**
@@ -157,82 +178,60 @@ bool BugFixer::handleAssertPersisted(const TraceEvent &te, int bug_index) {
      */
     auto &bugAddr = te.addresses.front();
 
-    // First, determine which case we are in by going backwards.
-    for (int i = bug_index - 1; i >= 0; i--) {
-        const TraceEvent &event = trace_[i];
-        if (!event.isOperation()) continue;
+    /**
+     * First, determine which case we are in by going backwards over the 
+     * operations on the bug's cache lines. Whether there's a missing fence
+     * only depends on where the walk stops, so fences are checked after.
+     */
+    const TraceAddressIndex &index = trace.addressIndex();
+    TraceAddressIndex::Walk walk = index.walkBack(bugAddr, bug_index);
+    // -1 if we walked all the way back to the start of the trace.
+    int stopIndex = -1;
+    for (int i = walk.next(); i >= 0; i = walk.next()) {
+        TraceEventView event = trace[i];
 
         // errs() << "Current index: " <<  i << "\n";
 
-        assert(event.addresses.size() <= 1 && 
+        assert(event.numAddresses() <= 1 && 
                 "Don't know how to handle more addresses!");
-        if (event.addresses.size()) {
-            auto &addr = event.addresses.front();
-
-            // if (event.type == TraceEvent::STORE && addr == bugAddr) {
-            //     assert(addr.isSingleCacheLine() && "don't know how to handle!");
-            //     /* This is the easy case, it's clear that none of the range was
-            //     persisted. */
-            //     errs() << "STORE: " << addr.str() << "\n";
-            //     missingFlush = true;
-            //     opIndices.push_back(i);
-            //     break;
-            // } else 
-            if (event.type == TraceEvent::STORE && addr.overlaps(bugAddr)) {
-                // assert(addr.isSingleCacheLine() && "don't know how to handle!");
-                /* In this case, we need to validate that there are a bunch of stores that
-                    when summed together */
-                // if (!addrInfo.length)
-                //     errs() << "STORE OVERLAP: " << addr.str() << "\n";
-                if (addrInfo.canAdd(addr)) addrInfo += addr;
-                else unadded.push_back(addr);
-
-                while (!unadded.empty()) {
-                    size_t sz = unadded.size();
-                    bool added = false;
-                    for (auto u = unadded.begin(); u != unadded.end(); ++u) {
-                        if (addrInfo.canAdd(*u)) {
-                            addrInfo += *u;
-                            unadded.erase(u);
-                            added = true;
-                            break;
-                        }
-                    }
-
-                    if (!added) break;
-                    else {
-                        assert(unadded.size() < sz && "INF");
-                    }
-                }
-
-                opIndices.push_back(i);
-                // This doesn't quite make sense to me, but I'll take it.
-                // In theory, it should add up to be exact.
-                if (addrInfo.contains(bugAddr)) {
-                    // errs() << "\tACCUMULATED: " << addrInfo.str() << "\n";
-                    // errs() << "\tCOMPLETE\n";
-                    missingFlush = true;
-                    break;
-                } else {
-                    // errs() << "\tACCUMULATED: " << addrInfo.str() << "\n";
-                }
-            } else if (event.type == TraceEvent::FLUSH &&
-                        event.addresses.front().overlaps(te.addresses.front())) {
-                assert(addr.isSingleCacheLine() && "don't know how to handle!");
-                // errs() << "FLUSH: " << addr.str() << "\n";
-                // errs() << "\tACCUMULATED: " << addrInfo.str() << "\n";
-                assert(missingFence == true &&
-                        "Shouldn't be a bug in this case, has flush and fence");
-                opIndices.push_back(i);
+        AddressInfo addr = event.address();
+
+        if (event.type() == TraceEvent::STORE && addr.overlaps(bugAddr)) {
+            // assert(addr.isSingleCacheLine() && "don't know how to handle!");
+            /* In this case, we need to validate that there are a bunch of stores that
+                when summed together */
+            coverage.add(addr);
+
+            opIndices.push_back(i);
+            // This doesn't quite make sense to me, but I'll take it.
+            // In theory, it should add up to be exact.
+            if (coverage.contains(bugAddr)) {
+                // errs() << "\tACCUMULATED: " << coverage.str() << "\n";
+                // errs() << "\tCOMPLETE\n";
+                missingFlush = true;
+                stopIndex = i;
                 break;
+            } else {
+                // errs() << "\tACCUMULATED: " << coverage.str() << "\n";
             }
-        } else if (event.type == TraceEvent::FENCE) {
-            // errs() << "FENCE\n";
-            missingFence = false;
-            missingFlush = true;
+        } else if (event.type() == TraceEvent::FLUSH && addr.overlaps(bugAddr)) {
+            assert(addr.isSingleCacheLine() && "don't know how to handle!");
+            // errs() << "FLUSH: " << addr.str() << "\n";
+            // errs() << "\tACCUMULATED: " << coverage.str() << "\n";
+            assert(!index.fencesBetween(i, bug_index) &&
+                    "Shouldn't be a bug in this case, has flush and fence");
+            opIndices.push_back(i);
+            stopIndex = i;
+            break;
         }
     }
 
+    if (index.fencesBetween(stopIndex, bug_index)) {
+        // errs() << "FENCE\n";
+        missingFence = false;
+        missingFlush = true;
+    }
+
     /**
      * Now, we need to reduce down the opIndices to things which are not 
      * the same location.
@@ -249,12 +248,12 @@ bool BugFixer::handleAssertPersisted(const TraceEvent &te, int bug_index) {
     // Foreach, if multiple stores need be fixed.
     for (int lastOpIndex : opIndices) {
         // Find where the last operation was.
-        const TraceEvent &last = trace_[lastOpIndex];
-        if (mapper_.contains(last.location)) {
+        TraceEventView last = trace[lastOpIndex];
+        if (mapper_.contains(last.site())) {
             // errs() << "Fix direct!\n";
-            // errs() << "\t\tLocation : " << last.location.str() << "\n";
-            assert(mapper_[last.location].size() && "can't have no instructions!");
-            for (const FixLoc &fLoc : mapper_[last.location]) {
+            // errs() << "\t\tLocation : " << last.location().str() << "\n";
+            assert(mapper_[last.site()].size() && "can't have no instructions!");
+            for (const FixLoc &fLoc : mapper_[last.site()]) {
                 for (Instruction *i : fLoc.insts()) {
                     errs() << "\t\tInstruction : " << *i << "\n";
                     if (!isa<StoreInst>(i) && !isa<AtomicCmpXchgInst>(i)) {
@@ -267,17 +266,17 @@ bool BugFixer::handleAssertPersisted(const TraceEvent &te, int bug_index) {
                     errs() << "OG: " << fLoc.str() << "\n";
                     errs() << "CP: " << loc.str() << "\n";
                                 
-                    bool multiline = !last.addresses.front().isSingleCacheLine();
+                    bool multiline = !last.address().isSingleCacheLine();
                     assert(!multiline && 
                             "Don't know how to handle multi-cache line operations!");
                     
                     bool res = false;
                     if (missingFlush && missingFence) {
-                        res = addFixToMapping(loc, FixDesc(ADD_FLUSH_AND_FENCE, last.callstack));
+                        res = addFixToMapping(loc, FixDesc(ADD_FLUSH_AND_FENCE, last.callstack()));
                     } else if (missingFlush) {
-                        res = addFixToMapping(loc, FixDesc(ADD_FLUSH_ONLY, last.callstack));
+                        res = addFixToMapping(loc, FixDesc(ADD_FLUSH_ONLY, last.callstack()));
                     } else if (missingFence) {
-                        res = addFixToMapping(loc, FixDesc(ADD_FENCE_ONLY, last.callstack));
+                        res = addFixToMapping(loc, FixDesc(ADD_FENCE_ONLY, last.callstack()));
                     }
 
                     // Have to do it this way, otherwise it short-circuits.
@@ -289,7 +288,7 @@ bool BugFixer::handleAssertPersisted(const TraceEvent &te, int bug_index) {
             }
         } else {
             errs() << "Forced indirect fix!\n";
-            for (const LocationInfo &li : last.callstack) {
+            for (const LocationInfo &li : last.callstack()) {
                 errs() << li.str() << " contains? " << mapper_.contains(li) << "\n";
             }
             // Here, we can take advantage of the persistent subprogram thing.
@@ -297,14 +296,21 @@ bool BugFixer::handleAssertPersisted(const TraceEvent &te, int bug_index) {
             bool res = false;
             FixDesc desc;
             if (missingFlush && missingFence) {
-                desc = FixDesc(ADD_FLUSH_AND_FENCE, last.callstack);
+                desc = FixDesc(ADD_FLUSH_AND_FENCE, last.callstack());
             } else if (missingFlush) {
-                desc = FixDesc(ADD_FLUSH_ONLY, last.callstack);
+                desc = FixDesc(ADD_FLUSH_ONLY, last.callstack());
             } else if (missingFence) {
-                desc = FixDesc(ADD_FENCE_ONLY, last.callstack);
+                desc = FixDesc(ADD_FENCE_ONLY, last.callstack());
             }
 
-            res = raiseFixLocation(FixLoc::NullLoc(), desc);
+            if (aliasReady_) {
+                res = raiseFixLocation(FixLoc::NullLoc(), desc);
+            } else {
+                // Streaming: the heuristic needs the alias analysis, which
+                // needs the whole trace, so wait for the stream to finish.
+                deferredRaises_.push_back(desc);
+                res = true;
+            }
 
             added = res || added;
         }
@@ -317,12 +323,14 @@ bool BugFixer::handleAssertPersisted(const TraceEvent &te, int bug_index) {
     return added;      
 }
 
-bool BugFixer::handleAssertOrdered(const TraceEvent &te, int bug_index) {
+bool BugFixer::handleAssertOrdered(TraceInfo &trace, const TraceEvent &te, 
+                                   int bug_index) {
     errs() << "\tTODO: implement " << __FUNCTION__ << "!\n";
     return false;
 }
 
-bool BugFixer::handleRequiredFlush(const TraceEvent &te, int bug_index) {
+bool BugFixer::handleRequiredFlush(TraceInfo &trace, const TraceEvent &te, 
+                                   int bug_index) {
     /**
      * Step 1: find the redundant flush and the original flush.
      */
@@ -330,18 +338,20 @@ bool BugFixer::handleRequiredFlush(const TraceEvent &te, int bug_index) {
     int redundantIdx = -1;
     int originalIdx = -1;
 
-    for (int i = bug_index - 1; i >= 0; i--) {
+    const TraceAddressIndex &index = trace.addressIndex();
+    TraceAddressIndex::Walk walk = index.walkBack(te.addresses.front(), bug_index);
+    for (int i = walk.next(); i >= 0; i = walk.next()) {
         if (redundantIdx != -1 && originalIdx != -1) break;
-        const TraceEvent &event = trace_[i];
-        if (!event.isOperation()) continue;
+        TraceEventView event = trace[i];
 
-        assert(event.addresses.size() <= 1 && 
+        assert(event.numAddresses() <= 1 && 
                 "Don't know how to handle more addresses!");
-        if (event.addresses.size()) {
+        if (event.numAddresses()) {
+            AddressInfo addr = event.address();
             errs() << "IDX: " << i << "\n";
-            errs() << "EVENT: " << event.typeString << "\n";
-            errs() << "Address: " << event.addresses.front().address << "\n";
-            errs() << "Length:  " << event.addresses.front().length << "\n";
+            errs() << "EVENT: " << TraceEvent::typeName(event.type()) << "\n";
+            errs() << "Address: " << addr.address << "\n";
+            errs() << "Length:  " << addr.length << "\n";
 
             /*
                 Since we already check on the outside for multi-line flushes, we
@@ -353,8 +363,8 @@ bool BugFixer::handleRequiredFlush(const TraceEvent &te, int bug_index) {
             // assert(event.addresses.front().isSingleCacheLine() && 
             //         "Don't know how to handle multi-cache line operations!");
 
-            if (event.type == TraceEvent::FLUSH &&
-                event.addresses.front() == te.addresses.front()) {
+            if (event.type() == TraceEvent::FLUSH &&
+                addr == te.addresses.front()) {
                 if (redundantIdx == -1) {
                     errs() << "\tfilled redt!\n";
                     redundantIdx = i;
@@ -363,8 +373,8 @@ bool BugFixer::handleRequiredFlush(const TraceEvent &te, int bug_index) {
                     originalIdx = i;
                     break;
                 }
-            } else if (event.type == TraceEvent::FLUSH &&
-                        event.addresses.front().overlaps(te.addresses.front())) {
+            } else if (event.type() == TraceEvent::FLUSH &&
+                        addr.overlaps(te.addresses.front())) {
                 /**
                  * If the redundant store is not exactly equal, then we really
                  * can't do much, because we don't want to separate out the
@@ -415,8 +425,8 @@ bool BugFixer::handleRequiredFlush(const TraceEvent &te, int bug_index) {
      * Otherwise, abort.
      */
 
-    TraceEvent &orig = trace_[originalIdx];
-    TraceEvent &redt = trace_[redundantIdx];
+    TraceEvent orig = trace[originalIdx];
+    TraceEvent redt = trace[redundantIdx];
 
     errs() << "Original: " << orig.str() << "\n";
     errs() << "Redundant: " << redt.str() << "\n";
@@ -429,7 +439,7 @@ bool BugFixer::handleRequiredFlush(const TraceEvent &te, int bug_index) {
     }
 
     // ContextGraph<bool> graph(mapper_, orig, redt);
-    FlowAnalyzer f(module_, mapper_, orig, redt);
+    FlowAnalyzer f(module_, mapper_, ctx_.alias(), orig, redt);
     if (!f.canAnalyze()) {
         errs() << "Cannot analyze, abort\n";
         return false;
@@ -439,19 +449,19 @@ bool BugFixer::handleRequiredFlush(const TraceEvent &te, int bug_index) {
 
     // Then we can just remove the redundant flush.
     bool res = false;
-    for (auto &redtLoc : mapper_[redt.location]) {
+    for (auto &redtLoc : mapper_[redt.site()]) {
         if (f.alwaysRedundant()) {
-            res = addFixToMapping(redtLoc, FixDesc(REMOVE_FLUSH_ONLY, redt.callstack));
+            res = addFixToMapping(redtLoc, FixDesc(REMOVE_FLUSH_ONLY, redt.callstack()));
             errs() << "Always redundant! " << "\n";
         } else {
             std::list<Instruction*> redundantPaths = f.redundantPaths();
 
             if (redundantPaths.size()) {
-                assert(mapper_[orig.location].size() > 0 && "can't handle!"); 
+                assert(mapper_[orig.site()].size() > 0 && "can't handle!"); 
                 
-                for (const FixLoc &origLoc : mapper_[orig.location]) {
+                for (const FixLoc &origLoc : mapper_[orig.site()]) {
                     // Set dependent of the real fix
-                    FixDesc remove(REMOVE_FLUSH_CONDITIONAL, redt.callstack, 
+                    FixDesc remove(REMOVE_FLUSH_CONDITIONAL, redt.callstack(), 
                         origLoc, redundantPaths);
                     bool ret = addFixToMapping(redtLoc, remove);
                     res = res || ret;
@@ -466,7 +476,8 @@ bool BugFixer::handleRequiredFlush(const TraceEvent &te, int bug_index) {
     return res;
 }
 
-bool BugFixer::computeAndAddFix(const TraceEvent &te, int bug_index) {
+bool BugFixer::computeAndAddFix(TraceInfo &trace, const TraceEvent &te, 
+                                int bug_index) {
     assert(te.isBug && "Can't fix a not-a-bug!");
 
     switch(te.type) {
@@ -474,12 +485,13 @@ bool BugFixer::computeAndAddFix(const TraceEvent &te, int bug_index) {
             errs() << "\tPersistence Bug (Universal Correctness)!\n";
             assert(te.addresses.size() == 1 &&
                 "A persist assertion should only have 1 address!");
-            return handleAssertPersisted(te, bug_index);
+            return handleAssertPersisted(trace, te, bug_index);
         }
         case TraceEvent::REQUIRED_FLUSH: {
-            errs() << "Not doing perf fixes anymore!\n";
-            return false;
-            #if 0
+            if (!PerfFixes) {
+                errs() << "Not doing perf fixes (see -perf-fixes)!\n";
+                return false;
+            }
             errs() << "\tPersistence Bug (Universal Performance)!\n";
             assert(te.addresses.size() > 0 &&
                 "A redundant flush assertion needs an address!");
@@ -498,11 +510,10 @@ bool BugFixer::computeAndAddFix(const TraceEvent &te, int bug_index) {
             // assert(te.addresses.front().isSingleCacheLine() &&
             //     "Don't know how to handle non-standard ranges which cross lines!");
 
-            return handleRequiredFlush(te, bug_index);
-            #endif
+            return handleRequiredFlush(trace, te, bug_index);
         }
         default: {
-            errs() << "Not yet supported: " << te.typeString << "\n";
+            errs() << "Not yet supported: " << TraceEvent::typeName(te.type) << "\n";
             return false;
         }
     }
@@ -556,18 +567,18 @@ bool BugFixer::fixBug(FixGenerator *fixer, const FixLoc &fl, const FixDesc &desc
             break;
         }
         case REMOVE_FLUSH_ONLY: {
-            errs() << "Not doing perf fixes anymore!\n";
-            return false;
-            #if 0
+            summary_ << summaryNum_ << ") REMOVE_FLUSH_ONLY:\n" << fl.str() << "\n";
+            ++summaryNum_;
+
             bool success = fixer->removeFlush(fl);
             assert(success && "could not remove flush of REMOVE_FLUSH_ONLY");
+            (void)success;
             break;
-            #endif
         }
         case REMOVE_FLUSH_CONDITIONAL: {
-            errs() << "Not doing perf fixes anymore!\n";
-            return false;
-            #if 0
+            summary_ << summaryNum_ << ") REMOVE_FLUSH_CONDITIONAL:\n" << fl.str() << "\n";
+            ++summaryNum_;
+
             /**
              * We need to get all of the dependent fixes, add them, then
              * add the conditional wrapper. Fun.
@@ -578,8 +589,8 @@ bool BugFixer::fixBug(FixGenerator *fixer, const FixLoc &fl, const FixDesc &desc
                 desc.originals, fl, desc.points);
             assert(success && 
                 "could not conditionally remove flush of REMOVE_FLUSH_CONDITIONAL");
+            (void)success;
             break;
-            #endif
         }
         default: {
             errs() << "UNSUPPORTED: " << desc.type << "\n";
@@ -643,7 +654,7 @@ bool BugFixer::raiseFixLocation(const FixLoc &fl, const FixDesc &desc) {
             // int64_t pmAlias = 0;
 
             // iangneal: We want unique aliases
-            std::unordered_set<const llvm::Value *> volAlias, pmAlias;
+            PtsSet volAlias, pmAlias;
 
             if (heuristicCache_.count(loc)) {
                 // errs() << "H-Cache hit!\n";
@@ -656,13 +667,6 @@ bool BugFixer::raiseFixLocation(const FixLoc &fl, const FixDesc &desc) {
                     for (Instruction *inst : fl.insts()) {
 
                         Instruction *i = inst;
-                        if (TraceAlias || ReducedAlias) {
-                            Value *v = vMap_[inst];
-                            // if (!v) errs() << *i << "\n";
-                            assert(v);
-                            i = dyn_cast<Instruction>(v);
-                            assert(i);
-                        }
 
                         /** Skip conditions **/
                         if (auto *cb = dyn_cast<CallBase>(i)) {
@@ -715,16 +719,16 @@ bool BugFixer::raiseFixLocation(const FixLoc &fl, const FixDesc &desc) {
                             // Now, we need to figure out all the aliases.
                         
                             // errs() << "Made it!\n";
-                            std::unordered_set<const llvm::Value *> ptsSet;
-                            bool res = pmDesc_->getPointsToSet(v, ptsSet);
+                            bool res;
+                            const PtsSet &ptsSet = pmDesc_->getPointsToSet(v, res);
                             // assert(res);
                             if (ptsSet.empty() && !isa<Function>(v)) {
                                 errs() << "\t\tNO PTS TO\n";
                                 // errs() << "\t\tPoints? " << pmDesc_->pointsToPm(v) << "\n";
-                                if (pmDesc_->pointsToPm(v)) pmAlias.insert(v);
-                                else volAlias.insert(v);
+                                if (pmDesc_->pointsToPm(v)) pmAlias.set(pmDesc_->id(v));
+                                else volAlias.set(pmDesc_->id(v));
 
-                                errs() << loc.str() << "\t\t\t[" << l << "] VOL: " << volAlias.size() << " PM: " << pmAlias.size() << "\n";
+                                errs() << loc.str() << "\t\t\t[" << l << "] VOL: " << volAlias.count() << " PM: " << pmAlias.count() << "\n";
                                 continue;
                             } else if (ptsSet.empty()) {
                                 errs() << loc.str() << " wut " << isa<Function>(v) << "\n";
@@ -732,7 +736,7 @@ bool BugFixer::raiseFixLocation(const FixLoc &fl, const FixDesc &desc) {
                             // assert(!ptsSet.empty() && "can't make progress!");
 
                             size_t numPm = pmDesc_->getNumPmAliases(ptsSet);
-                            size_t numVol = ptsSet.size() - numPm;
+                            size_t numVol = ptsSet.count() - numPm;
 
                             // // If it's all volatile, then it's irrelevant
                             // if (!numPm) {
@@ -745,9 +749,10 @@ bool BugFixer::raiseFixLocation(const FixLoc &fl, const FixDesc &desc) {
                             // volAlias += numVol;
                             // pmAlias += numPm;
 
-                            for (const auto val : ptsSet) {
-                                if (pmDesc_->pointsToPm(const_cast<Value*>(val))) pmAlias.insert(val);
-                                else volAlias.insert(val);
+                            for (unsigned id : ptsSet) {
+                                const Value *val = pmDesc_->value(id);
+                                if (pmDesc_->pointsToPm(const_cast<Value*>(val))) pmAlias.set(id);
+                                else volAlias.set(id);
                             }
                             
                         }
@@ -761,7 +766,7 @@ bool BugFixer::raiseFixLocation(const FixLoc &fl, const FixDesc &desc) {
             heuristicCache_[loc].first = volAlias;
             heuristicCache_[loc].second = pmAlias; 
             
-            errs() << loc.str() << "\n[" << l << "] VOL: " << volAlias.size() << " PM: " << pmAlias.size() << "\n";
+            errs() << loc.str() << "\n[" << l << "] VOL: " << volAlias.count() << " PM: " << pmAlias.count() << "\n";
             // errs() << loc.str() << "\t[" << minIdx << "] VOL: " << minVolAlias << " PM: " << maxPmAlias << "\n";
 
             // Rebuttal: do we need this?
@@ -772,8 +777,8 @@ bool BugFixer::raiseFixLocation(const FixLoc &fl, const FixDesc &desc) {
             //     minVolAlias = volAlias;
             //     maxPmAlias = pmAlias;
             // }
-            int64_t score = pmAlias.size() - volAlias.size();
-            if (!pmAlias.size() && !volAlias.size()) scores[l] = NO_ALIASES;
+            int64_t score = (int64_t)pmAlias.count() - (int64_t)volAlias.count();
+            if (pmAlias.empty() && volAlias.empty()) scores[l] = NO_ALIASES;
             else scores[l] = score;
         }
 
@@ -994,13 +999,13 @@ bool BugFixer::doRepair(void) {
      * everything else.
      */
     FixGenerator *fixer = nullptr;
-    switch (trace_.getSource()) {
+    switch (trace_->getSource()) {
         case TraceEvent::PMTEST: {
-            fixer = new PMTestFixGenerator(module_, pmDesc_.get(), &vMap_);
+            fixer = new PMTestFixGenerator(module_, pmDesc_.get());
             break;
         }
         case TraceEvent::GENERIC: {
-            fixer = new GenericFixGenerator(module_, pmDesc_.get(), &vMap_);
+            fixer = new GenericFixGenerator(module_, pmDesc_.get());
             break;
         }
         default: {
@@ -1015,9 +1020,9 @@ bool BugFixer::doRepair(void) {
      * 
      * Now, we find all the fixes.
      */
-    for (int bug_index : trace_.bugs()) {
+    for (int bug_index : trace_->bugs()) {
         errs() << "Bug Index: " << bug_index << "\n";
-        bool addedFix = computeAndAddFix(trace_[bug_index], bug_index);
+        bool addedFix = computeAndAddFix(*trace_, (*trace_)[bug_index], bug_index);
         if (addedFix) {
             errs() << "\tAdded a fix!\n";
         } else {
@@ -1084,7 +1089,7 @@ bool BugFixer::doRepair(void) {
     }
 
     errs() << "Fixed " << nfixes << " of " << nbugs << " identified! (" 
-        << trace_.bugs().size() << " in trace)\n";
+        << trace_->bugs().size() + nstreamed_ << " in trace)\n";
 
     errs() << "Interprocedural fixes : " << interFixes << "\n";
     errs() << "Intraprocedural fixes : " << intraFixes << "\n";
@@ -1099,57 +1104,34 @@ const std::string BugFixer::immutableFnNames_[] = { "memset_mov_sse2_empty" };
 const std::string BugFixer::immutableLibNames_[] = {"libc.so"};
 
 void BugFixer::runTraceAA() {
-    dupMod_ = llvm::CloneModule(module_, vMap_);
-
-    for (Function &f : module_) {
-        for (BasicBlock &b : f) {
-            for (Instruction &i : b) {
-                assert(vMap_[&i] && "check");
-            }
-        }
-    }
-
     // Get all the functions used in the trace.
-    unordered_set<Value*> used;
-    for (const TraceEvent &te : trace_.events()) {
-        for (const LocationInfo &li : te.callstack) {
+    unordered_set<Function*> used;
+    for (const TraceEventView &te : trace_->events()) {
+        for (const LocationInfo &li : te.callstack()) {
             if (!mapper_.contains(li)) continue;
 
             for (const FixLoc &fl : mapper_[li]) {
                 if (fl.insts().empty()) continue;
-
-                Function *usedFn = fl.insts().front()->getFunction();
-                Value *remap = vMap_[usedFn];
-                assert(remap);
-                used.insert(remap);
-
+                used.insert(fl.insts().front()->getFunction());
             }                    
         }
     }
 
     // Add a small whitelist
     std::unordered_set<std::string> whitelist = {"pmemobj_open"};
-    unordered_set<Value*> wlist;
-    std::list<Value*> explore;
+    unordered_set<Function*> wlist;
+    std::list<Function*> explore;
     for (Function &f : module_) {
-        if (whitelist.count(f.getName())) {
-            Value *remap = vMap_[&f];
-            assert(remap);
-            if (!wlist.count(remap)) {
-                wlist.insert(remap);
-                explore.push_back(remap);
-            }
-            
+        if (whitelist.count(f.getName()) && wlist.insert(&f).second) {
+            explore.push_back(&f);
         }
     }
 
     // Also add the things the functions call
     while(explore.size()) {
-        Value *v = explore.front();
+        Function *f = explore.front();
         explore.pop_front();
 
-        auto *f = dyn_cast<Function>(v);
-        if (!f) continue;
         if (f->isDeclaration() || f->getIntrinsicID() != Intrinsic::not_intrinsic) continue;
 
         for (auto &BB : *f) {
@@ -1159,10 +1141,7 @@ void BugFixer::runTraceAA() {
                 auto *cbF = cb->getCalledFunction();
                 if (!cbF) continue;
 
-                if (!wlist.count(cbF)) {
-                    explore.push_back(cbF);
-                    wlist.insert(cbF);
-                }
+                if (wlist.insert(cbF).second) explore.push_back(cbF);
             }
         }
     }
@@ -1170,125 +1149,58 @@ void BugFixer::runTraceAA() {
     // errs() << "WLIST " << wlist.size() << "\n";
     used.insert(wlist.begin(), wlist.end());
 
+    // Also add the callers of the functions, transitively.
     while (true) {
-        // errs() << "Currently " << used.size() << "\n";
-        unordered_set<Value*> next;
-        // Also add the users of the function as needed
-        for (auto *v : used) {
-            for (auto *u : v->users()) {
+        unordered_set<Function*> next;
+        for (Function *f : used) {
+            for (User *u : f->users()) {
                 auto *i = dyn_cast<Instruction>(u);
                 if (!i) continue;
-                Function *f = i->getFunction();
-                if (!f) continue;
-                if (used.count(f)) continue;
-                next.insert(f);
-            }
-
-            Instruction *i = dyn_cast<Instruction>(v);
-            if (!i) continue;
-
-            for (auto iter = i->value_op_begin(); iter != i->value_op_end(); ++iter) {
-                Value *v = *iter;
-                if (!v) continue;
-                Function *f = dyn_cast<Function>(v);
-                if (!f) continue;
-                if (used.count(f)) continue;
-                next.insert(f);
-                assert(false && "needed");
+                Function *caller = i->getFunction();
+                if (!used.count(caller)) next.insert(caller);
             }
         }
-        // Also add the 
 
         if (next.empty()) break;
-        // errs() << "\tAdding " << next.size() << '\n';
-
         used.insert(next.begin(), next.end());
     }
 
-    list<Function*> toRemove;
-    
-    size_t nfn = 0;
-    for (Function &f : *dupMod_) {
-        nfn++;
-        if (!used.count(&f)) toRemove.push_back(&f);
-    }
-
-
-    // errs() << nfn << ", remove " << toRemove.size() << "!\n";
-
-    for (Function *f : toRemove) {
-        // Rather than actually removing the functions, we strip their
-        // contents.
-        f->deleteBody();
+    /**
+     * Rather than analyzing a copy of the module with the other bodies 
+     * deleted, the analysis just doesn't look at them.
+     */
+    ptmodel::Scope slice;
+    for (Function &f : module_) {
+        if (!f.isDeclaration() && !used.count(&f)) slice.hidden.insert(&f);
     }
 
-    errs() << "analysis start!\n";
+    errs() << "analysis start! (" << slice.hidden.size() << " bodies hidden)\n";
 
-    pmDesc_.reset(new PmDesc(*dupMod_));
+    pmDesc_.reset(new PmDesc(AliasInfo::create(module_, &slice)));
 
     errs() << "analysis done!\n";
 
     // Set values
-    for (auto &te : trace_.events()) {
+    for (const TraceEventView &te : trace_->events()) {
         for (auto *val : te.pmValues(mapper_)) {
-            Value *v = vMap_[val];
-            // errs() << "PMV: " << *v << "\n";
-            assert(v && "can't be nullptr!");
-            pmDesc_->addKnownPmValue(v);
-
-            // assert(pmDesc_->pointsToPm(v));
+            pmDesc_->addKnownPmValue(val);
         }    
     }
-
-    // errs() << "added pmv values!\n";
-    // errs() << pmDesc_->str() << "\n";
 }
 
 void BugFixer::runReducedAllocAA() {
-    dupMod_ = llvm::CloneModule(module_, vMap_);
+    // The stack never holds PM, so leave allocas out of the analysis.
+    ptmodel::Scope slice;
+    slice.noAllocas = true;
 
-    // Some standard sanity checking
-    for (Function &f : module_) {
-        for (BasicBlock &b : f) {
-            for (Instruction &i : b) {
-                assert(vMap_[&i] && "check");
-            }
-        }
-    }
-
-    std::list<AllocaInst*> toRemove;
-
-    for (Function &f : *dupMod_) {
-        for (BasicBlock &b : f) {
-            for (Instruction &i : b) {
-                auto *ai = dyn_cast<AllocaInst>(&i);
-                if (ai) toRemove.push_back(ai);
-            }
-        }
-    }
-
-    errs() << "removing " << toRemove.size() << " allocas\n";
-
-    for (auto *ai : toRemove) {
-        ai->eraseFromParent();
-    }
-
-    errs() << "erasure done!\n";
-
-    // Finally, do the analysis
-    pmDesc_.reset(new PmDesc(*dupMod_));
+    pmDesc_.reset(new PmDesc(AliasInfo::create(module_, &slice)));
 
     errs() << "analysis done!\n";
 
     // Set values
-    for (auto &te : trace_.events()) {
+    for (const TraceEventView &te : trace_->events()) {
         for (auto *val : te.pmValues(mapper_)) {
-            Value *v = vMap_[val];
-            // errs() << "PMV: " << *v << "\n";
-            assert(v && "can't be nullptr!");
-            pmDesc_->addKnownPmValue(v);
-
-            // assert(pmDesc_->pointsToPm(v));
+            pmDesc_->addKnownPmValue(val);
         }    
     }
 
@@ -1296,20 +1208,14 @@ void BugFixer::runReducedAllocAA() {
     errs() << pmDesc_->str() << "\n";
 }
 
-BugFixer::BugFixer(llvm::Module &m, TraceInfo &ti) 
-    : module_(m), trace_(ti), mapper_(BugLocationMapper::getInstance(m)), 
-      pmDesc_(nullptr), dupMod_(nullptr), summary_(SummaryFile.c_str()) {
-    for (const std::string &fnName : immutableFnNames_) {
-        addImmutableFunction(fnName);
-    }
-
-    for (const std::string &libName : immutableLibNames_) {
-        addImmutableModule(libName);
-    }
-
+void BugFixer::setupAliasAnalysis(void) {
     if (EnableHeuristicRaising) {
 
-        if (TraceAlias || ReducedAlias || EnableMmapAA) assert( (TraceAlias ^ ReducedAlias ^ EnableMmapAA) && "can't have both!");
+        assert((int)TraceAlias + (int)ReducedAlias + (int)EnableMmapAA <= 1 && 
+               "can't have both!");
+        if (EnableMmapAA) errs() << "Alias queries use PM provenance only!\n";
+        else if (DemandAlias) errs() << "Alias queries are demand-driven!\n";
+        else if (ParallelAlias || VerifyParallelAlias) errs() << "Alias analysis is solved in parallel!\n";
 
         if (TraceAlias) {
             errs() << "Running TraceAA!\n";
@@ -1321,10 +1227,10 @@ BugFixer::BugFixer(llvm::Module &m, TraceInfo &ti)
             if (EnableMmapAA) errs() << "Running MmapAA!\n";
             else errs() << "Running VanillaAA!\n";
 
-            pmDesc_.reset(new PmDesc(module_));
+            pmDesc_.reset(new PmDesc(ctx_.alias()));
 
             // Set values
-            for (auto &te : trace_.events()) {
+            for (const TraceEventView &te : trace_->events()) {
                 errs() << te.str() << "\n";
                 for (auto *val : te.pmValues(mapper_)) {
                     pmDesc_->addKnownPmValue(val);
@@ -1334,19 +1240,60 @@ BugFixer::BugFixer(llvm::Module &m, TraceInfo &ti)
         // errs() << "scoping\n";
     }
 
+    aliasReady_ = true;
+
     // errs() << "here?\n";
     // assert(false);
+}
+
+BugFixer::BugFixer(RepairContext &ctx, TraceInfo &ti) 
+    : module_(ctx.module()), ctx_(ctx), trace_(&ti), mapper_(ctx.mapper()), 
+      pmDesc_(nullptr), summary_(ctx.summaryFile().c_str()) {
+    for (const std::string &fnName : immutableFnNames_) {
+        addImmutableFunction(fnName);
+    }
+
+    for (const std::string &libName : immutableLibNames_) {
+        addImmutableModule(libName);
+    }
+
+    setupAliasAnalysis();
+}
 
-    // if (TraceAlias) {
-    //     for (Function &f : module_) {
-    //         for (BasicBlock &b : f) {
-    //             for (Instruction &i : b) {
-    //                 assert(vMap_[&i] && "check 2");
-    //             }
-    //         }
-    //     }
-    // }
+BugFixer::BugFixer(RepairContext &ctx, TraceInfoBuilder &builder) 
+    : module_(ctx.module()), ctx_(ctx), trace_(nullptr), mapper_(ctx.mapper()), 
+      pmDesc_(nullptr), summary_(ctx.summaryFile().c_str()) {
+    for (const std::string &fnName : immutableFnNames_) {
+        addImmutableFunction(fnName);
+    }
+
+    for (const std::string &libName : immutableLibNames_) {
+        addImmutableModule(libName);
+    }
 
+    /**
+     * Step 1 of doRepair happens here, as the bugs come in.
+     */
+    streamed_.reset(new TraceInfo(builder.stream(
+        [this] (TraceInfo &context, int bug_index) {
+            errs() << "Bug Index: " << nstreamed_ << "\n";
+            bool addedFix = computeAndAddFix(context, context[bug_index], 
+                                             bug_index);
+            if (addedFix) {
+                errs() << "\tAdded a fix!\n";
+            } else {
+                errs() << "\tDid not add a fix!\n";
+            }
+            nstreamed_++;
+        })));
+    trace_ = streamed_.get();
+
+    setupAliasAnalysis();
+
+    for (const FixDesc &desc : deferredRaises_) {
+        (void)raiseFixLocation(FixLoc::NullLoc(), desc);
+    }
+    deferredRaises_.clear();
 }
 
 void BugFixer::addImmutableFunction(const std::string &fnName) {
@@ -14,8 +14,7 @@
 #include "FixGenerator.hpp"
 #include "BugReports.hpp"
 #include "FlowAnalyzer.hpp"
-
-#include "llvm/Transforms/Utils/Cloning.h"
+#include "RepairContext.hpp"
 
 namespace pmfix {
 
@@ -29,18 +28,19 @@ namespace pmfix {
 class BugFixer final {
 private:
     llvm::Module &module_;
-    TraceInfo &trace_;
+    RepairContext &ctx_;
+    // Either the trace we were given, or streamed_.
+    TraceInfo *trace_;
+    // When streaming, only holds one event per site (see TraceInfoBuilder::stream).
+    std::unique_ptr<TraceInfo> streamed_;
+    size_t nstreamed_ = 0;
     BugLocationMapper &mapper_;
     std::unique_ptr<PmDesc> pmDesc_;
-    // For trimming
-    llvm::ValueToValueMapTy vMap_;
-    std::unique_ptr<llvm::Module> dupMod_;
     std::ofstream summary_;
     size_t summaryNum_ = 0;
 
-    std::unordered_map<LocationInfo,
-                       std::pair<std::unordered_set<const llvm::Value *>, 
-                                 std::unordered_set<const llvm::Value *>>,
+    // (volatile, PM) aliases of the stores at a location, as ids from pmDesc_.
+    std::unordered_map<LocationInfo, std::pair<PtsSet, PtsSet>,
                        LocationInfo::Hash> heuristicCache_;
 
     /**
@@ -132,6 +132,13 @@ private:
     // std::unordered_map<FixLoc, FixDesc, FixLoc::Hash> fixMap_;
     std::map<FixLoc, FixDesc, FixLoc::Compare> fixMap_;
 
+    /**
+     * Raising needs the alias analysis, which isn't set up until the whole
+     * trace has been seen. When streaming, forced raises wait here until then.
+     */
+    bool aliasReady_ = false;
+    std::list<FixDesc> deferredRaises_;
+
     /**
      * Utility to update the fix map. This provides basic fix coalescing (i.e.,
      * purely redundant fixes or upgrading fixes from flush/fence only to 
@@ -148,19 +155,22 @@ private:
     /**
      * Handle fix generation for a missing persist call.
      */
-    bool handleAssertPersisted(const TraceEvent &te, int bug_index);
+    bool handleAssertPersisted(TraceInfo &trace, const TraceEvent &te, 
+                               int bug_index);
 
     /**
      * Handle fix generation for a missing ordering call.
      * 
      * Since we cannot re-order stores, the only fix here is to insert a fence.
      */
-    bool handleAssertOrdered(const TraceEvent &te, int bug_index);
+    bool handleAssertOrdered(TraceInfo &trace, const TraceEvent &te, 
+                             int bug_index);
 
     /**
      * Handle fix generation for a redundant flush.
      */
-    bool handleRequiredFlush(const TraceEvent &te, int bug_index);
+    bool handleRequiredFlush(TraceInfo &trace, const TraceEvent &te, 
+                             int bug_index);
 
     /**
      * Iterate over the fix map and see if there's anywhere we can do some fixing.
@@ -181,6 +191,9 @@ private:
     bool patchMemoryPrimitives(FixGenerator *fixer);
 
     /**
+     * The trace is bug_index's trace: either the full trace or, when 
+     * streaming, just the bug's context (see TraceWindow::context).
+     * 
      * Figure out how to fix the given bug and add the fix to the map. Generally
      * will call a handler function based on the kind of fix that needs to be
      * applied after validating that the request is well-formed.
@@ -188,7 +201,8 @@ private:
      * Returns true if a new fix was added, false if an existing fix also fixes
      * the given bug. This is mostly used as debug information.
      */
-    bool computeAndAddFix(const TraceEvent &te, int bug_index);
+    bool computeAndAddFix(TraceInfo &trace, const TraceEvent &te, 
+                          int bug_index);
 
     /**
      * Run the fix generator to fix the specified bug.
@@ -197,18 +211,31 @@ private:
 
     /**
      * Run the trace alias analysis, which reduces the time spent in the alias
-     * analysis by removing functions which don't appear in the trace.
+     * analysis by ignoring the bodies of functions which don't appear in the 
+     * trace.
      */
     void runTraceAA(void);
 
     /**
      * Run the reduce alloc alias analysis, which reduces the time spent in the alias
-     * analysis by removing stack allocation sites.
+     * analysis by ignoring stack allocation sites.
      */
     void runReducedAllocAA(void);
 
+    /**
+     * Set up pmDesc_ (if heuristic raising is on) from the trace events.
+     */
+    void setupAliasAnalysis(void);
+
 public:
-    BugFixer(llvm::Module &m, TraceInfo &ti);
+    BugFixer(RepairContext &ctx, TraceInfo &ti);
+
+    /**
+     * Streaming version. Step 1 of doRepair (computing the initial fixes) is
+     * done here as the builder streams the bugs in, so the full trace never 
+     * has to be held in memory.
+     */
+    BugFixer(RepairContext &ctx, TraceInfoBuilder &builder);
 
     /**
      * Do the program repair!
@@ -1,9 +1,14 @@
 #include "BugReports.hpp"
+#include "BinaryTrace.hpp"
+#include "PmemcheckLog.hpp"
+#include "MapperCache.hpp"
 #include "PassUtils.hpp"
 
 #include <algorithm>
 #include <cctype>
 #include <iomanip>
+#include <mutex>
+#include <set>
 #include <sstream>
 #include <unistd.h>
 
@@ -12,6 +17,7 @@
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
 
 #include "llvm/Analysis/OrderedBasicBlock.h"
@@ -22,8 +28,13 @@ using namespace std;
 
 #pragma region AddressInfo
 
-bool AddressInfo::isSingleCacheLine(void) const {
+uint64_t AddressInfo::cacheLineSize(void) {
     static uint64_t cl_sz = (uint64_t)sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
+    return cl_sz;
+}
+
+bool AddressInfo::isSingleCacheLine(void) const {
+    uint64_t cl_sz = cacheLineSize();
     uint64_t cl_start = start() / cl_sz;
     uint64_t cl_end = end() / cl_sz;
     return cl_start == cl_end;
@@ -41,43 +52,51 @@ bool AddressInfo::operator==(const AddressInfo &other) const {
     return address == other.address && length == other.length;
 }
 
-bool AddressInfo::canAdd(const AddressInfo &other) const {
-    if (length == 0) {
-        assert(!address && "bad construction!");
-        return true;
-    }
+void AddressSet::add(const AddressInfo &ai) {
+    if (!ai.length) return;
+    uint64_t start = ai.start();
+    uint64_t end = ai.end();
 
-    // Combine ranges, ensure no gaps.
-    if (other.address < address) {
-       return other.end() + 1 >= address;
-    } else {
-       return end() + 1 >= other.address;
+    // Absorb everything that overlaps or is adjacent.
+    auto it = ranges_.upper_bound(start);
+    if (it != ranges_.begin()) {
+        auto prev = std::prev(it);
+        if (prev->second + 1 >= start) it = prev;
     }
-}
 
-void AddressInfo::operator+=(const AddressInfo &other) {
-    if (length == 0) {
-        assert(!address && "bad construction!");
-        address = other.address;
-        length = other.length;
-        return;
+    while (it != ranges_.end() && it->first <= end + 1) {
+        start = std::min(start, it->first);
+        end = std::max(end, it->second);
+        it = ranges_.erase(it);
     }
 
-    // Combine ranges, ensure no gaps.
-    if (other.address < address) {
-        assert(other.end() + 1 >= address && "bad range!");
-    } else {
-        if (end() + 1 < other.address) {
-            errs() << str() << " < " << other.str() << "\n";
-        }
-        assert(end() + 1 >= other.address && "bad range!");
-    }
+    ranges_[start] = end;
+}
 
-    uint64_t newAddress = std::min(other.address, address);
-    uint64_t newLength = std::max(other.end(), end()) + 1 - newAddress;
+bool AddressSet::contains(const AddressInfo &ai) const {
+    auto it = ranges_.upper_bound(ai.start());
+    if (it == ranges_.begin()) return false;
+    --it;
+    return it->second >= ai.end();
+}
 
-    address = newAddress;
-    length = newLength;
+bool AddressSet::overlaps(const AddressInfo &ai) const {
+    if (!ai.length) return false;
+    // The last interval starting before ai ends is the only candidate.
+    auto it = ranges_.upper_bound(ai.end());
+    if (it == ranges_.begin()) return false;
+    --it;
+    return it->second >= ai.start();
+}
+
+std::string AddressSet::str() const {
+    std::stringstream buffer;
+    buffer << "<AddressSet:";
+    for (const auto &p : ranges_) {
+        buffer << " [" << p.first << ", " << p.second << "]";
+    }
+    buffer << ">";
+    return buffer.str();
 }
 
 #pragma endregion
@@ -176,71 +195,77 @@ std::string FixLoc::str() const {
 
 #pragma region BugLocationMapper
 
-std::unique_ptr<BugLocationMapper> BugLocationMapper::instance(nullptr);
+cl::opt<std::string> MapperCacheDir("mapper-cache-dir", cl::init(""),
+    cl::desc("Directory to cache the source location index of modules in, "
+             "so repairing the same module again skips building it"));
 
-BugLocationMapper &BugLocationMapper::getInstance(Module &m) {
-    if (!instance) {
-        instance.reset(new BugLocationMapper(m));
-    }
+cl::opt<bool> LazyMapper("lazy-mapper", cl::init(false),
+    cl::desc("Only index the source locations of functions as they are looked "
+             "up, rather than all of them up front"));
 
-    return *instance;
-}
+BugLocationMapper::BugLocationMapper(Module &m) : m_(m) {
+    createSuffixIndex(m);
+
+    std::unique_ptr<MapperCache> cache;
+    if (!MapperCacheDir.empty()) {
+        cache.reset(new MapperCache(m, MapperCacheDir));
+        if (cache->load(*this)) {
+            errs() << "Loaded location index from " << cache->path() << "\n";
+            return;
+        }
+    }
 
-void BugLocationMapper::insertMapping(Instruction *i) {
-    // Essentially, need to get the line number and file name from the 
-    // instruction debug information.
-    if (!i->hasMetadata()) return;
-    if (!i->getMetadata("dbg")) return;
+    // A partial index isn't worth caching.
+    if (LazyMapper) {
+        lazy_ = true;
+        return;
+    }
 
-    if (DILocation *di = dyn_cast<DILocation>(i->getMetadata("dbg"))) {
-        LocationInfo li;
-        li.function = i->getFunction()->getName();
-        li.line = di->getLine();
-
-        DILocalScope *ls = di->getScope();
-        DIFile *df = ls->getFile();
-        li.file = df->getFilename();
-
-        // if ("memset_mov_sse2_empty" == li.function) {
-        //     errs() << "DBG: " << li.str() << " ===== " << *i << '\n';
-        // }
-
-        // Now, there may already be a mapping, but it should be the previous 
-        // instruction. They aren't guaranteed to be in the same basic block, 
-        // but everything should be in the right function context.
-        // if (locMap_.count(li)) {
-        //     if (locMap_[li]->getParent() != i->getParent()) {
-        //         errs() << "ERROR\n";
-        //         errs() << li.str() << '\n';
-        //         errs() << "Old: " << *locMap_[li] << "\n";
-        //         errs() << "New: " << *i << "\n";
-        //         errs() << "Context: " << *i->getFunction() << "\n";
-        //     }
-        //     assert(locMap_[li]->getParent() == i->getParent() && 
-        //            "Assumptions violated, instructions not in same basic block!");
-        // }
-        locMap_[li].push_back(i);
+    createMappings(m);
+    if (cache && cache->save(*this)) {
+        errs() << "Saved location index to " << cache->path() << "\n";
     }
 }
 
-void BugLocationMapper::createMappings(Module &m) {
-    for (Function &f : m) {
-        for (BasicBlock &b : f) {
-            for (Instruction &i : b) {
-                // Ignore instructions we don't care too much about.
-                // if (!isa<StoreInst>(&i) && !isa<CallBase>(&i)) continue;
-                // Turns out we DO care.
-                insertMapping(&i);
+void BugLocationMapper::indexFunction(Function &f) const {
+    // Locations include the function, so they are all new.
+    std::unordered_map<LocationInfo, 
+                       std::list<Instruction*>, 
+                       LocationInfo::Hash> locs;
+
+    for (BasicBlock &b : f) {
+        for (Instruction &i : b) {
+            // Ignore instructions we don't care too much about.
+            // if (!isa<StoreInst>(&i) && !isa<CallBase>(&i)) continue;
+            // Turns out we DO care.
+
+            // Essentially, need to get the line number and file name from the 
+            // instruction debug information.
+            if (!i.hasMetadata()) continue;
+            if (!i.getMetadata("dbg")) continue;
+
+            if (DILocation *di = dyn_cast<DILocation>(i.getMetadata("dbg"))) {
+                LocationInfo li;
+                li.function = f.getName();
+                li.line = di->getLine();
+
+                DILocalScope *ls = di->getScope();
+                DIFile *df = ls->getFile();
+                li.file = df->getFilename();
+
+                // Now, there may already be a mapping, but it should be the 
+                // previous instruction. They aren't guaranteed to be in the 
+                // same basic block, but everything should be in the right 
+                // function context.
+                locs[li].push_back(&i);
             }
         }
     }
 
-    assert(locMap_.size() && "no debug information found!!!");
-
     /**
      * Now, we do the fix mapping.
      */
-    for (auto &p : locMap_) {
+    for (auto &p : locs) {
         auto &location = p.first;
         auto &instructions = p.second;
 
@@ -256,7 +281,7 @@ void BugLocationMapper::createMappings(Module &m) {
             blocks[q->getParent()].push_back(q);
         }
 
-        std::list<FixLoc> locs;
+        std::list<FixLoc> fixLocs;
         for (auto &p : blocks) {
             auto &insts = p.second;
             assert(insts.size() && "wat");
@@ -271,34 +296,117 @@ void BugLocationMapper::createMappings(Module &m) {
                 if (obb.dominates(last, ii)) last = ii;
             }
 
-            locs.emplace_back(first, last, location);
+            fixLocs.emplace_back(first, last, location);
         }
 
-        fixLocMap_[location] = locs;
+        fixLocMap_[location] = sites_.size();
+        sites_.push_back(fixLocs);
+        locMap_[location] = std::move(instructions);
     }
 
-    // errs() << "fix map size: " << fixLocMap_.size() << "\n";
-    // const char fnHack[] = "do_slabs_free";
-    // errs() << *m.getFunction(fnHack) << "\n";
-    // for (auto &p : fixLocMap_) {
-    //     if (p.first.function == fnHack) {
-    //         errs() << p.first.str() << "\n";
-    //         for (FixLoc &fl : p.second) {
-    //             errs() << "\t" << fl.str() << "\n";
-    //         }
-    //     }
-    // }
-    // errs() << "inst map size " << locMap_.size() << "\n";
-    // for (auto &p : locMap_) {
-    //     if (p.first.function == fnHack) {
-    //         errs() << p.first.str() << "\n";
-    //     }
-    // }
-    // assert(false);
-    
+    indexed_.insert(&f);
+}
+
+void BugLocationMapper::createMappings(Module &m) {
+    for (Function &f : m) {
+        indexFunction(f);
+    }
+
+    assert(locMap_.size() && "no debug information found!!!");
     assert(!fixLocMap_.empty() && "wat");
 }
 
+void BugLocationMapper::createSuffixIndex(Module &m) {
+    for (Function &f : m) {
+        StringRef name = f.getName();
+        // Every prefix up to a dot, so "a.b.1" is found for both "a" and "a.b".
+        for (size_t pos = name.find('.'); pos != StringRef::npos && pos > 0;
+             pos = name.find('.', pos + 1)) {
+            suffixed_[name.substr(0, pos)].push_back(&f);
+        }
+    }
+}
+
+std::unique_lock<std::mutex> BugLocationMapper::lookup(
+    const std::string &function) const {
+
+    std::unique_lock<std::mutex> lock = lookup();
+    if (!lazy_) return lock;
+
+    Function *f = m_.getFunction(function);
+    if (f && !indexed_.count(f)) indexFunction(*f);
+    return lock;
+}
+
+void BugLocationMapper::indexFunctions(
+    const std::vector<std::string> &names) const {
+    if (!lazy_) return;
+
+    auto lock = lookup();
+    size_t before = indexed_.size();
+    for (const std::string &name : names) {
+        Function *f = m_.getFunction(name);
+        if (f && !indexed_.count(f)) indexFunction(*f);
+    }
+
+    errs() << "Indexed " << indexed_.size() - before << " more functions, "
+        << indexed_.size() << " of " << m_.size() << " so far\n";
+}
+
+const std::vector<Function*> &BugLocationMapper::suffixedFunctions(
+    StringRef name) const {
+    static const std::vector<Function*> none;
+    auto it = suffixed_.find(name);
+    return it == suffixed_.end() ? none : it->second;
+}
+
+#pragma endregion
+
+#pragma region TraceTables
+
+uint32_t TraceTables::internString(const std::string &s) {
+    auto it = stringIds_.find(s);
+    if (it != stringIds_.end()) return it->second;
+
+    uint32_t id = strings_.size();
+    strings_.push_back(s);
+    stringIds_.emplace(s, id);
+    return id;
+}
+
+LocId TraceTables::internLocation(const LocationInfo &li) {
+    auto it = locIds_.find(li);
+    if (it != locIds_.end()) return it->second;
+
+    LocId id = locs_.size();
+    Loc loc;
+    loc.function = internString(li.function);
+    loc.file = internString(li.file);
+    loc.line = li.line;
+    loc.site = mapper_.siteId(li);
+
+    locs_.push_back(loc);
+    locInfos_.push_back(li);
+    locIds_.emplace(li, id);
+    return id;
+}
+
+StackId TraceTables::internStack(const std::vector<LocId> &frames) {
+    auto it = stackIds_.find(frames);
+    if (it != stackIds_.end()) return it->second;
+
+    StackId id = stacks_.size();
+    stacks_.push_back(frames);
+
+    std::vector<LocationInfo> infos;
+    infos.reserve(frames.size());
+    for (LocId loc : frames) infos.push_back(locInfos_[loc]);
+    stackInfos_.push_back(std::move(infos));
+
+    stackIds_.emplace(frames, id);
+    return id;
+}
+
 #pragma endregion
 
 #pragma region TraceEvent
@@ -316,6 +424,18 @@ TraceEvent::Type TraceEvent::getType(string typeString) {
     return TraceEvent::INVALID;
 }
 
+const char *TraceEvent::typeName(Type type) {
+    switch (type) {
+        case STORE: return "STORE";
+        case FLUSH: return "FLUSH";
+        case FENCE: return "FENCE";
+        case ASSERT_PERSISTED: return "ASSERT_PERSISTED";
+        case ASSERT_ORDERED: return "ASSERT_ORDERED";
+        case REQUIRED_FLUSH: return "REQUIRED_FLUSH";
+        default: return "INVALID";
+    }
+}
+
 template< typename T >
 std::string int_to_hex( T i )
 {
@@ -330,8 +450,8 @@ std::string TraceEvent::str() const {
     std::stringstream buffer;
 
     buffer << "Event (time=" << timestamp << ")\n";
-    buffer << "\tType: " << typeString << '\n';
-    buffer << "\tLocation: " << location.str() << '\n';
+    buffer << "\tType: " << typeName(type) << '\n';
+    buffer << "\tLocation: " << location().str() << '\n';
     if (addresses.size()) {
         buffer << "\tAddress Info:\n";
         for (const auto &ai : addresses) {
@@ -341,7 +461,7 @@ std::string TraceEvent::str() const {
     }
     buffer << "\tCall Stack:\n";
     int i = 0;
-    for (const LocationInfo &li : callstack) {
+    for (const LocationInfo &li : callstack()) {
         buffer << "[" << i << "] " << li.str() << '\n';
         i++;
     }
@@ -350,17 +470,21 @@ std::string TraceEvent::str() const {
 }
 
 bool TraceEvent::callStacksEqual(const TraceEvent &a, const TraceEvent &b) {
-    if (a.callstack.size() != b.callstack.size()) {
+    assert(a.tables == b.tables && "events from different traces!");
+    if (a.stackId == b.stackId) return true;
+
+    const TraceTables &t = *a.tables;
+    const std::vector<LocId> &fa = t.frames(a.stackId);
+    const std::vector<LocId> &fb = t.frames(b.stackId);
+    if (fa.size() != fb.size()) {
         return false;
     }
 
-    for (int i = 0; i < a.callstack.size(); i++) {
-        const LocationInfo &la = a.callstack[i];
-        const LocationInfo &lb = b.callstack[i];
-        errs() << "\t\t" << la.str() << " ?= " << lb.str() << '\n';
-        if (la.function != lb.function) return false;
-        if (la.file != lb.file) return false;
-        if (i > 0 && la.line != lb.line) return false;
+    for (int i = 0; i < fa.size(); i++) {
+        if (fa[i] == fb[i]) continue;
+        if (t.functionId(fa[i]) != t.functionId(fb[i])) return false;
+        if (t.fileId(fa[i]) != t.fileId(fb[i])) return false;
+        if (i > 0 && t.line(fa[i]) != t.line(fb[i])) return false;
     }
 
     return true;
@@ -480,7 +604,7 @@ std::list<Value*> TraceEvent::pmValues(const BugLocationMapper &mapper) const {
     // }
     // assert(location == callstack[0] && "wat");
 
-    if (!mapper.contains(location)) return pmAddrs;
+    if (!mapper.contains(site())) return pmAddrs;
     if (type == FENCE || type == ASSERT_PERSISTED ||
         type == ASSERT_ORDERED || type == REQUIRED_FLUSH) return pmAddrs;
 
@@ -492,7 +616,7 @@ std::list<Value*> TraceEvent::pmValues(const BugLocationMapper &mapper) const {
     //     for (Instruction *i : fLoc.insts()) errs() << "\t" << *i << "\n";
     // }
 
-    for (auto &fLoc : mapper[location]) {
+    for (auto &fLoc : mapper[site()]) {
         // errs() << fLoc.str() << "\n";
         switch (source) {
             case PMTEST: {
@@ -563,6 +687,106 @@ std::list<Value*> TraceEvent::pmValues(const BugLocationMapper &mapper) const {
 
 #pragma endregion
 
+#pragma region TraceEventColumns
+
+void TraceEventColumns::push_back(const TraceEvent &te) {
+    uint8_t flags = te.isBug ? BUG : 0;
+    if (te.addresses.size()) flags |= HAS_ADDRESS;
+    if (te.addresses.size() > 1) flags |= MORE_ADDRESSES;
+
+    for (size_t j = 1; j < te.addresses.size(); ++j) {
+        extra_.emplace_back(size(), te.addresses[j]);
+    }
+
+    types_.push_back(te.type);
+    flags_.push_back(flags);
+    timestamps_.push_back(te.timestamp);
+    addresses_.push_back(te.addresses.size() ? te.addresses.front().address : 0);
+    lengths_.push_back(te.addresses.size() ? te.addresses.front().length : 0);
+    locations_.push_back(te.locationId);
+    stacks_.push_back(te.stackId);
+}
+
+void TraceEventColumns::append(const TraceEventColumns &other, size_t i) {
+    if (other.flags_[i] & MORE_ADDRESSES) {
+        auto range = other.extra(i);
+        for (auto *it = range.first; it != range.second; ++it) {
+            extra_.emplace_back(size(), it->second);
+        }
+    }
+
+    types_.push_back(other.types_[i]);
+    flags_.push_back(other.flags_[i]);
+    timestamps_.push_back(other.timestamps_[i]);
+    addresses_.push_back(other.addresses_[i]);
+    lengths_.push_back(other.lengths_[i]);
+    locations_.push_back(other.locations_[i]);
+    stacks_.push_back(other.stacks_[i]);
+}
+
+void TraceEventColumns::truncate(size_t n) {
+    types_.resize(n);
+    flags_.resize(n);
+    timestamps_.resize(n);
+    addresses_.resize(n);
+    lengths_.resize(n);
+    locations_.resize(n);
+    stacks_.resize(n);
+    while (!extra_.empty() && extra_.back().first >= n) extra_.pop_back();
+}
+
+std::pair<const std::pair<uint32_t, AddressInfo>*, 
+          const std::pair<uint32_t, AddressInfo>*> 
+TraceEventColumns::extra(size_t i) const {
+    auto lo = std::lower_bound(extra_.begin(), extra_.end(), i,
+        [] (const std::pair<uint32_t, AddressInfo> &e, size_t idx) { 
+            return e.first < idx; });
+    auto hi = lo;
+    while (hi != extra_.end() && hi->first == i) ++hi;
+    return std::make_pair(extra_.data() + (lo - extra_.begin()), 
+                          extra_.data() + (hi - extra_.begin()));
+}
+
+size_t TraceEventColumns::numAddresses(size_t i) const {
+    if (!(flags_[i] & HAS_ADDRESS)) return 0;
+    if (!(flags_[i] & MORE_ADDRESSES)) return 1;
+    auto range = extra(i);
+    return 1 + (range.second - range.first);
+}
+
+AddressInfo TraceEventColumns::address(size_t i, size_t j) const {
+    assert(j < numAddresses(i) && "event doesn't have that many addresses!");
+    AddressInfo ai;
+    if (!j) {
+        ai.address = addresses_[i];
+        ai.length = lengths_[i];
+    } else {
+        ai = extra(i).first[j - 1].second;
+    }
+    return ai;
+}
+
+#pragma endregion
+
+#pragma region TraceEventView
+
+TraceEvent TraceEventView::event(void) const {
+    TraceEvent te;
+    te.source = trace_->getSource();
+    te.type = type();
+    te.timestamp = timestamp();
+    for (size_t j = 0, n = numAddresses(); j < n; ++j) {
+        te.addresses.push_back(address(j));
+    }
+    te.isBug = isBug();
+    te.tables = &trace_->tables();
+    te.locationId = locationId();
+    te.stackId = stackId();
+    return te;
+}
+
+#pragma endregion
+
 #pragma region TraceInfo
 
 TraceInfo::TraceInfo(YAML::Node m) : meta_(m), source_(TraceEvent::UNKNOWN) {
@@ -574,19 +798,184 @@ TraceInfo::TraceInfo(YAML::Node m) : meta_(m), source_(TraceEvent::UNKNOWN) {
     }
 }
 
+cl::opt<unsigned> MaxRunPeriod("trace-max-run-period", cl::init(8),
+    cl::desc("Longest sequence of events that is stored as a run when it "
+             "repeats with fixed address strides (0 to not compress)"));
+
+namespace {
+
+/**
+ * What run detection compares, from either a new event or a stored one.
+ */
+struct RunKey {
+    TraceEvent::Type type;
+    bool isBug;
+    size_t numAddresses;
+    int64_t address;
+    uint64_t length;
+    uint64_t timestamp;
+    LocId locationId;
+    StackId stackId;
+
+    RunKey(const TraceEvent &te) 
+        : type(te.type), isBug(te.isBug), numAddresses(te.addresses.size()),
+          address(numAddresses ? te.addresses.front().address : 0),
+          length(numAddresses ? te.addresses.front().length : 0),
+          timestamp(te.timestamp), locationId(te.locationId), 
+          stackId(te.stackId) {}
+
+    RunKey(const TraceEventView &te) 
+        : type(te.type()), isBug(te.isBug()), numAddresses(te.numAddresses()),
+          address(numAddresses ? te.address().address : 0),
+          length(numAddresses ? te.address().length : 0),
+          timestamp(te.timestamp()), locationId(te.locationId()), 
+          stackId(te.stackId()) {}
+};
+
+/**
+ * True if b can be a later iteration of a in a run.
+ */
+bool sameOperation(const RunKey &a, const RunKey &b) {
+    if (a.isBug || b.isBug) return false;
+    if (a.type != b.type) return false;
+    if (a.stackId != b.stackId || a.locationId != b.locationId) return false;
+    if (a.numAddresses != b.numAddresses) return false;
+    if (a.numAddresses > 1) return false;
+    return a.length == b.length;
+}
+
+}
+
 void TraceInfo::addEvent(TraceEvent &&event) {
+    assert((!event.tables || event.tables == tables_.get()) && 
+           "event from another trace!");
+    assert(event.source == source_ && "event from another source!");
+    index_.reset();
+
     if (event.isBug) {
-        bugs_.push_back(events_.size());
+        bugs_.push_back(size_);
+    }
+
+    if (!appendToRun(event)) appendPlain(std::move(event));
+}
+
+void TraceInfo::appendPlain(TraceEvent &&event) {
+    if (!runs_.empty() && !runs_.back().repeats()) {
+        runs_.back().period++;
+        runs_.back().size++;
+    } else {
+        TraceRun run;
+        run.first = size_;
+        run.body = events_.size();
+        run.period = 1;
+        run.size = 1;
+        runs_.push_back(run);
+    }
+
+    events_.push_back(event);
+    strides_.emplace_back();
+    size_++;
+}
+
+TraceInfo TraceInfo::fromEvents(TraceEvent::Source source, 
+                                std::vector<TraceEvent> events,
+                                unsigned maxRunPeriod) {
+    TraceInfo ti(source);
+    ti.maxRunPeriod_ = (int)maxRunPeriod;
+    for (TraceEvent &te : events) ti.addEvent(std::move(te));
+    return ti;
+}
+
+bool TraceInfo::appendToRun(const TraceEvent &event) {
+    unsigned maxPeriod = maxRunPeriod_ < 0 ? MaxRunPeriod : maxRunPeriod_;
+    if (!maxPeriod || event.isBug || runs_.empty()) return false;
+
+    RunKey key(event);
+    TraceRun &last = runs_.back();
+    if (last.repeats()) {
+        size_t idx = last.body + last.size % last.period;
+        int64_t iter = last.size / last.period;
+        RunKey te(stored(idx));
+        const TraceStride &st = strides_[idx];
+        if (sameOperation(te, key) &&
+            te.address + st.address * iter == key.address &&
+            (int64_t)te.timestamp + st.timestamp * iter == (int64_t)key.timestamp) {
+            last.size++;
+            size_++;
+            return true;
+        }
+        // The run is over. New ones start from plain events.
+        return false;
     }
 
-    events_.emplace_back(event); 
+    // Are the last 2p - 1 plain events and this one two iterations of a loop?
+    for (uint32_t p = 1; p <= maxPeriod && 2 * p - 1 <= last.size; ++p) {
+        size_t base = events_.size() - (2 * p - 1);
+        auto second = [&] (uint32_t j) -> RunKey {
+            return j + p < 2 * p - 1 ? RunKey(stored(base + j + p)) : key;
+        };
+
+        bool match = true;
+        for (uint32_t j = 0; j < p && match; ++j) {
+            match = sameOperation(RunKey(stored(base + j)), second(j));
+        }
+        if (!match) continue;
+
+        for (uint32_t j = 0; j < p; ++j) {
+            RunKey a(stored(base + j));
+            RunKey b = second(j);
+            strides_[base + j].address = b.address - a.address;
+            strides_[base + j].timestamp = (int64_t)b.timestamp - (int64_t)a.timestamp;
+        }
+
+        // Only the first iteration stays stored.
+        events_.truncate(base + p);
+        strides_.erase(strides_.begin() + base + p, strides_.end());
+
+        TraceRun run;
+        run.first = size_ - (2 * p - 1);
+        run.body = base;
+        run.period = p;
+        run.size = 2 * p;
+
+        last.period -= 2 * p - 1;
+        last.size -= 2 * p - 1;
+        if (!last.size) runs_.pop_back();
+        runs_.push_back(run);
+
+        size_++;
+        return true;
+    }
+
+    return false;
+}
+
+TraceEventView TraceInfo::operator[](int i) const {
+    assert(i >= 0 && (uint64_t)i < size_ && "bad trace index!");
+    auto it = std::upper_bound(runs_.begin(), runs_.end(), (uint64_t)i,
+        [] (uint64_t idx, const TraceRun &run) { return idx < run.first; });
+    --it;
+    uint64_t off = i - it->first;
+    return stored(it->body + off % it->period, off / it->period);
+}
+
+const TraceAddressIndex &TraceInfo::addressIndex() const {
+    if (!index_) index_ = std::make_shared<TraceAddressIndex>(*this);
+    return *index_;
 }
 
 std::string TraceInfo::str(void) const {
     std::stringstream buffer;
 
-    for (const auto &event : events_) {
-        buffer << event.str() << '\n';
+    for (const TraceRun &run : runs_) {
+        for (uint32_t j = 0; j < run.period; ++j) {
+            buffer << stored(run.body + j).str();
+            if (run.repeats()) {
+                buffer << " x" << run.iterations(j) << " (stride " 
+                    << strides_[run.body + j].address << ")";
+            }
+            buffer << '\n';
+        }
     }
 
     return buffer.str();
@@ -594,33 +983,367 @@ std::string TraceInfo::str(void) const {
 
 #pragma endregion
 
+#pragma region TraceAddressIndex
+
+namespace {
+
+// Division rounding down/up, for a positive divisor.
+int64_t floorDiv(int64_t a, int64_t b) {
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+int64_t ceilDiv(int64_t a, int64_t b) {
+    return -floorDiv(-a, b);
+}
+
+}
+
+uint64_t TraceAddressIndex::RunFences::count(int64_t lo, int64_t hi) const {
+    lo = std::max<int64_t>(lo, 0);
+    hi = std::min<int64_t>(hi, run.size);
+    if (hi <= lo) return 0;
+
+    // Number of occurrences of slot j at offsets below x.
+    auto below = [this] (int64_t j, int64_t x) -> uint64_t {
+        return x > j ? (x - j + run.period - 1) / run.period : 0;
+    };
+
+    uint64_t n = 0;
+    for (uint32_t j : slots) n += below(j, hi) - below(j, lo);
+    return n;
+}
+
+uint64_t TraceAddressIndex::RunFences::total(void) const {
+    return count(0, run.size);
+}
+
+TraceAddressIndex::TraceAddressIndex(const TraceInfo &trace) {
+    const TraceEventColumns &events = trace.events_;
+    uint64_t clSize = AddressInfo::cacheLineSize();
+    uint64_t nfences = 0;
+
+    for (const TraceRun &run : trace.runs()) {
+        if (!run.repeats()) {
+            for (uint32_t k = 0; k < run.size; ++k) {
+                int i = run.first + k;
+                size_t idx = run.body + k;
+                TraceEvent::Type type = events.type(idx);
+                if (type == TraceEvent::FENCE) {
+                    fences_.push_back(i);
+                    continue;
+                }
+
+                if (type != TraceEvent::STORE && type != TraceEvent::FLUSH) continue;
+                if (!events.numAddresses(idx)) continue;
+
+                AddressInfo addr = events.address(idx);
+                if (!addr.length) continue;
+                for (uint64_t l = addr.start() / clSize; l <= addr.end() / clSize; ++l) {
+                    lines_[l].push_back(i);
+                }
+            }
+            continue;
+        }
+
+        RunFences rf;
+        rf.run = run;
+        rf.before = nfences;
+        for (uint32_t j = 0; j < run.period; ++j) {
+            size_t idx = run.body + j;
+            TraceEvent::Type type = events.type(idx);
+            if (type == TraceEvent::FENCE) {
+                rf.slots.push_back(j);
+                continue;
+            }
+
+            if (type != TraceEvent::STORE && type != TraceEvent::FLUSH) continue;
+            if (!events.numAddresses(idx)) continue;
+
+            AddressInfo addr = events.address(idx);
+            if (!addr.length) continue;
+
+            RunOp op;
+            op.first = run.first + j;
+            op.step = run.period;
+            op.count = run.iterations(j);
+            op.address = addr.address;
+            op.length = addr.length;
+            op.stride = trace.strides_[run.body + j].address;
+            int64_t last = op.address + op.stride * (int64_t)(op.count - 1);
+            op.lo = std::min(op.address, last);
+            op.hi = std::max(op.address, last) + op.length - 1;
+            runOps_.push_back(op);
+        }
+
+        if (!rf.slots.empty()) {
+            nfences += rf.total();
+            runFences_.push_back(rf);
+        }
+    }
+
+    std::sort(runOps_.begin(), runOps_.end(), 
+              [] (const RunOp &a, const RunOp &b) { return a.lo < b.lo; });
+    uint64_t maxHi = 0;
+    for (const RunOp &op : runOps_) {
+        maxHi = std::max(maxHi, op.hi);
+        runOpsMaxHi_.push_back(maxHi);
+    }
+}
+
+size_t TraceAddressIndex::fencesBetween(int after, int before) const {
+    if (before <= after + 1) return 0;
+    auto lo = std::upper_bound(fences_.begin(), fences_.end(), after);
+    auto hi = std::lower_bound(fences_.begin(), fences_.end(), before);
+    size_t n = hi > lo ? hi - lo : 0;
+
+    // Only the first and last overlapping runs can be partly outside.
+    int64_t from = (int64_t)after + 1;
+    int64_t to = before;
+    auto first = std::partition_point(runFences_.begin(), runFences_.end(),
+        [from] (const RunFences &rf) { return (int64_t)rf.run.end() <= from; });
+    auto last = std::partition_point(first, runFences_.end(),
+        [to] (const RunFences &rf) { return (int64_t)rf.run.first < to; });
+    if (first == last) return n;
+
+    auto partial = [from, to] (const RunFences &rf) {
+        return rf.count(from - (int64_t)rf.run.first, to - (int64_t)rf.run.first);
+    };
+
+    n += partial(*first);
+    if (last - first > 1) {
+        const RunFences &end = *(last - 1);
+        n += partial(end);
+        n += end.before - (first->before + first->total());
+    }
+
+    return n;
+}
+
+TraceAddressIndex::Walk TraceAddressIndex::walkBack(const AddressInfo &addr, 
+                                                    int before) const {
+    Walk w;
+    if (!addr.length) return w;
+
+    uint64_t clSize = AddressInfo::cacheLineSize();
+    auto begin = lines_.lower_bound(addr.start() / clSize);
+    auto end = lines_.upper_bound(addr.end() / clSize);
+    for (auto it = begin; it != end; ++it) {
+        const std::vector<int> &idx = it->second;
+        size_t pos = std::lower_bound(idx.begin(), idx.end(), before) - idx.begin();
+        if (pos) w.heads_.emplace_back(&idx, pos);
+    }
+
+    /**
+     * Run operations: only those starting at or before the end of addr can
+     * overlap it, and we can stop once none of the earlier ones reach addr.
+     */
+    int64_t x = addr.start();
+    int64_t y = addr.end();
+    size_t k = std::upper_bound(runOps_.begin(), runOps_.end(), addr.end(),
+        [] (uint64_t v, const RunOp &op) { return v < op.lo; }) - runOps_.begin();
+    while (k-- > 0 && runOpsMaxHi_[k] >= addr.start()) {
+        const RunOp &op = runOps_[k];
+        if (op.hi < addr.start()) continue;
+        if (before - 1 < op.first) continue;
+
+        // The occurrences [tLo, tHi] that overlap addr.
+        int64_t len = op.length;
+        int64_t tLo = 0;
+        int64_t tHi = op.count - 1;
+        if (op.stride > 0) {
+            tHi = std::min(tHi, floorDiv(y - op.address, op.stride));
+            tLo = std::max(tLo, ceilDiv(x - (len - 1) - op.address, op.stride));
+        } else if (op.stride < 0) {
+            tHi = std::min(tHi, floorDiv(op.address + len - 1 - x, -op.stride));
+            tLo = std::max(tLo, ceilDiv(op.address - y, -op.stride));
+        }
+        // ... and that come before the given index.
+        tHi = std::min(tHi, floorDiv(before - 1 - op.first, op.step));
+        if (tHi < tLo) continue;
+
+        Walk::Seq seq;
+        seq.next = op.first + tHi * op.step;
+        seq.step = op.step;
+        seq.left = tHi - tLo + 1;
+        w.seqs_.push_back(seq);
+    }
+
+    return w;
+}
+
+int TraceAddressIndex::Walk::next(void) {
+    int64_t best = -1;
+    for (auto &h : heads_) {
+        if (h.second) best = std::max<int64_t>(best, (*h.first)[h.second - 1]);
+    }
+    for (auto &s : seqs_) {
+        if (s.left) best = std::max(best, s.next);
+    }
+
+    if (best < 0) return -1;
+
+    // Advance every line that had it, so multi-line events come up once.
+    for (auto &h : heads_) {
+        if (h.second && (*h.first)[h.second - 1] == best) h.second--;
+    }
+    for (auto &s : seqs_) {
+        if (s.left && s.next == best) {
+            s.next -= s.step;
+            s.left--;
+        }
+    }
+
+    return best;
+}
+
+#pragma endregion
+
+#pragma region TraceWindow
+
+cl::opt<cl::boolOrDefault> PruneTrace("prune-trace",
+    cl::desc("Drop trace events that are irrelevant to every bug before "
+             "repairing, as parse-trace does (not done when streaming). By "
+             "default only raw pmemcheck logs, which parse-trace never saw, "
+             "are pruned"));
+
+cl::opt<unsigned> StreamLineHistory("stream-line-history", cl::init(0),
+    cl::desc("When streaming, the max number of operations kept per cache line "
+             "since its last flush (0 for unbounded, the default). Bugs that "
+             "need an evicted operation may get different fixes"));
+
+void TraceWindow::release(uint64_t idx) {
+    auto it = events_.find(idx);
+    assert(it != events_.end() && "releasing a dead event!");
+    if (--it->second.refs == 0) events_.erase(it);
+}
+
+void TraceWindow::add(TraceEvent &&te) {
+    uint64_t idx = index_++;
+
+    if (te.type == TraceEvent::FENCE) {
+        epoch_++;
+        return;
+    }
+
+    if (te.type != TraceEvent::STORE && te.type != TraceEvent::FLUSH) return;
+    if (te.addresses.empty() || !te.addresses.front().length) return;
+
+    const AddressInfo &addr = te.addresses.front();
+    uint64_t clSize = AddressInfo::cacheLineSize();
+    uint64_t first = addr.start() / clSize;
+    uint64_t last = addr.end() / clSize;
+
+    for (uint64_t line = first; line <= last; ++line) {
+        std::deque<uint64_t> &ops = lines_[line];
+
+        // A flush of the whole line stops every backward walk through this
+        // line, so nothing before it is reachable anymore, except by the
+        // REQUIRED_FLUSH handler. It looks past a redundant flush for the
+        // one before it, so the last flush before this one stays.
+        AddressInfo lineAddr;
+        lineAddr.address = line * clSize;
+        lineAddr.length = clSize;
+        if (te.type == TraceEvent::FLUSH && addr.contains(lineAddr)) {
+            auto prev = std::find_if(ops.rbegin(), ops.rend(), [&] (uint64_t i) {
+                return events_.at(i).event.type == TraceEvent::FLUSH;
+            });
+            uint64_t keep = prev != ops.rend() ? *prev : idx;
+            for (uint64_t old : ops) {
+                if (old != keep) release(old);
+            }
+            ops.clear();
+            if (keep != idx) ops.push_back(keep);
+        }
+
+        ops.push_back(idx);
+
+        if (StreamLineHistory && ops.size() > StreamLineHistory) {
+            errs() << "Warning: -stream-line-history dropped event " 
+                << ops.front() << " of cache line " << line 
+                << ", later bugs on the line may not see it\n";
+            release(ops.front());
+            ops.pop_front();
+        }
+    }
+
+    unsigned refs = (unsigned)(last - first + 1);
+    events_.emplace(idx, WindowEvent{std::move(te), epoch_, refs});
+    maxRetained_ = std::max(maxRetained_, events_.size());
+}
+
+TraceInfo TraceWindow::context(const TraceEvent &bug) const {
+    uint64_t clSize = AddressInfo::cacheLineSize();
+    std::set<uint64_t> reachable;
+
+    for (const AddressInfo &addr : bug.addresses) {
+        if (!addr.length) continue;
+        auto begin = lines_.lower_bound(addr.start() / clSize);
+        auto end = lines_.upper_bound(addr.end() / clSize);
+        for (auto it = begin; it != end; ++it) {
+            for (uint64_t idx : it->second) {
+                const TraceEvent &op = events_.at(idx).event;
+                if (op.addresses.front().overlaps(addr)) reachable.insert(idx);
+            }
+        }
+    }
+
+    TraceInfo ti(source_);
+    ti.tables_ = tables_;
+
+    // Fences aren't kept, so stand one in at the bug's location.
+    TraceEvent fence = bug;
+    fence.type = TraceEvent::FENCE;
+    fence.addresses.clear();
+    fence.isBug = false;
+
+    // Only whether there was a fence in between matters, not how many.
+    uint64_t epoch = 0;
+    for (uint64_t idx : reachable) {
+        const WindowEvent &we = events_.at(idx);
+        if (we.epoch > epoch) ti.addEvent(TraceEvent(fence));
+        epoch = we.epoch;
+        ti.addEvent(TraceEvent(we.event));
+    }
+    if (epoch_ > epoch) ti.addEvent(TraceEvent(fence));
+
+    ti.addEvent(TraceEvent(bug));
+
+    return ti;
+}
+
+#pragma endregion
+
 #pragma region TraceInfoBuilder
 
-void TraceInfoBuilder::processEvent(TraceInfo &ti, YAML::Node event) {
+TraceEvent TraceInfoBuilder::processEvent(TraceEvent::Source source, 
+                                          YAML::Node event) {
     TraceEvent e;
-    e.source = ti.getSource();
-    e.typeString = event["event"].as<string>();
-
-    TraceEvent::Type event_type = TraceEvent::getType(e.typeString);
+    e.source = source;
+    TraceEvent::Type event_type = TraceEvent::getType(event["event"].as<string>());
 
     assert(event_type != TraceEvent::INVALID);
     
     e.type = event_type;
     e.timestamp = event["timestamp"].as<uint64_t>();
-    e.location.function = event["function"].as<string>();
-    e.location.file = event["file"].as<string>();
-    e.location.line = event["line"].as<int64_t>();
+    LocationInfo location;
+    location.function = event["function"].as<string>();
+    location.file = event["file"].as<string>();
+    location.line = event["line"].as<int64_t>();
+    e.tables = tables_.get();
+    e.locationId = tables_->internLocation(location);
     e.isBug = event["is_bug"].as<bool>();
 
     assert(event["stack"].IsSequence() && "Don't know what to do!");
+    std::vector<LocId> frames;
     for (size_t i = 0; i < event["stack"].size(); ++i) {
         YAML::Node sf = event["stack"][i];
         LocationInfo li;
         li.function = sf["function"].as<string>();
         li.file = sf["file"].as<string>();
         li.line = sf["line"].as<int64_t>();
-        e.callstack.emplace_back(li);
+        frames.push_back(tables_->internLocation(li));
     }
+    e.stackId = tables_->internStack(frames);
 
     switch (e.type) {
         case TraceEvent::STORE:
@@ -650,14 +1373,60 @@ void TraceInfoBuilder::processEvent(TraceInfo &ti, YAML::Node event) {
     /**
      * Sanity checking.
      */
-    assert(e.callstack[0] == e.location);
+    assert(e.callstack()[0] == e.location());
 
-    ti.addEvent(std::move(e));
+    return e;
 }
 
 void TraceInfoBuilder::resolveLocations(TraceEvent &te) {
+    te.stackId = resolveStack(te.stackId);
+    // The location may have been renamed too.
+    te.locationId = tables_->frames(te.stackId)[0];
+}
+
+StackId TraceInfoBuilder::resolveStack(StackId id) {
+    auto it = resolved_.find(id);
+    if (it != resolved_.end()) return it->second;
+
+    return internResolved(id, resolveFrames(tables_->stack(id)));
+}
+
+void TraceInfoBuilder::resolveStacks(const std::vector<StackId> &ids) {
+    std::vector<StackId> todo;
+    std::unordered_set<StackId> seen;
+    for (StackId id : ids) {
+        if (resolved_.count(id) || !seen.insert(id).second) continue;
+        todo.push_back(id);
+    }
+
+    // In lazy mode, index every function of these stacks now, so the workers
+    // don't contend on indexing them.
+    std::vector<std::string> functions;
+    std::unordered_set<uint32_t> seenFunctions;
+    for (StackId id : todo) {
+        for (LocId loc : tables_->frames(id)) {
+            if (seenFunctions.insert(tables_->functionId(loc)).second) {
+                functions.push_back(tables_->location(loc).function);
+            }
+        }
+    }
+    mapper_.indexFunctions(functions);
 
-    std::vector<LocationInfo> &stack = te.callstack;
+    // Nothing is interned while the workers run, so the tables are stable.
+    std::vector<std::vector<LocationInfo>> results(todo.size());
+    utils::parallelFor(todo.size(), [&] (size_t i) {
+        results[i] = resolveFrames(tables_->stack(todo[i]));
+    });
+
+    for (size_t i = 0; i < todo.size(); ++i) {
+        internResolved(todo[i], results[i]);
+    }
+}
+
+static std::mutex resolveLogMutex;
+
+std::vector<LocationInfo> TraceInfoBuilder::resolveFrames(
+    std::vector<LocationInfo> stack) const {
 
     // [0] is the current location, which we use to set up the node itself.
     for (int i = stack.size() - 1; i >= 1; --i) {
@@ -697,7 +1466,7 @@ void TraceInfoBuilder::resolveLocations(TraceEvent &te) {
             // errs() << "START LOC: \n";
             // errs() << "\tFUNC NAME: "<< fLoc.insts().front()->getFunction()->getName() << "\n";
             for (Instruction *inst : fLoc.insts()) {
-                errs() << *inst << "\n";
+                // errs() << *inst << "\n";
                 if (auto *cb = dyn_cast<CallBase>(inst)) {
                     // errs() << *inst << "\n";
                     Function *f = cb->getCalledFunction();
@@ -725,6 +1494,7 @@ void TraceInfoBuilder::resolveLocations(TraceEvent &te) {
         }
 
         if (possibleCallSites.empty()) {
+            std::lock_guard<std::mutex> lock(resolveLogMutex);
             errs() << "No calls to " << callee.function << "!\n";
         }
 
@@ -755,18 +1525,19 @@ void TraceInfoBuilder::resolveLocations(TraceEvent &te) {
 
         Function *f = callInst->getCalledFunction();
         if (!f) {
-            errs() << "Try get function pointer function (" << callee.function << ")\n";
+            {
+                std::lock_guard<std::mutex> lock(resolveLogMutex);
+                errs() << "Try get function pointer function (" << callee.function << ")\n";
+            }
             f = mapper_.module().getFunction(callee.function);
             if (!f) {
-                std::list<Function*> fnCandidates;
-                for (Function &fn : mapper_.module()) {
-                    std::string fnName(fn.getName().data());
-                    if (fnName.find(callee.function) != std::string::npos) {
-                        // Skip false matches
-                        auto ending = fnName.substr(fnName.find(callee.function) + callee.function.size());
-                        if (ending[0] != '.') continue; // name mangling
-                        errs() << "\t\t--- " << fnName << "\n"; 
-                        fnCandidates.push_back(&fn);
+                // name mangling
+                const std::vector<Function*> &fnCandidates = 
+                    mapper_.suffixedFunctions(callee.function);
+                {
+                    std::lock_guard<std::mutex> lock(resolveLogMutex);
+                    for (Function *fn : fnCandidates) {
+                        errs() << "\t\t--- " << fn->getName() << "\n"; 
                     }
                 }
                 assert(fnCandidates.size() == 1 && "wat");
@@ -780,29 +1551,363 @@ void TraceInfoBuilder::resolveLocations(TraceEvent &te) {
         }
     }
 
-    /**
-     * Now, we set up arguments so we can call the other create() function.
-     */ 
+    return stack;
+}
+
+StackId TraceInfoBuilder::internResolved(
+    StackId id, const std::vector<LocationInfo> &stack) {
 
-    if (stack[0] != te.location) {
-        te.location = stack[0];
+    std::vector<LocId> frames;
+    for (const LocationInfo &li : stack) {
+        frames.push_back(tables_->internLocation(li));
     }
+
+    StackId res = tables_->internStack(frames);
+    resolved_[id] = res;
+    // Already resolved, so resolving again is a no-op.
+    resolved_[res] = res;
+    return res;
 }
 
-TraceInfo TraceInfoBuilder::build(void) {
-    TraceInfo ti(doc_["metadata"]);
+TraceEvent TraceInfoBuilder::processBinaryEvent(
+    TraceEvent::Source source, const BinaryEvent &event, 
+    const std::vector<LocId> &locations,
+    const std::vector<StackId> &stacks) {
+
+    TraceEvent e;
+    e.source = source;
+    e.type = (TraceEvent::Type)event.type;
+    assert(e.type > TraceEvent::INVALID && e.type <= TraceEvent::REQUIRED_FLUSH);
+    e.timestamp = event.timestamp;
+    e.isBug = event.isBug();
+    e.tables = tables_.get();
+    e.locationId = locations[event.location];
+    e.stackId = stacks[event.stack];
+
+    switch (e.type) {
+        case TraceEvent::STORE:
+        case TraceEvent::FLUSH:
+        case TraceEvent::ASSERT_PERSISTED:
+        case TraceEvent::REQUIRED_FLUSH: {
+            AddressInfo ai;
+            ai.address = event.address;
+            ai.length = event.length;
+            e.addresses.push_back(ai);
+            break;
+        }    
+        case TraceEvent::ASSERT_ORDERED: {
+            AddressInfo a, b;
+            a.address = event.address;
+            a.length = event.length;
+            b.address = event.addressB;
+            b.length = event.lengthB;
+            e.addresses.push_back(a);
+            e.addresses.push_back(b);
+            break;
+        } 
+        default:
+            break;
+    }
+
+    assert(e.callstack()[0] == e.location());
+
+    return e;
+}
+
+TraceEvent::Source TraceInfoBuilder::source(void) {
+    if (binary_) return binary_->source();
+    if (log_) return log_->source();
+
+    std::string src = doc_["metadata"]["source"].as<std::string>();
+    if ("PMTEST" == src) return TraceEvent::PMTEST;
+    if ("GENERIC" == src) return TraceEvent::GENERIC;
+    return TraceEvent::UNKNOWN;
+}
+
+void TraceInfoBuilder::forEachEvent(
+    TraceEvent::Source source, const std::function<void(TraceEvent &&)> &fn) {
+
+    if (binary_) return forEachRecord(*binary_, source, fn);
+    if (log_) return forEachRecord(*log_, source, fn);
 
     auto trace = doc_["trace"];
     assert(trace.IsSequence() && "Don't know what to do otherwise!");
     for (size_t i = 0; i < trace.size(); ++i) {
-        processEvent(ti, trace[i]);
+        fn(processEvent(source, trace[i]));
+    }
+}
+
+template<typename RecordFile>
+void TraceInfoBuilder::forEachRecord(
+    const RecordFile &file, TraceEvent::Source source, 
+    const std::function<void(TraceEvent &&)> &fn) {
+
+    // Intern the file's tables once; events only carry indices into them.
+    std::vector<LocId> locations;
+    locations.reserve(file.numLocations());
+    for (size_t i = 0; i < file.numLocations(); ++i) {
+        locations.push_back(tables_->internLocation(file.location(i)));
     }
 
-    for (size_t i = 0; i < ti.size(); ++i) {
-        resolveLocations(ti[i]);
+    std::vector<StackId> stacks;
+    stacks.reserve(file.numStacks());
+    for (size_t i = 0; i < file.numStacks(); ++i) {
+        std::vector<LocId> frames;
+        for (uint32_t loc : file.stack(i)) {
+            frames.push_back(locations[loc]);
+        }
+        stacks.push_back(tables_->internStack(frames));
     }
 
+    // The file gives us every stack up front, so resolve them all at once.
+    resolveStacks(stacks);
+
+    std::vector<BinaryEvent> scratch;
+    for (size_t b = 0; b < file.numBlocks(); ++b) {
+        for (const BinaryEvent &be : file.block(b, scratch)) {
+            fn(processBinaryEvent(source, be, locations, stacks));
+        }
+    }
+}
+
+TraceInfo TraceInfoBuilder::createTrace(void) {
+    TraceInfo ti = binary_ || log_ ? TraceInfo(source()) 
+                                   : TraceInfo(doc_["metadata"]);
+    ti.tables_ = tables_;
     return ti;
 }
 
+namespace {
+
+/**
+ * For deduplicating events by (type, call stack) when streaming or pruning.
+ */
+struct SiteHash {
+    size_t operator()(const TraceEvent &te) const {
+        return llvm::hash_combine(te.type, te.stackId);
+    }
+};
+
+struct SiteEqual {
+    bool operator()(const TraceEvent &a, const TraceEvent &b) const {
+        return a.type == b.type && a.stackId == b.stackId;
+    }
+};
+
+}
+
+TraceInfo TraceInfoBuilder::build(void) {
+    TraceInfo ti = createTrace();
+
+    forEachEvent(ti.getSource(), [&ti] (TraceEvent &&e) {
+        ti.addEvent(std::move(e));
+    });
+
+    TraceEventColumns &events = ti.events_;
+    std::vector<StackId> stacks;
+    stacks.reserve(events.size());
+    for (size_t i = 0; i < events.size(); ++i) stacks.push_back(events.stackId(i));
+    resolveStacks(stacks);
+
+    // Events repeated by runs share a stack, so resolve the stored ones only.
+    for (size_t i = 0; i < events.size(); ++i) {
+        StackId stack = resolveStack(events.stackId(i));
+        // The location may have been renamed too.
+        events.setLocation(i, tables_->frames(stack)[0], stack);
+    }
+
+    // parse-trace already pruned its YAML and binary traces.
+    bool pruneTrace = PruneTrace == cl::BOU_UNSET ? !!log_
+                                                  : PruneTrace == cl::BOU_TRUE;
+    if (pruneTrace) prune(ti);
+
+    return ti;
+}
+
+void TraceInfoBuilder::prune(TraceInfo &ti) {
+    const TraceEventColumns &events = ti.events_;
+    size_t orig = ti.size();
+    std::vector<bool> keep(events.size(), true);
+
+    /**
+     * Decisions are made per stored event, so a run keeps or drops all of 
+     * the repetitions of an operation together.
+     */
+
+    // Step 1: Remove bugs from redundant locations. (Bugs are never in runs.)
+    std::unordered_set<TraceEvent, SiteHash, SiteEqual> sites;
+    AddressSet bugAddrs;
+    for (size_t i = 0; i < events.size(); ++i) {
+        if (!events.isBug(i)) continue;
+        if (!sites.insert(ti.stored(i)).second) {
+            keep[i] = false;
+            continue;
+        }
+        for (size_t j = 0; j < events.numAddresses(i); ++j) {
+            bugAddrs.add(events.address(i, j));
+        }
+    }
+
+    // Step 2: Remove stores and flushes unrelated to any bug.
+    for (const TraceRun &run : ti.runs_) {
+        for (uint32_t j = 0; j < run.period; ++j) {
+            size_t i = run.body + j;
+            TraceEvent::Type type = events.type(i);
+            if (type != TraceEvent::STORE && type != TraceEvent::FLUSH) continue;
+
+            // Everything the run's repetitions of it touch.
+            AddressInfo span = events.address(i);
+            int64_t shift = ti.strides_[i].address * (int64_t)(run.iterations(j) - 1);
+            if (shift < 0) span.address += shift;
+            span.length += shift < 0 ? -shift : shift;
+
+            if (!bugAddrs.overlaps(span)) keep[i] = false;
+        }
+    }
+
+    /**
+     * Step 3: Remove repeated stores. A store to the same range as a later 
+     * one adds nothing to what the later one covers, as long as no flush or
+     * bug looks at the range in between. Runs are left alone, and nothing
+     * before one is considered redundant.
+     */
+    // address -> length -> latest store
+    std::map<uint64_t, std::map<uint64_t, size_t>> inFlight;
+    uint64_t maxLength = 0;
+    for (const TraceRun &run : ti.runs_) {
+        if (run.repeats()) {
+            inFlight.clear();
+            continue;
+        }
+
+        for (size_t i = run.body; i < run.body + run.period; ++i) {
+            TraceEvent::Type type = events.type(i);
+            if (!keep[i] || type == TraceEvent::FENCE) continue;
+
+            if (type == TraceEvent::STORE) {
+                AddressInfo ai = events.address(i);
+                auto res = inFlight[ai.address].insert({ai.length, i});
+                if (!res.second) {
+                    keep[res.first->second] = false;
+                    res.first->second = i;
+                }
+                maxLength = std::max(maxLength, ai.length);
+                continue;
+            }
+
+            // Flush or bug, so whatever overlaps is no longer redundant.
+            for (size_t j = 0; j < events.numAddresses(i); ++j) {
+                AddressInfo ai = events.address(i, j);
+                if (!ai.length) continue;
+                uint64_t from = ai.start() > maxLength ? ai.start() - maxLength : 0;
+                auto it = inFlight.lower_bound(from);
+                while (it != inFlight.end() && it->first <= ai.end()) {
+                    auto &byLength = it->second;
+                    for (auto jt = byLength.begin(); jt != byLength.end(); ) {
+                        AddressInfo stored;
+                        stored.address = it->first;
+                        stored.length = jt->first;
+                        jt = stored.overlaps(ai) ? byLength.erase(jt) : std::next(jt);
+                    }
+                    it = byLength.empty() ? inFlight.erase(it) : std::next(it);
+                }
+            }
+        }
+    }
+
+    // Step 4: Remove redundant fences. Bugs in between don't count.
+    bool lastWasFence = false;
+    for (const TraceRun &run : ti.runs_) {
+        if (run.repeats()) {
+            lastWasFence = false;
+            continue;
+        }
+
+        for (size_t i = run.body; i < run.body + run.period; ++i) {
+            if (!keep[i] || events.isBug(i)) continue;
+            bool isFence = events.type(i) == TraceEvent::FENCE;
+            if (isFence && lastWasFence) keep[i] = false;
+            lastWasFence = isFence;
+        }
+    }
+
+    /**
+     * Rebuild. Plain events go through addEvent() again, as pruning can turn
+     * them into runs.
+     */
+    TraceInfo out(ti.source_);
+    out.tables_ = ti.tables_;
+    out.meta_ = ti.meta_;
+    for (const TraceRun &run : ti.runs_) {
+        std::vector<uint32_t> slots;
+        uint64_t size = 0;
+        for (uint32_t j = 0; j < run.period; ++j) {
+            if (!keep[run.body + j]) continue;
+            slots.push_back(j);
+            size += run.iterations(j);
+        }
+
+        if (size > slots.size()) {
+            // Still repeats. The partial last iteration is still a prefix.
+            TraceRun pruned;
+            pruned.first = out.size_;
+            pruned.body = out.events_.size();
+            pruned.period = slots.size();
+            pruned.size = size;
+            for (uint32_t j : slots) {
+                out.events_.append(events, run.body + j);
+                out.strides_.push_back(ti.strides_[run.body + j]);
+            }
+            out.runs_.push_back(pruned);
+            out.size_ += size;
+            continue;
+        }
+
+        for (uint32_t j : slots) {
+            if (run.iterations(j)) out.addEvent(ti.stored(run.body + j).event());
+        }
+    }
+
+    errs() << "Pruned trace from " << orig << " to " << out.size() 
+        << " events (" << out.events_.size() << " stored, " << sites.size() 
+        << " distinct bugs)\n";
+
+    ti = std::move(out);
+}
+
+TraceInfo TraceInfoBuilder::stream(const BugHandler &handler) {
+    TraceInfo summary = createTrace();
+    TraceWindow window(summary.getSource(), tables_);
+    std::unordered_set<TraceEvent, SiteHash, SiteEqual> sites;
+
+    size_t nevents = 0;
+    size_t nbugs = 0;
+    forEachEvent(summary.getSource(), [&] (TraceEvent &&e) {
+        resolveLocations(e);
+
+        if (e.isBug) {
+            TraceInfo context = window.context(e);
+            handler(context, context.size() - 1);
+            nbugs++;
+        }
+
+        sites.insert(e);
+        window.add(std::move(e));
+        nevents++;
+    });
+
+    for (const TraceEvent &e : sites) {
+        TraceEvent rep = e;
+        // Bugs have already been handled.
+        rep.isBug = false;
+        summary.addEvent(std::move(rep));
+    }
+
+    errs() << "Streamed " << nevents << " events (" << nbugs << " bugs), " 
+        << sites.size() << " distinct sites, at most " << window.maxSize() 
+        << " events live\n";
+
+    return summary;
+}
+
 #pragma endregion
@@ -4,11 +4,21 @@
  */
 
 #include <cstdint>
+#include <deque>
+#include <functional>
 #include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/Function.h"
@@ -32,19 +42,15 @@ struct AddressInfo {
     uint64_t end(void) const { return address + length - 1llu; }
 
     // Methods for checking overlap with others/cache lines.
+    static uint64_t cacheLineSize(void);
     bool isSingleCacheLine(void) const;
     bool overlaps(const AddressInfo &other) const;
     // Returns true if this fully encompasses other.
     bool contains(const AddressInfo &other) const;
 
-    bool canAdd(const AddressInfo &other) const;
-
     // These are equal if the cache lines equal
     bool operator==(const AddressInfo &other) const;
 
-    void operator+=(const AddressInfo &other);
-
-
     std::string str() const {
         std::stringstream buffer;
         buffer << "<AddressInfo: addr=" << address << 
@@ -53,6 +59,29 @@ struct AddressInfo {
     }
 };
 
+/**
+ * A set of byte ranges, kept as disjoint, non-adjacent intervals. Used for 
+ * accumulating partial stores until they cover some address range.
+ */
+class AddressSet {
+private:
+    // start -> end, both inclusive.
+    std::map<uint64_t, uint64_t> ranges_;
+
+public:
+    void add(const AddressInfo &ai);
+
+    // True if a single interval of the set covers all of ai.
+    bool contains(const AddressInfo &ai) const;
+
+    // True if any byte of ai is in the set.
+    bool overlaps(const AddressInfo &ai) const;
+
+    bool empty(void) const { return ranges_.empty(); }
+
+    std::string str() const;
+};
+
 /**
  * Just a wrapper for source code location information.
  */
@@ -65,13 +94,27 @@ struct LocationInfo {
     // Returns just the file name, trims directory information.
     std::string getFilename(void) const;
 
+    // Same, without the copy.
+    llvm::StringRef filenameRef(void) const {
+        llvm::StringRef f(file);
+        size_t pos = f.find_last_of('/');
+        return pos == llvm::StringRef::npos ? f : f.substr(pos + 1);
+    }
+
     struct Hash {
         // We only want to hash the last part of the file to avoid 
         // hash issues when the directories differ.
         uint64_t operator()(const LocationInfo &li) const {
-            return std::hash<std::string>{}(li.function) ^
-                   std::hash<std::string>{}(li.getFilename()) ^ 
-                   std::hash<int64_t>{}(li.line);
+            return llvm::hash_combine(llvm::StringRef(li.function), 
+                                      li.filenameRef(), li.line);
+        }
+    };
+
+    // Unlike operator==, the file names have to match exactly.
+    struct ExactEqual {
+        bool operator()(const LocationInfo &a, const LocationInfo &b) const {
+            return a.line == b.line && a.function == b.function && 
+                   a.file == b.file;
         }
     };
 
@@ -140,44 +183,191 @@ private:
 
     llvm::Module &m_;
 
-    std::unordered_map<LocationInfo, 
-                       std::list<llvm::Instruction*>, 
-                       LocationInfo::Hash> locMap_;
+    /**
+     * The tables below are filled in a function at a time in lazy mode 
+     * (-lazy-mapper), which happens from the const lookups, so they are 
+     * mutable. Sites are in a deque so that references to them stay valid 
+     * as more functions are indexed.
+     */
+
+    mutable std::unordered_map<LocationInfo, 
+                               std::list<llvm::Instruction*>, 
+                               LocationInfo::Hash> locMap_;
     
-    std::unordered_map<LocationInfo, 
-                       std::list<FixLoc>, 
-                       LocationInfo::Hash> fixLocMap_;
+    // Source location -> site id, which indexes sites_. The ids are dense so
+    // that the trace can resolve each of its locations once and then only 
+    // deal in integers (see TraceTables).
+    mutable std::unordered_map<LocationInfo, int, LocationInfo::Hash> fixLocMap_;
+    mutable std::deque<std::list<FixLoc>> sites_;
+
+    // Lazy mode: the functions indexed so far. The trace builder looks up 
+    // locations from its workers, so lookups take the mutex in lazy mode.
+    bool lazy_ = false;
+    mutable std::unordered_set<const llvm::Function*> indexed_;
+    mutable std::mutex lazyMutex_;
+
+    // name -> functions named name.NNN, which is how LLVM renames local
+    // functions on a name clash when linking.
+    llvm::StringMap<std::vector<llvm::Function*>> suffixed_;
 
-    void insertMapping(llvm::Instruction *i);
+    void indexFunction(llvm::Function &f) const;
 
     void createMappings(llvm::Module &m);
 
-    static std::unique_ptr<BugLocationMapper> instance;
+    void createSuffixIndex(llvm::Module &m);
 
-    BugLocationMapper(llvm::Module &m) : m_(m) { createMappings(m); }
+    /**
+     * Call before looking up a location of the given function. In lazy mode,
+     * this locks the tables and indexes the function if it hasn't been yet.
+     */
+    std::unique_lock<std::mutex> lookup(const std::string &function) const;
+
+    std::unique_lock<std::mutex> lookup(void) const {
+        return lazy_ ? std::unique_lock<std::mutex>(lazyMutex_) 
+                     : std::unique_lock<std::mutex>();
+    }
+
+    // Can fill in the mappings from disk (-mapper-cache-dir).
+    friend class MapperCache;
 
     BugLocationMapper(const BugLocationMapper &) = delete;
 
 public:
-    
-    static BugLocationMapper &getInstance(llvm::Module &m);
 
-    const std::list<FixLoc> &operator[](const LocationInfo &li) const 
-        { return fixLocMap_.at(li); }
+    /**
+     * Indexes the module (or, with -lazy-mapper, gets ready to). There is one
+     * mapper per module being repaired, owned by its RepairContext.
+     */
+    BugLocationMapper(llvm::Module &m);
+
+    static const int NO_SITE = -1;
 
-    bool contains(const LocationInfo &li) const 
-        { return fixLocMap_.count(li); }
+    const std::list<FixLoc> &operator[](const LocationInfo &li) const {
+        auto lock = lookup(li.function);
+        return sites_[fixLocMap_.at(li)]; 
+    }
 
-    const std::list<llvm::Instruction*> &insts(const LocationInfo &li) const 
-        { return locMap_.at(li); }
+    const std::list<FixLoc> &operator[](int site) const {
+        auto lock = lookup();
+        return sites_[site]; 
+    }
+
+    bool contains(const LocationInfo &li) const {
+        auto lock = lookup(li.function);
+        return fixLocMap_.count(li); 
+    }
 
-    bool instsContains(const LocationInfo &li) const 
-        { return fixLocMap_.count(li); }
+    bool contains(int site) const { return site != NO_SITE; }
+
+    /**
+     * Returns the site id of the location, or NO_SITE.
+     */
+    int siteId(const LocationInfo &li) const {
+        auto lock = lookup(li.function);
+        auto it = fixLocMap_.find(li);
+        return it == fixLocMap_.end() ? NO_SITE : it->second;
+    }
+
+    const std::list<llvm::Instruction*> &insts(const LocationInfo &li) const {
+        auto lock = lookup(li.function);
+        return locMap_.at(li); 
+    }
+
+    bool instsContains(const LocationInfo &li) const {
+        auto lock = lookup(li.function);
+        return fixLocMap_.count(li); 
+    }
+
+    /**
+     * In lazy mode, index the given functions now. The trace builder does
+     * this with every function in the trace before looking anything up.
+     */
+    void indexFunctions(const std::vector<std::string> &names) const;
+
+    /**
+     * Functions named name.NNN (see suffixed_).
+     */
+    const std::vector<llvm::Function*> &suffixedFunctions(
+        llvm::StringRef name) const;
 
     llvm::Module &module() const { return m_; }
 
 };
 
+typedef uint32_t LocId;
+typedef uint32_t StackId;
+
+/**
+ * Interned source locations and call stacks for a trace.
+ * 
+ * Traces repeat the same few hundred stacks millions of times, so events just
+ * hold ids into these tables. Each distinct location is also resolved against
+ * the BugLocationMapper once, when it is interned.
+ */
+class TraceTables {
+private:
+    struct Loc {
+        uint32_t function;
+        uint32_t file;
+        int64_t line;
+        int site;
+    };
+
+    struct FramesHash {
+        size_t operator()(const std::vector<LocId> &frames) const {
+            return llvm::hash_combine_range(frames.begin(), frames.end());
+        }
+    };
+
+    const BugLocationMapper &mapper_;
+
+    std::vector<std::string> strings_;
+    std::unordered_map<std::string, uint32_t> stringIds_;
+
+    std::vector<Loc> locs_;
+    std::vector<LocationInfo> locInfos_;
+    std::unordered_map<LocationInfo, LocId, LocationInfo::Hash, 
+                       LocationInfo::ExactEqual> locIds_;
+
+    std::vector<std::vector<LocId>> stacks_;
+    std::vector<std::vector<LocationInfo>> stackInfos_;
+    std::unordered_map<std::vector<LocId>, StackId, FramesHash> stackIds_;
+
+    uint32_t internString(const std::string &s);
+
+public:
+    TraceTables(const BugLocationMapper &mapper) : mapper_(mapper) {}
+
+    LocId internLocation(const LocationInfo &li);
+
+    StackId internStack(const std::vector<LocId> &frames);
+
+    const LocationInfo &location(LocId id) const { return locInfos_[id]; }
+
+    /**
+     * Innermost frame first.
+     */
+    const std::vector<LocId> &frames(StackId id) const { return stacks_[id]; }
+
+    const std::vector<LocationInfo> &stack(StackId id) const 
+        { return stackInfos_[id]; }
+
+    uint32_t functionId(LocId id) const { return locs_[id].function; }
+
+    uint32_t fileId(LocId id) const { return locs_[id].file; }
+
+    int64_t line(LocId id) const { return locs_[id].line; }
+
+    /**
+     * The mapper site of the location (BugLocationMapper::NO_SITE if none).
+     */
+    int site(LocId id) const { return locs_[id].site; }
+
+    size_t numLocations(void) const { return locs_.size(); }
+
+    size_t numStacks(void) const { return stacks_.size(); }
+};
+
 struct TraceEvent {
     /**
      * The type of event, i.e. the kind of operation.
@@ -197,17 +387,27 @@ struct TraceEvent {
 
     static Type getType(std::string typeString);
 
+    static const char *typeName(Type type);
+
     // Event data.
     Source source;
     Type type;
     uint64_t timestamp;
-    std::vector<AddressInfo> addresses;
-    LocationInfo location;
+    // Only ASSERT_ORDERED has more than one.
+    llvm::SmallVector<AddressInfo, 2> addresses;
     bool isBug;
-    std::vector<LocationInfo> callstack;
+    // Interned location and call stack (see TraceTables).
+    const TraceTables *tables = nullptr;
+    LocId locationId;
+    StackId stackId;
+
+    const LocationInfo &location(void) const 
+        { return tables->location(locationId); }
 
-    // Debug
-    std::string typeString;
+    const std::vector<LocationInfo> &callstack(void) const 
+        { return tables->stack(stackId); }
+
+    int site(void) const { return tables->site(locationId); }
 
     // Helper
 
@@ -228,17 +428,287 @@ struct TraceEvent {
 };
 
 
+/**
+ * A stretch of a trace, stored compactly. Only the first `period` events of
+ * the stretch are stored; event o of the stretch is stored event 
+ * body + o % period, with its address and timestamp moved forward 
+ * o / period times by that event's stride. So loops that do the same thing to
+ * the next element every iteration take the space of one iteration.
+ * 
+ * A stretch no longer than its period does not repeat, it's just a block of
+ * plain events.
+ */
+struct TraceRun {
+    // Index (in the whole trace) of the first event.
+    uint64_t first;
+    // Index of the first stored event.
+    uint32_t body;
+    uint32_t period;
+    // Number of events in the stretch. The last iteration may be partial.
+    uint64_t size;
+
+    bool repeats(void) const { return size > period; }
+
+    uint64_t end(void) const { return first + size; }
+
+    // Number of times the j-th event of the body occurs.
+    uint64_t iterations(uint32_t j) const {
+        return j < size ? (size - j + period - 1) / period : 0;
+    }
+};
+
+/**
+ * How far a stored event moves every iteration of its run.
+ */
+struct TraceStride {
+    int64_t address = 0;
+    int64_t timestamp = 0;
+};
+
+/**
+ * The stored events of a trace, one dense array per field. The bug handlers
+ * scan a lot of events but only look at their types and first addresses, so
+ * those are kept apart from the rest. The source and tables are the same for
+ * the whole trace, so they aren't stored per event.
+ * 
+ * Only ASSERT_ORDERED events have more than one address; the others are kept
+ * in a small side table.
+ */
+class TraceEventColumns {
+private:
+    enum Flags : uint8_t {
+        BUG = 1,
+        HAS_ADDRESS = 2,
+        // Has addresses in extra_.
+        MORE_ADDRESSES = 4
+    };
+
+    std::vector<int8_t> types_;
+    std::vector<uint8_t> flags_;
+    std::vector<uint64_t> timestamps_;
+    // First address of each event, if it has one.
+    std::vector<uint64_t> addresses_;
+    std::vector<uint64_t> lengths_;
+    std::vector<LocId> locations_;
+    std::vector<StackId> stacks_;
+    // (event, address) for the addresses after the first, sorted by event.
+    std::vector<std::pair<uint32_t, AddressInfo>> extra_;
+
+    std::pair<const std::pair<uint32_t, AddressInfo>*, 
+              const std::pair<uint32_t, AddressInfo>*> extra(size_t i) const;
+
+public:
+    void push_back(const TraceEvent &te);
+
+    /**
+     * Append the i-th event of another trace.
+     */
+    void append(const TraceEventColumns &other, size_t i);
+
+    /**
+     * Drop every event from the n-th on.
+     */
+    void truncate(size_t n);
+
+    size_t size(void) const { return types_.size(); }
+
+    TraceEvent::Type type(size_t i) const 
+        { return (TraceEvent::Type)types_[i]; }
+
+    uint64_t timestamp(size_t i) const { return timestamps_[i]; }
+
+    bool isBug(size_t i) const { return flags_[i] & BUG; }
+
+    size_t numAddresses(size_t i) const;
+
+    /**
+     * The j-th address of the i-th event.
+     */
+    AddressInfo address(size_t i, size_t j = 0) const;
+
+    LocId locationId(size_t i) const { return locations_[i]; }
+
+    StackId stackId(size_t i) const { return stacks_[i]; }
+
+    void setLocation(size_t i, LocId location, StackId stack) {
+        locations_[i] = location;
+        stacks_[i] = stack;
+    }
+};
+
+class TraceInfo;
+
+/**
+ * One event of a trace, read in place from the trace's columns. Only valid
+ * while the trace is. Converts to a TraceEvent where a full copy is needed.
+ */
+class TraceEventView {
+private:
+    const TraceInfo *trace_;
+    // Stored event, and which iteration of its run.
+    uint32_t idx_;
+    uint64_t iteration_;
+
+public:
+    TraceEventView(const TraceInfo &trace, uint32_t idx, uint64_t iteration)
+        : trace_(&trace), idx_(idx), iteration_(iteration) {}
+
+    inline TraceEvent::Type type(void) const;
+
+    inline uint64_t timestamp(void) const;
+
+    inline bool isBug(void) const;
+
+    inline size_t numAddresses(void) const;
+
+    /**
+     * The j-th address. Must have one.
+     */
+    inline AddressInfo address(size_t j = 0) const;
+
+    inline LocId locationId(void) const;
+
+    inline StackId stackId(void) const;
+
+    inline const LocationInfo &location(void) const;
+
+    inline const std::vector<LocationInfo> &callstack(void) const;
+
+    inline int site(void) const;
+
+    bool isOperation(void) const { 
+        TraceEvent::Type t = type();
+        return t == TraceEvent::STORE || t == TraceEvent::FLUSH || 
+               t == TraceEvent::FENCE;
+    }
+
+    bool isAssertion(void) const { 
+        TraceEvent::Type t = type();
+        return t == TraceEvent::ASSERT_PERSISTED || 
+               t == TraceEvent::ASSERT_ORDERED || 
+               t == TraceEvent::REQUIRED_FLUSH;
+    }
+
+    TraceEvent event(void) const;
+
+    operator TraceEvent() const { return event(); }
+
+    std::string str() const { return event().str(); }
+
+    std::list<llvm::Value*> pmValues(const BugLocationMapper &mapper) const 
+        { return event().pmValues(mapper); }
+};
+
+/**
+ * Index of a trace's stores and flushes by cache line, plus where the fences
+ * are. Lets the bug handlers find the overlapping operations before a bug 
+ * without scanning the whole trace backward.
+ * 
+ * Runs are not expanded: each stored event of a run is kept as an arithmetic
+ * sequence, and the overlapping iterations are computed on demand.
+ */
+class TraceAddressIndex {
+private:
+    // cache line -> indices of plain stores/flushes touching it, ascending.
+    std::map<uint64_t, std::vector<int>> lines_;
+    // Indices of all plain fences, ascending.
+    std::vector<int> fences_;
+
+    // A store or flush repeated by a run.
+    struct RunOp {
+        // Index of the first occurrence, and distance between occurrences.
+        int64_t first;
+        int64_t step;
+        uint64_t count;
+        // First occurrence's address, and how far it moves each time.
+        int64_t address;
+        uint64_t length;
+        int64_t stride;
+        // Lowest and highest byte touched over all the occurrences.
+        uint64_t lo, hi;
+    };
+    // Sorted by lo.
+    std::vector<RunOp> runOps_;
+    // Max hi over runOps_[0..i].
+    std::vector<uint64_t> runOpsMaxHi_;
+
+    // Fences repeated by a run.
+    struct RunFences {
+        TraceRun run;
+        // Positions of the fences in the run body.
+        std::vector<uint32_t> slots;
+        // Number of fences in the runs before this one.
+        uint64_t before;
+
+        uint64_t total(void) const;
+        // Number of the fences at offsets [lo, hi) of the run.
+        uint64_t count(int64_t lo, int64_t hi) const;
+    };
+    // In trace order.
+    std::vector<RunFences> runFences_;
+
+public:
+    TraceAddressIndex(const TraceInfo &trace);
+
+    /**
+     * Number of fences strictly between the two indices.
+     */
+    size_t fencesBetween(int after, int before) const;
+
+    /**
+     * Walks the stores and flushes on the cache lines of an address range 
+     * backward from some index. Events on several of the lines are only 
+     * returned once. The caller still has to check the exact overlap.
+     */
+    class Walk {
+    private:
+        friend class TraceAddressIndex;
+        // (line indices, next position to look at + 1)
+        std::vector<std::pair<const std::vector<int>*, size_t>> heads_;
+        // Overlapping occurrences of run operations: next index (counting 
+        // down), step, and how many are left.
+        struct Seq {
+            int64_t next;
+            int64_t step;
+            uint64_t left;
+        };
+        std::vector<Seq> seqs_;
+
+    public:
+        /**
+         * The next earlier event index, or -1 when done.
+         */
+        int next(void);
+    };
+
+    Walk walkBack(const AddressInfo &addr, int before) const;
+};
+
 class TraceInfo {
 private:
     friend class TraceInfoBuilder;
+    friend class TraceWindow;
+    friend class TraceAddressIndex;
+    friend class TraceEventView;
 
     // Trace data.
+    // -- interned locations and stacks, shared by every trace from a builder
+    std::shared_ptr<TraceTables> tables_;
     // -- indices where bugs live
     std::list<int> bugs_; 
-    // -- the actual events
-    std::vector<TraceEvent> events_;
+    // -- the stored events (see TraceRun), and their strides
+    TraceEventColumns events_;
+    std::vector<TraceStride> strides_;
+    // -- how the stored events make up the trace, in order
+    std::vector<TraceRun> runs_;
+    // -- number of events in the trace
+    uint64_t size_ = 0;
     // -- the source of the trace
     TraceEvent::Source source_;
+    // -- built on first use
+    mutable std::shared_ptr<TraceAddressIndex> index_;
+    // -- longest run period, or -1 for -trace-max-run-period
+    int maxRunPeriod_ = -1;
 
     // Metadata. For stuff like which fix generator to use.
     YAML::Node meta_;
@@ -248,20 +718,84 @@ private:
 
     void addEvent(TraceEvent &&event);
 
+    /**
+     * Append to the trace as a plain event.
+     */
+    void appendPlain(TraceEvent &&event);
+
+    /**
+     * Try to add the event to a run, either by continuing the last run or by
+     * starting a new one out of the last few plain events. Returns false if
+     * it doesn't fit in one.
+     */
+    bool appendToRun(const TraceEvent &event);
+
+    /**
+     * The stored event at the given iteration of its run.
+     */
+    TraceEventView stored(size_t idx, uint64_t iteration = 0) const
+        { return TraceEventView(*this, idx, iteration); }
+
     TraceInfo(YAML::Node m);
 
+    TraceInfo(TraceEvent::Source source) : source_(source) {}
+
 public:
 
-    const TraceEvent &operator[](int i) const { return events_[i]; }
-    TraceEvent &operator[](int i) { return events_[i]; }
+    /**
+     * Events are read from their run's stored event.
+     */
+    TraceEventView operator[](int i) const;
 
     const std::list<int> &bugs() const { return bugs_; }
 
-    const std::vector<TraceEvent> &events() const { return events_; }
+    /**
+     * A trace of just the given events, for tools and tests. maxRunPeriod
+     * is used instead of -trace-max-run-period; with 0, every event is 
+     * stored as is.
+     */
+    static TraceInfo fromEvents(TraceEvent::Source source,
+                                std::vector<TraceEvent> events,
+                                unsigned maxRunPeriod);
+
+    class StoredEvents {
+    private:
+        const TraceInfo &trace_;
+
+    public:
+        class iterator {
+        private:
+            const TraceInfo *trace_;
+            uint32_t idx_;
+
+        public:
+            iterator(const TraceInfo &trace, uint32_t idx) 
+                : trace_(&trace), idx_(idx) {}
+
+            TraceEventView operator*() const { return trace_->stored(idx_); }
+            iterator &operator++() { ++idx_; return *this; }
+            bool operator!=(const iterator &other) const 
+                { return idx_ != other.idx_; }
+        };
+
+        StoredEvents(const TraceInfo &trace) : trace_(trace) {}
+
+        iterator begin() const { return iterator(trace_, 0); }
+        iterator end() const { return iterator(trace_, size()); }
+        size_t size() const { return trace_.events_.size(); }
+    };
+
+    /**
+     * The stored events. Every distinct operation of the trace is in here, but
+     * repetitions of it by a run are not.
+     */
+    StoredEvents events() const { return StoredEvents(*this); }
 
-    size_t size() const { return events_.size(); }
+    const std::vector<TraceRun> &runs() const { return runs_; }
 
-    bool empty() const { return events_.empty(); }
+    size_t size() const { return size_; }
+
+    bool empty() const { return !size_; }
 
     std::string str() const;
 
@@ -269,8 +803,108 @@ public:
     T getMetadata(const char *key) const { return meta_[key].as<T>(); }
 
     TraceEvent::Source getSource() const { return source_; }
+
+    const TraceTables &tables() const { return *tables_; }
+
+    const TraceAddressIndex &addressIndex() const;
 };
 
+TraceEvent::Type TraceEventView::type(void) const 
+    { return trace_->events_.type(idx_); }
+
+uint64_t TraceEventView::timestamp(void) const {
+    return trace_->events_.timestamp(idx_) + 
+           trace_->strides_[idx_].timestamp * (int64_t)iteration_;
+}
+
+bool TraceEventView::isBug(void) const 
+    { return trace_->events_.isBug(idx_); }
+
+size_t TraceEventView::numAddresses(void) const 
+    { return trace_->events_.numAddresses(idx_); }
+
+AddressInfo TraceEventView::address(size_t j) const {
+    AddressInfo ai = trace_->events_.address(idx_, j);
+    // Runs never have more than one address.
+    ai.address += trace_->strides_[idx_].address * (int64_t)iteration_;
+    return ai;
+}
+
+LocId TraceEventView::locationId(void) const 
+    { return trace_->events_.locationId(idx_); }
+
+StackId TraceEventView::stackId(void) const 
+    { return trace_->events_.stackId(idx_); }
+
+const LocationInfo &TraceEventView::location(void) const 
+    { return trace_->tables().location(locationId()); }
+
+const std::vector<LocationInfo> &TraceEventView::callstack(void) const 
+    { return trace_->tables().stack(stackId()); }
+
+int TraceEventView::site(void) const 
+    { return trace_->tables().site(locationId()); }
+
+/**
+ * Bounded-memory view of the recent past of a trace, for streaming.
+ * 
+ * The bug handlers only ever look backward from a bug for overlapping stores
+ * and flushes, and for whether a fence happened in between. So rather than the
+ * whole trace, we keep per cache line the operations since the last flush that
+ * covered the whole line (older ones can never be reached, as the walk stops
+ * at that flush). Fences are only kept as an epoch counter.
+ */
+class TraceWindow {
+private:
+    struct WindowEvent {
+        TraceEvent event;
+        // Number of fences seen before this event.
+        uint64_t epoch;
+        // Number of cache lines still referring to this event.
+        unsigned refs;
+    };
+
+    TraceEvent::Source source_;
+    std::shared_ptr<TraceTables> tables_;
+    // Index of the next event, and number of fences so far.
+    uint64_t index_ = 0;
+    uint64_t epoch_ = 0;
+    size_t maxRetained_ = 0;
+
+    std::unordered_map<uint64_t, WindowEvent> events_;
+    // cache line -> indices of retained operations, oldest first: those
+    // since the last whole-line flush, and the flush before that.
+    std::map<uint64_t, std::deque<uint64_t>> lines_;
+
+    void release(uint64_t idx);
+
+public:
+    TraceWindow(TraceEvent::Source source, std::shared_ptr<TraceTables> tables) 
+        : source_(source), tables_(tables) {}
+
+    /**
+     * Advance the window past the given event.
+     */
+    void add(TraceEvent &&te);
+
+    /**
+     * Build the context of the given bug: a small trace of the operations
+     * overlapping the bug which are still reachable, with runs of fences 
+     * collapsed to one, followed by the bug itself (so the bug is the last
+     * event). The bug handlers give the same answer on this as on the full 
+     * trace.
+     */
+    TraceInfo context(const TraceEvent &bug) const;
+
+    size_t size(void) const { return events_.size(); }
+
+    size_t maxSize(void) const { return maxRetained_; }
+};
+
+class BinaryTraceFile;
+class PmemcheckLog;
+struct BinaryEvent;
+
 /**
  * Ian: my thought on using this builder style is that it will de-clutter
  * the TraceInfo class.
@@ -279,22 +913,108 @@ class TraceInfoBuilder {
 private:
     YAML::Node doc_;
     BugLocationMapper &mapper_;
+    std::shared_ptr<TraceTables> tables_;
+    // Stacks only need to be resolved once.
+    std::unordered_map<StackId, StackId> resolved_;
+    // If one is set, we build from it rather than doc_.
+    const BinaryTraceFile *binary_ = nullptr;
+    const PmemcheckLog *log_ = nullptr;
 
     /**
      * Convert the YAML node into a proper trace event.
      */
-    void processEvent(TraceInfo &ti, YAML::Node event);
+    TraceEvent processEvent(TraceEvent::Source source, YAML::Node event);
+
+    /**
+     * Same, but from a binary trace record. The location and stack tables are
+     * decoded once up front and shared across events.
+     */
+    TraceEvent processBinaryEvent(TraceEvent::Source source, 
+                                  const BinaryEvent &event,
+                                  const std::vector<LocId> &locations,
+                                  const std::vector<StackId> &stacks);
+
+    /**
+     * Decode every event of the trace in order, without keeping them.
+     */
+    void forEachEvent(TraceEvent::Source source, 
+                      const std::function<void(TraceEvent &&)> &fn);
+
+    /**
+     * forEachEvent() for the record based inputs (BinaryTraceFile and
+     * PmemcheckLog), which share the same tables and event records.
+     */
+    template<typename RecordFile>
+    void forEachRecord(const RecordFile &file, TraceEvent::Source source,
+                       const std::function<void(TraceEvent &&)> &fn);
+
+    TraceEvent::Source source(void);
 
     /**
      * Fixes up slight naming differences in trace event stack traces.
      */
     void resolveLocations(TraceEvent &te);
 
+    StackId resolveStack(StackId id);
+
+    /**
+     * Resolve many stacks at once, on the worker pool. Only reads the module
+     * and mapper, which nothing modifies during the trace build.
+     */
+    void resolveStacks(const std::vector<StackId> &ids);
+
+    std::vector<LocationInfo> resolveFrames(std::vector<LocationInfo> stack) const;
+
+    StackId internResolved(StackId id, const std::vector<LocationInfo> &stack);
+
+    /**
+     * Create an empty trace, sharing our tables.
+     */
+    TraceInfo createTrace(void);
+
+    /**
+     * Drops the events no bug handler can reach (-prune-trace). Like
+     * BugReport._optimize in tools/Reports.py, for traces that didn't go 
+     * through it:
+     *  1. Only keep the first bug of each (type, call stack).
+     *  2. Drop stores and flushes which don't overlap any bug.
+     *  3. Drop a store if the same range is stored again before anything 
+     *     flushes or checks it (Reports.py keeps both).
+     *  4. Collapse runs of fences.
+     * Must run after the locations are resolved.
+     */
+    static void prune(TraceInfo &ti);
+
 public:
-    TraceInfoBuilder(llvm::Module &m, YAML::Node document) 
-        : mapper_(BugLocationMapper::getInstance(m)), doc_(document) {};
+    TraceInfoBuilder(BugLocationMapper &mapper, YAML::Node document) 
+        : mapper_(mapper), doc_(document),
+          tables_(std::make_shared<TraceTables>(mapper_)) {};
+
+    TraceInfoBuilder(BugLocationMapper &mapper, const BinaryTraceFile &file)
+        : mapper_(mapper), 
+          tables_(std::make_shared<TraceTables>(mapper_)), binary_(&file) {};
+
+    TraceInfoBuilder(BugLocationMapper &mapper, const PmemcheckLog &log)
+        : mapper_(mapper), 
+          tables_(std::make_shared<TraceTables>(mapper_)), log_(&log) {};
 
     TraceInfo build(void);
+
+    /**
+     * Called with the context of each bug (see TraceWindow::context) and the
+     * index of the bug within that context.
+     */
+    typedef std::function<void(TraceInfo&, int)> BugHandler;
+
+    /**
+     * Streaming version of build(). Rather than materializing the trace, 
+     * each bug is handed to the handler as soon as it is seen, so memory is
+     * bounded by the live cache lines rather than the trace length.
+     * 
+     * Returns a trace with no bugs and one representative event per distinct
+     * (type, call stack), which is all the alias analysis setup needs.
+     */
+    TraceInfo stream(const BugHandler &handler);
 };
 
 }
@@ -0,0 +1,176 @@
+#include "DemandAA.hpp"
+
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/Instructions.h"
+
+#include "PointsToModel.hpp"
+
+using namespace llvm;
+using namespace pmfix;
+using namespace pmfix::ptmodel;
+
+DemandAA::DemandAA(Module &m, const Scope &scope) : m_(m), scope_(scope) {
+    collectStores();
+}
+
+unsigned DemandAA::objectId(const Value *v) {
+    auto res = objectIds_.insert({v, (unsigned)objects_.size()});
+    if (res.second) objects_.push_back(v);
+    return res.first->second;
+}
+
+void DemandAA::collectStores(void) {
+    std::vector<std::pair<const Value*, const Value*>> stores;
+    ptmodel::collectStores(m_, scope_, stores);
+    for (const auto &st : stores) {
+        stores_.emplace_back(st.first, NodeKey(st.second, false));
+    }
+
+    for (const Function &f : m_) {
+        if (!scope_.hasBody(&f)) continue;
+
+        for (const BasicBlock &b : f) {
+            for (const Instruction &i : b) {
+                auto *cb = dyn_cast<CallBase>(&i);
+                if (!cb) continue;
+
+                const Value *dst, *src;
+                if (copiesMemory(cb, dst, src)) {
+                    stores_.emplace_back(dst, NodeKey(src, true));
+                }
+
+                const Value *callee = cb->getCalledValue()->stripPointerCasts();
+                if (!isa<Function>(callee) && !isa<InlineAsm>(callee)) {
+                    indirectCalls_.push_back(cb);
+                }
+            }
+        }
+    }
+}
+
+const SparseBitVector<> &DemandAA::compute(NodeKey key) {
+    Node &node = nodes_[key.getOpaqueValue()];
+    if (node.done || node.pass == pass_) return node.pts;
+    node.pass = pass_;
+    touched_.push_back(&node);
+
+    SparseBitVector<> pts;
+    SmallVector<NodeKey, 16> work;
+    DenseSet<const void*> seen;
+
+    auto push = [&] (NodeKey k) {
+        if (seen.insert(k.getOpaqueValue()).second) work.push_back(k);
+    };
+    auto pushValue = [&] (const Value *v) { push(NodeKey(v, false)); };
+
+    // x = *y gets everything stored where y may point.
+    auto load = [&] (const Value *y) {
+        const SparseBitVector<> &where = compute(NodeKey(y, false));
+        if (where.empty()) return;
+
+        for (const auto &st : stores_) {
+            if (compute(NodeKey(st.first, false)).intersects(where)) {
+                push(st.second);
+            }
+        }
+    };
+
+    std::vector<const Value*> rets;
+    auto callReturns = [&] (const CallBase *cb, const Function *f) {
+        if (!scope_.hasBody(f)) {
+            if (returnsFirstArg(f) && cb->arg_size()) {
+                pushValue(cb->getArgOperand(0));
+            } else {
+                pts.set(objectId(cb));
+            }
+            return;
+        }
+
+        rets.clear();
+        returnValues(f, rets);
+        for (const Value *r : rets) pushValue(r);
+    };
+
+    std::vector<const CallBase*> calls;
+    SmallVector<const Value*, 4> srcs;
+
+    push(key);
+    while (!work.empty()) {
+        NodeKey k = work.pop_back_val();
+        const Value *v = k.getPointer();
+
+        if (k.getInt()) {
+            load(v);
+        } else if (scope_.hides(v)) {
+            continue;
+        } else if (scope_.isObject(v)) {
+            pts.set(objectId(v));
+        } else if (auto *arg = dyn_cast<Argument>(v)) {
+            const Function *f = arg->getParent();
+            unsigned idx = arg->getArgNo();
+
+            calls.clear();
+            directCalls(f, scope_, calls);
+            for (const CallBase *cb : calls) {
+                if (idx < cb->arg_size()) pushValue(cb->getArgOperand(idx));
+            }
+
+            if (f->hasAddressTaken()) {
+                unsigned fid = objectId(f);
+                for (const CallBase *cb : indirectCalls_) {
+                    if (idx < cb->arg_size() && 
+                        compute(NodeKey(cb->getCalledValue(), false)).test(fid)) {
+                        pushValue(cb->getArgOperand(idx));
+                    }
+                }
+            }
+        } else if (const Value *from = loadSource(v)) {
+            load(from);
+        } else if (auto *cb = dyn_cast<CallBase>(v)) {
+            const Value *callee = cb->getCalledValue()->stripPointerCasts();
+            if (auto *f = dyn_cast<Function>(callee)) {
+                callReturns(cb, f);
+            } else if (isa<InlineAsm>(callee)) {
+                pts.set(objectId(cb));
+            } else {
+                // Copy, as callReturns can add objects.
+                SparseBitVector<> callees = compute(NodeKey(callee, false));
+                for (unsigned id : callees) {
+                    if (auto *f = dyn_cast<Function>(objects_[id])) {
+                        callReturns(cb, f);
+                    }
+                }
+            }
+        } else {
+            // Null, undef, and other constants point nowhere.
+            srcs.clear();
+            copySources(v, srcs);
+            for (const Value *src : srcs) pushValue(src);
+        }
+    }
+
+    if (node.pts |= pts) grew_ = true;
+    return node.pts;
+}
+
+bool DemandAA::getPointsToSet(const Value *v, std::vector<const Value*> &ptsSet) {
+    if (!v->getType()->isPointerTy()) return false;
+
+    NodeKey key(v, false);
+    do {
+        grew_ = false;
+        ++pass_;
+        compute(key);
+    } while (grew_);
+
+    // A pass without growth means everything it computed is final.
+    for (Node *n : touched_) n->done = true;
+    touched_.clear();
+
+    for (unsigned id : nodes_[key.getOpaqueValue()].pts) {
+        ptsSet.push_back(objects_[id]);
+    }
+    return true;
+}
@@ -0,0 +1,95 @@
+#pragma once
+/**
+ * Demand-driven points-to analysis (-demand-aa).
+ *
+ * The fixer asks about a few hundred pointers (the trace's PM values and the
+ * stores it looks at while raising fixes), but Andersen's solves every 
+ * pointer in the module up front. This answers each query by walking 
+ * backwards from the pointer over the assignments that reach it, as in
+ * Heintze and Tardieu, "Demand-Driven Pointer Analysis" (PLDI '01): copies
+ * (casts, GEPs, phis, call arguments and returns) are followed directly, and
+ * a load "x = *y" picks up every stored value "*z = w" where y and z may 
+ * alias, which is itself a query. Like Andersen's, it is field- and 
+ * context-insensitive.
+ *
+ * Every pointer a query depends on is solved along the way, and all of them 
+ * are kept for later queries. Queries that depend on each other (through 
+ * loads in a loop, say) are iterated until none of their sets grow.
+ */
+
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/PointerIntPair.h"
+#include "llvm/ADT/SparseBitVector.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/Module.h"
+
+#include "PointsToModel.hpp"
+
+namespace pmfix {
+
+class DemandAA {
+private:
+    /**
+     * A pointer, or (with the bit set) the contents of the memory it points
+     * to, which is what memcpy stores.
+     */
+    typedef llvm::PointerIntPair<const llvm::Value*, 1, bool> NodeKey;
+
+    struct Node {
+        // Object ids, see objects_.
+        llvm::SparseBitVector<> pts;
+        // The pass that last computed pts (see pass_).
+        uint64_t pass = 0;
+        // Won't change any more.
+        bool done = false;
+    };
+
+    llvm::Module &m_;
+    ptmodel::Scope scope_;
+
+    // Node for every pointer queried so far, directly or not. A node map, as
+    // solving holds on to references while adding nodes.
+    std::unordered_map<const void*, Node> nodes_;
+
+    // Abstract objects: allocas, globals, functions and the results of calls
+    // to external functions.
+    std::vector<const llvm::Value*> objects_;
+    llvm::DenseMap<const llvm::Value*, unsigned> objectIds_;
+
+    // Everything that writes a pointer to memory: (where, what).
+    std::vector<std::pair<const llvm::Value*, NodeKey>> stores_;
+    std::vector<const llvm::CallBase*> indirectCalls_;
+
+    /**
+     * Queries are solved in passes. A node is computed at most once a pass,
+     * so a query that reaches back to itself sees its partial set; if any 
+     * set grew during the pass, there is another one.
+     */
+    uint64_t pass_ = 0;
+    bool grew_ = false;
+    std::vector<Node*> touched_;
+
+    unsigned objectId(const llvm::Value *v);
+
+    void collectStores(void);
+
+    const llvm::SparseBitVector<> &compute(NodeKey key);
+
+public:
+    DemandAA(llvm::Module &m, const ptmodel::Scope &scope = ptmodel::Scope());
+
+    DemandAA(const DemandAA &) = delete;
+
+    /**
+     * Same contract as Andersen's: returns false if v isn't a pointer.
+     */
+    bool getPointsToSet(const llvm::Value *v, 
+                        std::vector<const llvm::Value*> &ptsSet);
+};
+
+}
@@ -20,9 +20,6 @@ using namespace llvm;
 cl::opt<bool> UseNT("use-nt", 
     cl::desc("Indicates whether or not to use NT stores for persistent subprograms."));
 
-extern cl::opt<bool> TraceAlias;
-extern cl::opt<bool> ReducedAlias;
-
 llvm::Function *FixGenerator::getClwbDefinition() const {
     // Function *clwb = Intrinsic::getDeclaration(&module_, Intrinsic::x86_clwb, {ptrTy});
     // -- the above appends extra type specifiers that cause it not to generate.
@@ -221,10 +218,6 @@ bool FixGenerator::makeAllStoresPersistent(
             } else if (auto *cx = dyn_cast<AtomicCmpXchgInst>(&i)) {
                 ptrOp = cx->getPointerOperand();
             }
-
-            if (TraceAlias || ReducedAlias) {
-                ptrOp = (*traceAAMap_)[ptrOp];
-            }
             
             if (ptrOp) {
                 /**
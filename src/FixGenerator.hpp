@@ -36,7 +36,6 @@ private:
 protected:
     llvm::Module &module_;
     const PmDesc *pmDesc_;
-    llvm::ValueToValueMapTy *traceAAMap_;
 
     /** PURE UTILITY
      */
@@ -74,8 +73,8 @@ protected:
         llvm::Function *oldF, llvm::Function *newF, const llvm::ValueToValueMapTy &vmap);
 
 public:
-    FixGenerator(llvm::Module &m, const PmDesc *pm, llvm::ValueToValueMapTy *vmap) 
-        : module_(m), pmDesc_(pm), traceAAMap_(vmap) {}
+    FixGenerator(llvm::Module &m, const PmDesc *pm) 
+        : module_(m), pmDesc_(pm) {}
 
     /** CORRECTNESS
      * All these functions return the new instruction they created (or a pointer
@@ -138,8 +137,8 @@ class GenericFixGenerator : public FixGenerator {
 private:
 
 public:
-    GenericFixGenerator(llvm::Module &m, const PmDesc *pm, llvm::ValueToValueMapTy *vmap) 
-        : FixGenerator(m, pm, vmap) {}
+    GenericFixGenerator(llvm::Module &m, const PmDesc *pm) 
+        : FixGenerator(m, pm) {}
 
     virtual llvm::Instruction *insertFlush(const FixLoc &fl) override;
 
@@ -173,8 +172,8 @@ private:
                                llvm::Instruction **assert);
 
 public:
-    PMTestFixGenerator(llvm::Module &m, const PmDesc *pm, llvm::ValueToValueMapTy *vmap) 
-        : FixGenerator(m, pm, vmap) {}
+    PMTestFixGenerator(llvm::Module &m, const PmDesc *pm) 
+        : FixGenerator(m, pm) {}
 
     virtual llvm::Instruction *insertFlush(const FixLoc &fl) override;
 
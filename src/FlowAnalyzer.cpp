@@ -3,12 +3,23 @@
 #include <iomanip>
 #include <sstream>
 #include <deque>
+#include <limits>
 #include <utility>
 
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/CFG.h"
+#include "llvm/IR/IntrinsicInst.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
 
 #include "FlowAnalyzer.hpp"
+#include "AliasCache.hpp"
+#include "DemandAA.hpp"
+#include "InclusionAA.hpp"
+#include "MmapAA.hpp"
 #include "PassUtils.hpp"
+#include "PmSummary.hpp"
 
 using namespace llvm;
 using namespace pmfix;
@@ -16,68 +27,194 @@ using namespace std;
 
 #pragma region PmDesc
 
-SharedAndersen PmDesc::anders_(nullptr);
-SharedAndersenCache PmDesc::cache_(nullptr);
+static cl::opt<std::string> AliasCacheDir("alias-cache-dir", cl::init(""),
+    cl::desc("Directory to cache Andersen's points-to results for modules in, "
+             "so repairing the same module again skips the analysis. Unused "
+             "with the other alias options, which don't run Andersen's"));
+
+extern cl::opt<bool> EnableMmapAA;
+extern cl::opt<bool> DemandAlias;
+extern cl::opt<bool> ParallelAlias;
+extern cl::opt<bool> VerifyParallelAlias;
+
+unsigned AliasInfo::id(const Value *v) {
+    auto it = ids.find(v);
+    if (it != ids.end()) return it->second;
+
+    unsigned n = values.size();
+    values.push_back(v);
+    ids[v] = n;
+    return n;
+}
+
+static void runAndersen(AliasInfo &alias) {
+    alias.anders = std::make_shared<AndersenAAWrapperPass>();
+    assert(!alias.anders->runOnModule(*alias.module) && "failed!");
+}
+
+bool AliasInfo::query(const Value *v, std::vector<const Value*> &ptsSet) {
+    if (mmap) return mmap->getPointsToSet(v, ptsSet);
+    if (demand) return demand->getPointsToSet(v, ptsSet);
+    if (inclusion) return inclusion->getPointsToSet(v, ptsSet);
+
+    if (!anders) {
+        bool known;
+        if (disk->lookup(v, known, ptsSet)) return known;
+
+        errs() << "No cached alias results for " << *v << ", running Andersen\n";
+        runAndersen(*this);
+    }
+
+    return anders->getResult().getPointsToSet(v, ptsSet);
+}
+
+AliasInfo::Shared AliasInfo::create(Module &m, const ptmodel::Scope *slice) {
+    Shared alias = std::make_shared<AliasInfo>();
+    alias->module = &m;
+
+    ptmodel::Scope everything;
+    const ptmodel::Scope &scope = slice ? *slice : everything;
+
+    if (!AliasCacheDir.empty() && 
+        (slice || EnableMmapAA || DemandAlias || ParallelAlias || 
+         VerifyParallelAlias)) {
+        errs() << "Warning: -alias-cache-dir only caches Andersen's results, "
+            "which -trace-aa, -reduced-aa, -demand-aa, -parallel-aa and "
+            "-mmap-aa don't use\n";
+    }
+
+    if (DemandAlias && !EnableMmapAA) {
+        alias->demand = std::make_shared<DemandAA>(m, scope);
+        return alias;
+    }
+
+    std::vector<const llvm::Value *> allocSites;
+    if (EnableMmapAA) {
+        alias->mmap = std::make_shared<MmapAA>(m);
+        alias->mmap->getAllAllocationSites(allocSites);
+    } else if (slice || ParallelAlias || VerifyParallelAlias) {
+        // Neither Andersen's nor the cache file can look at just part of a
+        // module, so slices always go to the in-tree solver.
+        bool parallel = ParallelAlias || VerifyParallelAlias;
+        alias->inclusion = std::make_shared<InclusionAA>(m, scope);
+        alias->inclusion->solve(parallel);
+
+        if (VerifyParallelAlias) {
+            InclusionAA serial(m, scope);
+            serial.solve(false);
+            if (!alias->inclusion->sameAs(serial)) {
+                // Not an assert, so release builds can be checked too.
+                report_fatal_error(
+                    "parallel and serial points-to solutions differ");
+            }
+            errs() << "Parallel points-to solution verified\n";
+        }
+
+        alias->inclusion->getAllAllocationSites(allocSites);
+    } else if (!AliasCacheDir.empty()) {
+        alias->disk = std::make_shared<AliasCache>(m, AliasCacheDir);
+        if (alias->disk->load(allocSites)) {
+            errs() << "Loaded alias results from " << alias->disk->path() << "\n";
+        } else {
+            runAndersen(*alias);
+            alias->anders->getResult().getAllAllocationSites(allocSites);
+            if (alias->disk->save(*alias->anders, allocSites)) {
+                errs() << "Saved alias results to " << alias->disk->path() << "\n";
+            }
+            alias->disk.reset();
+        }
+    } else {
+        runAndersen(*alias);
+        alias->anders->getResult().getAllAllocationSites(allocSites);
+    }
+    assert(!allocSites.empty());
 
-bool PmDesc::getPointsToSet(const llvm::Value *v,                                  
-                            std::unordered_set<const llvm::Value *> &ptsSet) const {
+    // Number these first so the points-to sets stay dense.
+    for (const Value *v : allocSites) (void)alias->id(v);
+
+    return alias;
+}
+
+const PtsSet &AliasInfo::getPointsToSet(const llvm::Value *v, bool &res) {
     assert(v);
-    if (!v) return false;
     /**                                                                            
      * Using a cache for this dramatically reduces the amount of time spent here,  
      * as the call to "getPointsToSet" has to re-traverse a bunch of internal      
      * data structures to construct the set.                                       
      */                                                                            
-    bool ret = true;                                                               
-    if (!cache_->count(v)) {                                                
-        std::vector<const Value*> rawSet;                                            
-        ret = anders_->getResult().getPointsToSet(v, rawSet);                      
-        if (ret) { 
-            ptsSet.insert(rawSet.begin(), rawSet.end());                                                                         
-            (*cache_)[v] = ptsSet;                                              
-        }                                                                            
-    } else {                                                                       
-        ptsSet = (*cache_)[v];                                                
-    }                                                                              
-                                                                                   
-    return ret;
+    auto it = cache.find(v);
+    if (it != cache.end()) {
+        res = !unknown.count(v);
+        return it->second;
+    }
+
+    PtsSet &ptsSet = cache[v];
+    std::vector<const Value*> rawSet;                                            
+    res = query(v, rawSet);
+    if (!res) {
+        unknown.insert(v);
+        return ptsSet;
+    }
+
+    for (const Value *pv : rawSet) ptsSet.set(id(pv));
+    return ptsSet;
 }
 
-PmDesc::PmDesc(Module &m) {
-    if (!anders_) {
-        anders_ = std::make_shared<AndersenAAWrapperPass>();
-        assert(!anders_->runOnModule(m) && "failed!");
+/**
+ * True if every bit of sub is set in super.
+ */
+static bool isSubset(const PtsSet &sub, const PtsSet &super) {
+    PtsSet rest;
+    rest.intersectWithComplement(sub, super);
+    return rest.empty();
+}
 
-        std::vector<const llvm::Value *> allocSites;
-        anders_->getResult().getAllAllocationSites(allocSites);
-        assert(!allocSites.empty());
-        // errs() << "ALLOC: " << allocSites.size() << "\n";
-        // assert(false);
-    }
-    if (!cache_) {
-        cache_ = std::make_shared<AndersenCache>();
-    }
+/**
+ * s |= bits, copying s first if anyone else holds it. Returns true if s grew.
+ */
+static bool addTo(std::shared_ptr<PtsSet> &s, const PtsSet &bits) {
+    if (isSubset(bits, *s)) return false;
+    if (s.use_count() > 1) s = std::make_shared<PtsSet>(*s);
+    *s |= bits;
+    return true;
+}
+
+PmDesc::PmDesc(AliasInfo::Shared alias) 
+    : alias_(alias), pm_locals_(std::make_shared<PtsSet>()),
+      pm_globals_(std::make_shared<PtsSet>()), pm_(pm_globals_) {
+    assert(alias_);
+    if (!alias_->mmap) return;
+
+    // These hold for the whole program.
+    for (const Value *v : alias_->mmap->mappings()) pm_globals_->set(id(v));
+}
+
+PmDesc::PmDesc(const PmDesc &d) 
+    : alias_(d.alias_), pm_locals_(d.pm_locals_), pm_globals_(d.pm_globals_),
+      pm_(d.pm_), version_(d.version_) {}
+
+bool PmDesc::mayBePm(const Value *obj) {
+    return !isa<AllocaInst>(obj) && !isa<Function>(obj) && !isa<Constant>(obj);
 }
 
 void PmDesc::addKnownPmValue(Value *pmv) {
-    std::unordered_set<const llvm::Value *> ptsSet, filtered;
-    assert(getPointsToSet(pmv, ptsSet) && "could not get!");
+    bool res;
+    PtsSet ptsSet = getPointsToSet(pmv, res);
+    assert(res && "could not get!");
 
     if (ptsSet.empty()) {
         // This happens for allocation sites I believe. 
         // -- inttoptr too
-        ptsSet.insert(pmv);
+        ptsSet.set(id(pmv));
     }
-    assert(ptsSet.size() && "no points to!");
-
+    assert(!ptsSet.empty() && "no points to!");
 
+    PtsSet filtered;
     // We also need to filter the ptsSet to not include allocas, those are always volatile
-    for (const Value *v : ptsSet) {
-        if (isa<AllocaInst>(v)) continue;
-        if (isa<Function>(v)) continue;
-        if (isa<Constant>(v)) continue;
+    for (unsigned i : ptsSet) {
+        if (!mayBePm(value(i))) continue;
         // errs() << "KPMVK:" << *v << "\n";
-        filtered.insert(v);
+        filtered.set(i);
     }
 
     // if (filtered.empty()) {
@@ -86,75 +223,78 @@ void PmDesc::addKnownPmValue(Value *pmv) {
 
     // assert(filtered.size() && "We don't have the allocation site of the PM!");
 
-    if (isa<GlobalValue>(pmv)) pm_globals_.insert(filtered.begin(), filtered.end());
-    else pm_locals_.insert(filtered.begin(), filtered.end());
+    if (isa<GlobalValue>(pmv)) (void)addTo(pm_globals_, filtered);
+    else (void)addTo(pm_locals_, filtered);
+    if (addTo(pm_, filtered)) version_++;
 }
 
-size_t PmDesc::getNumPmAliases(
-    const std::unordered_set<const llvm::Value *> &ptsSet) const {
-
-    std::unordered_set<const llvm::Value *> pm_values;
-    pm_values.insert(pm_locals_.begin(), pm_locals_.end());
-    pm_values.insert(pm_globals_.begin(), pm_globals_.end());
-
-    // errs() << "ptsSet size: " << ptsSet.size() << "\n";
-    // errs() << "pm_values size: " << pm_values.size() << "\n";
+void PmDesc::doReturn(const PmDesc &d) {
+    // The callee started from our globals, so unless it learned something
+    // they are still the same set.
+    if (pm_globals_ == d.pm_globals_) return;
 
-    std::unordered_set<const llvm::Value*> both, intersect;
-    both.insert(pm_values.begin(), pm_values.end());
-    both.insert(ptsSet.begin(), ptsSet.end());
+    PtsSet added, dropped;
+    added.intersectWithComplement(*d.pm_globals_, *pm_);
+    // Only possible if we learned globals the callee doesn't know about
+    // since it was created.
+    dropped.intersectWithComplement(*pm_globals_, *d.pm_globals_);
+    dropped.intersectWithComplement(*pm_locals_);
 
-    // a form of set intersection
-    // (void)std::set_intersection(ptsSet.begin(), ptsSet.end(),
-    //                             pm_values.begin(), pm_values.end(), inter.begin());
+    pm_globals_ = d.pm_globals_;
 
-    for (const Value *v : both) {
-        if (pm_values.count(v) && ptsSet.count(v)) {
-            intersect.insert(v);
+    if (!dropped.empty()) {
+        if (pm_locals_->empty()) {
+            pm_ = pm_globals_;
+        } else {
+            pm_ = std::make_shared<PtsSet>(*pm_locals_);
+            *pm_ |= *pm_globals_;
         }
+        version_++;
+    } else if (addTo(pm_, added)) {
+        version_++;
     }
+}
 
-    return intersect.size();
+void PmDesc::merge(const PmDesc &d) {
+    (void)addTo(pm_locals_, *d.pm_locals_);
+    (void)addTo(pm_globals_, *d.pm_globals_);
+    if (addTo(pm_, *d.pm_)) version_++;
+}
+
+size_t PmDesc::getNumPmAliases(const PtsSet &ptsSet) const {
+    PtsSet intersect(ptsSet);
+    intersect &= *pm_;
+    return intersect.count();
 }
 
 bool PmDesc::contains(const llvm::Value *pmv) const {
-    std::unordered_set<const llvm::Value *> ptsSet;
-    return getPointsToSet(pmv, ptsSet);
+    bool res;
+    (void)getPointsToSet(pmv, res);
+    return res;
 }
 
 bool PmDesc::pointsToPm(llvm::Value *pmv) const {
-    std::unordered_set<const llvm::Value *> ptsSet;
-    bool res = getPointsToSet(pmv, ptsSet);
-    if (!res) {
-        errs() << "COULD NOT GET: " << *pmv << "\n";
+    auto it = verdicts_.find(pmv);
+    if (it != verdicts_.end() && it->second.first == version_) {
+        return it->second.second;
     }
 
-    if (ptsSet.empty()) {
-        ptsSet.insert(pmv);
+    bool res;
+    const PtsSet &ptsSet = getPointsToSet(pmv, res);
+    if (!res) {
+        errs() << "COULD NOT GET: " << *pmv << "\n";
     }
 
     assert(res && "could not get!");
 
-    size_t numPm = getNumPmAliases(ptsSet);
-
-    return numPm > 0;
+    bool verdict = ptsSet.empty() ? pm_->test(id(pmv)) : pm_->intersects(ptsSet);
+    verdicts_[pmv] = std::make_pair(version_, verdict);
+    return verdict;
 }
 
 bool PmDesc::isSubsetOf(const PmDesc &possSuper) {
-    // They are subsets if the intersection is equal to the smaller set.
-    std::vector<const Value*> gi, li;
-    
-    (void)std::set_intersection(
-        possSuper.pm_globals_.begin(), possSuper.pm_globals_.end(),
-        pm_globals_.begin(), pm_globals_.end(), gi.begin());
-
-    (void)std::set_intersection(
-        possSuper.pm_locals_.begin(), possSuper.pm_locals_.end(),
-        pm_locals_.begin(), pm_locals_.end(), li.begin());
-
-    std::unordered_set<const Value*> gs(gi.begin(), gi.end());
-    std::unordered_set<const Value*> ls(li.begin(), li.end());
-    return gs == pm_globals_ && ls == pm_locals_;
+    return isSubset(*pm_globals_, *possSuper.pm_globals_) &&
+           isSubset(*pm_locals_, *possSuper.pm_locals_);
 }
 
 std::string PmDesc::str(int indent) const {
@@ -165,8 +305,8 @@ std::string PmDesc::str(int indent) const {
     for (int i = 0; i < indent; ++i) istr += "\t";
 
     buffer << istr << "<PmDesc>\n";
-    buffer << istr << "\tNum Locals:  " << pm_locals_.size() << "\n";
-    buffer << istr << "\tNum Globals: " << pm_globals_.size() << "\n";
+    buffer << istr << "\tNum Locals:  " << pm_locals_->count() << "\n";
+    buffer << istr << "\tNum Globals: " << pm_globals_->count() << "\n";
     buffer << istr << "</PmDesc>";
 
     return buffer.str();
@@ -176,15 +316,26 @@ std::string PmDesc::str(int indent) const {
 
 #pragma region FnContext
 
+FnContext::FnContext(const FnContext::Shared &parent, CallBase *cb)
+    : callStack_(parent->callStack_), onStack_(parent->onStack_),
+      parent_(parent), pm_(parent->pm_) {
+    callStack_.push_back(cb);
+    onStack_.insert(cb);
+}
+
 FnContext::Shared FnContext::doCall(Function *f, CallBase *cb) {
-    if (callBaseCache_->count(cb)) {
-        return callBaseCache_->at(cb);
+    auto it = callees_.find(cb);
+    if (it != callees_.end()) {
+        if (FnContext::Shared nctx = it->second.lock()) {
+            // Same call string, so same context; it just learns what this
+            // path knows about PM.
+            nctx->pm_.merge(pm_);
+            return nctx;
+        }
     }
 
-    // Copy, basic setup
-    FnContext::Shared nctx = std::make_shared<FnContext>(*this);
-    nctx->parent_ = shared_from_this();
-    nctx->callStack_.push_back(cb);
+    FnContext::Shared nctx(new FnContext(shared_from_this(), cb));
+    callees_[cb] = nctx;
 
     return nctx;
 }
@@ -239,24 +390,24 @@ std::string FnContext::str(int indent) const {
 
 #pragma region ContextNode
 
-ContextBlock::Shared ContextBlock::create(FnContext::Shared ctx, 
-                                          llvm::Instruction *first,
-                                          llvm::Instruction *trace) {
+ContextBlock ContextBlock::create(FnContext::Shared ctx, 
+                                  llvm::Instruction *first,
+                                  llvm::Instruction *trace) {
     /**
      * Now, we set up the node!
      */ 
-    ContextBlock::Shared node = std::make_shared<ContextBlock>();
-    node->ctx = ctx;
-    node->first = first;
-    node->last = first;
-    node->traceInst = trace;
+    ContextBlock node;
+    node.ctx = ctx;
+    node.first = first;
+    node.last = first;
+    node.traceInst = trace;
     // errs() << "CREATE BEGIN ------\n";
 
     // -- Scroll down to find the last instruction.
-    while (Instruction *tmp = node->last->getNextNonDebugInstruction()) {
+    while (Instruction *tmp = node.last->getNextNonDebugInstruction()) {
         // This makes sure the call is also the last instruction, as 
         // it should be.
-        node->last = tmp;
+        node.last = tmp;
         if (CallBase *cb = dyn_cast<CallBase>(tmp)) {
             Function *f = cb->getCalledFunction();
             if (f && !f->isDeclaration() && !f->isIntrinsic()) {
@@ -267,22 +418,23 @@ ContextBlock::Shared ContextBlock::create(FnContext::Shared ctx,
     }
 
     
-    // errs() << node->str() << "\n";
+    // errs() << node.str() << "\n";
     // errs() << "CREATE END ------\n";
 
     return node;
 }
 
-ContextBlock::Shared ContextBlock::create(const BugLocationMapper &mapper, 
-                                          TraceEvent &te) {
+ContextBlock ContextBlock::create(const BugLocationMapper &mapper, 
+                                  AliasInfo::Shared alias,
+                                  TraceEvent &te) {
 
     // Start from the top down.
-    FnContext::Shared parent = FnContext::create(mapper.module());
+    FnContext::Shared parent = FnContext::create(alias);
 
     errs() << te.str() << "\n\n";
 
     // Copy. So we can modify.
-    std::vector<LocationInfo> &stack = te.callstack;
+    std::vector<LocationInfo> stack = te.callstack();
 
     // [0] is the current location, which we use to set up the node itself.
     for (int i = stack.size() - 1; i >= 1; --i) {
@@ -368,16 +520,11 @@ ContextBlock::Shared ContextBlock::create(const BugLocationMapper &mapper,
             errs() << "Try get function pointer function (" << callee.function << ")\n";
             f = mapper.module().getFunction(callee.function);
             if (!f) {
-                std::list<Function*> fnCandidates;
-                for (Function &fn : mapper.module()) {
-                    std::string fnName(fn.getName().data());
-                    if (fnName.find(callee.function) != std::string::npos) {
-                        // Skip false matches
-                        auto ending = fnName.substr(fnName.find(callee.function) + callee.function.size());
-                        if (ending[0] != '.') continue; // name mangling
-                        errs() << "\t\t--- " << fnName << "\n"; 
-                        fnCandidates.push_back(&fn);
-                    }
+                // name mangling
+                const std::vector<Function*> &fnCandidates = 
+                    mapper.suffixedFunctions(callee.function);
+                for (Function *fn : fnCandidates) {
+                    errs() << "\t\t--- " << fn->getName() << "\n"; 
                 }
                 assert(fnCandidates.size() == 1 && "wat");
                 f = fnCandidates.front();
@@ -398,15 +545,14 @@ ContextBlock::Shared ContextBlock::create(const BugLocationMapper &mapper,
      * Now, we set up arguments so we can call the other create() function.
      */ 
 
-    if (stack[0] != te.location) {
+    if (stack[0] != te.location()) {
         errs() << "DING\n";
-        te.location = stack[0];
     }
 
     const LocationInfo &curr = stack[0];
     if (!mapper.contains(curr)) {
         errs() << "stack[0] " << curr.str() << "\n";
-        errs() << "location " << te.location.str() << "\n";
+        errs() << "location " << te.location().str() << "\n";
 
         LocationInfo dup = curr;
         dup.function = "memset_mov2x64b.896";
@@ -420,7 +566,7 @@ ContextBlock::Shared ContextBlock::create(const BugLocationMapper &mapper,
          * TODO: Any way around this? Doesn't seem like it.
          */
         assert(false);
-        return nullptr;
+        return ContextBlock();
     }
     // We use this to figure out the first and last instruction in the window.
     std::list<Instruction*> possibleLocs;
@@ -477,14 +623,23 @@ std::string ContextBlock::str(int indent) const {
 
 #pragma region ContextGraph
 
+static cl::opt<bool> UsePmSummaries("pm-summaries", cl::init(true),
+    cl::desc("Step over calls to functions that can't store to PM, flush, "
+             "fence or return PM when building flow graphs"));
+
+template <typename T>
+typename ContextGraph<T>::NodeId ContextGraph<T>::addNode(const ContextBlock &b) {
+    assert(nodes_.size() < std::numeric_limits<NodeId>::max() && "graph too big!");
+    nodes_.emplace_back(b);
+    return nodes_.size() - 1;
+}
+
 template <typename T>
-std::list<typename ContextGraph<T>::GraphNodePtr> 
-ContextGraph<T>::constructSuccessors(ContextGraph<T>::GraphNodePtr node) {
+void ContextGraph<T>::constructSuccessors(NodeId id, std::vector<NodeId> &out) {
     /**
      * TODO: We can use the caching mechanism as a way of doing loop detection.
      */
-    std::list<ContextGraph::GraphNodePtr> finalSuccessors;
-    node->constructed = true;
+    nodes_[id].constructed = true;
 
     /**
      * What we want to do here is collect FnContext, Instruction tuples.
@@ -494,7 +649,9 @@ ContextGraph<T>::constructSuccessors(ContextGraph<T>::GraphNodePtr node) {
     typedef std::pair<FnContext::Shared, Instruction*> SuccType;
     std::list<SuccType> successors;
 
-    Instruction *last = node->block->last;
+    // Copied, as adding nodes below moves the blocks.
+    ContextBlock block = nodes_[id].block;
+    Instruction *last = block.last;
 
     /**
      * If the last instruction is a return instruction, then the only successor
@@ -502,10 +659,10 @@ ContextGraph<T>::constructSuccessors(ContextGraph<T>::GraphNodePtr node) {
      */
 
     if (ReturnInst *ri = dyn_cast<ReturnInst>(last)) {
-        if (node->block->ctx->canReturn()) {
-            auto newCtx = node->block->ctx->doReturn(ri);
+        if (block.ctx->canReturn()) {
+            auto newCtx = block.ctx->doReturn(ri);
             // The next instruction isn't too complicated
-            CallBase *cb = node->block->ctx->caller();
+            CallBase *cb = block.ctx->caller();
             Instruction *next = cb->getNextNonDebugInstruction();
             assert(next && "bad assumptions!");
             successors.emplace_back(newCtx, next);
@@ -528,11 +685,14 @@ ContextGraph<T>::constructSuccessors(ContextGraph<T>::GraphNodePtr node) {
         assert(f && "don't know how to handle this yet!");
 
         // Check recursion.
-        if (node->block->ctx->contains(cb)) {
+        if (block.ctx->contains(cb)) {
             // Here, we just advance to the next instruction instead.
-            successors.emplace_back(node->block->ctx, cb->getNextNonDebugInstruction());
+            successors.emplace_back(block.ctx, cb->getNextNonDebugInstruction());
+        } else if (summaries_ && summaries_->isClean(f)) {
+            // Nothing in there for us, so the call is one step.
+            successors.emplace_back(block.ctx, cb->getNextNonDebugInstruction());
         } else {
-            auto newCtx = node->block->ctx->doCall(f, cb);
+            auto newCtx = block.ctx->doCall(f, cb);
             Instruction *next = &f->getEntryBlock().front();
             successors.emplace_back(newCtx, next);
         }
@@ -545,7 +705,7 @@ ContextGraph<T>::constructSuccessors(ContextGraph<T>::GraphNodePtr node) {
     else if (last->isTerminator()) {
         errs() << "LAST TERM " << *last << "\n";
         for (BasicBlock *succ : llvm::successors(last->getParent())) {
-            successors.emplace_back(node->block->ctx, 
+            successors.emplace_back(block.ctx, 
                                     succ->getFirstNonPHIOrDbgOrLifetime());
             errs() << "HEY HEY HEY " << *succ->getFirstNonPHIOrDbgOrLifetime() << "\n";
         }
@@ -560,24 +720,25 @@ ContextGraph<T>::constructSuccessors(ContextGraph<T>::GraphNodePtr node) {
     }
 
     for (SuccType &st : successors) {
-        if (nullptr != nodeCache_[st.first][st.second]) {
+        auto key = std::make_pair(st.first.get(), st.second);
+        auto it = nodeCache_.find(key);
+        if (it != nodeCache_.end()) {
             errs() << "CACHE HIT BRONT " << *last << "\n";
-            finalSuccessors.push_back(nodeCache_[st.first][st.second]);
+            cacheHits_++;
+            out.push_back(it->second);
         } else {
             // Need a new context block
-            auto newCtx = ContextBlock::create(st.first, st.second, st.second);
-            auto newNode = std::make_shared<ContextGraph::GraphNode>(newCtx);
-            finalSuccessors.push_back(newNode);
-            nodeCache_[st.first][st.second] = newNode;
+            NodeId child = addNode(ContextBlock::create(st.first, st.second, st.second));
+            out.push_back(child);
+            nodeCache_[key] = child;
         }
     }
-
-    return finalSuccessors;
 }
 
 template <typename T>
-void ContextGraph<T>::construct(ContextBlock::Shared end) {
-    std::deque<std::shared_ptr<GraphNode>> frontier(roots.begin(), roots.end());
+void ContextGraph<T>::construct(const ContextBlock &end) {
+    std::deque<NodeId> frontier(roots.begin(), roots.end());
+    std::vector<NodeId> successors;
 
     size_t nnodes = roots.size();
     /**
@@ -587,62 +748,60 @@ void ContextGraph<T>::construct(ContextBlock::Shared end) {
      * 3. Add as children if conditions work.
      */
     while (frontier.size()) {
-        ContextGraph::GraphNodePtr n = frontier.front();
+        NodeId n = frontier.front();
         frontier.pop_front();
 
         // Pre-check
         errs() << "------B\n";
         errs() << "SZ: " << frontier.size() << ", TOTAL: " << nnodes << "\n";
 
-        if (n->constructed) {
+        if (nodes_[n].constructed) {
             errs() << "Already constructed! DO NOTHING\n";
             nnodes--;
             errs() << "------E\n";
             continue;
         }
 
-        // errs() << "Traverse " << n->block->str() << "\n";
-        if (*n->block == *end) {
+        // errs() << "Traverse " << nodes_[n].block.str() << "\n";
+        if (nodes_[n].block == end) {
             errs() << "equals end!!! End traversal\n";
             // This counts as "construction"
-            n->constructed = true;
+            nodes_[n].constructed = true;
+            nodes_[n].isEnd = true;
             // Update the trace instruction too
-            n->block->traceInst = end->traceInst;
+            nodes_[n].block.traceInst = end.traceInst;
             leaves.push_back(n);
             
             errs() << "------E\n";
             continue;
         }
-        //  else {
-            // errs() << "NE:\n" << end->str() << "\nEND NE\n";
-        // }
 
         // Construct successors.
-        assert(!n->constructed && "SEEMS WASTEFUL BRONT");
-        auto successors = constructSuccessors(n);
-        n->constructed = true;
-
-        for (auto childNode : successors) {
-            // Set parent-child relations
-            n->children.insert(childNode);
-            childNode->parents.insert(n);
-
+        successors.clear();
+        constructSuccessors(n, successors);
+        std::sort(successors.begin(), successors.end());
+        successors.erase(std::unique(successors.begin(), successors.end()), 
+                         successors.end());
+
+        // Set parent-child relations
+        GraphNode &node = nodes_[n];
+        node.constructed = true;
+        node.firstChild = children_.size();
+        node.numChildren = successors.size();
+        children_.insert(children_.end(), successors.begin(), successors.end());
+
+        for (NodeId child : successors) {
             /**
              * If a child has already been constructed, than means we have a 
              * loop! So, we don't add it back to the frontier.
              */
-            if (!childNode->constructed) {
+            if (!nodes_[child].constructed) {
                 nnodes++;
-                frontier.push_back(childNode);
-                // errs() << "\tnew child!\n";
-                // errs() << childNode->block->str() << "\n";
+                frontier.push_back(child);
             } 
-            // else {
-            //     errs() << "\tconstructed child!\n";
-            // }
         }
 
-        if (n->isTerminator()) {
+        if (node.isTerminator()) {
             errs() << "no kids!\n";
             leaves.push_back(n);
         }
@@ -654,34 +813,53 @@ void ContextGraph<T>::construct(ContextBlock::Shared end) {
     errs() << "<<< Have " << leaves.size() << " leaves! >>>\n";
 }
 
+template <typename T>
+void ContextGraph<T>::indexParents(void) {
+    parentStart_.assign(nodes_.size() + 1, 0);
+    for (NodeId child : children_) parentStart_[child + 1]++;
+    for (size_t i = 1; i < parentStart_.size(); ++i) {
+        parentStart_[i] += parentStart_[i - 1];
+    }
+
+    parents_.resize(children_.size());
+    std::vector<uint32_t> next(parentStart_.begin(), parentStart_.end() - 1);
+    for (NodeId n = 0; n < nodes_.size(); ++n) {
+        for (NodeId child : children(n)) parents_[next[child]++] = n;
+    }
+}
+
 template <typename T>
 ContextGraph<T>::ContextGraph(const BugLocationMapper &mapper, 
+                              AliasInfo::Shared alias,
                               TraceEvent &start, 
                               TraceEvent &end) {
     errs() << "CONSTRUCT ME\n\n";
 
-    ContextBlock::Shared sblk = ContextBlock::create(mapper, start);
-    if (!sblk) {
+    ContextBlock sblk = ContextBlock::create(mapper, alias, start);
+    if (!sblk.valid()) {
         errs() << "\tCONSTRUCT ABORT!\n";
         return;
     }
-    ContextBlock::Shared eblk = ContextBlock::create(mapper, end);
-    // errs() << sblk->str() << "\n";
-    // errs() << eblk->str() << "\n";
+    ContextBlock eblk = ContextBlock::create(mapper, alias, end);
+    // errs() << sblk.str() << "\n";
+    // errs() << eblk.str() << "\n";
 
     errs() << "\nEND CONSTRUCT\n";
 
-    auto root = std::make_shared<ContextGraph::GraphNode>(sblk);
-    roots.push_back(root);
+    if (UsePmSummaries) summaries_ = PmSummaries::get(*alias);
+
+    roots.push_back(addNode(sblk));
 
     construct(eblk);
+    indexParents();
 
     // Validate that the leaf nodes are all what we expect them to be.
     assert(leaves.size() >= 1 && "Did not construct leaves!");
-    for (ContextGraph::GraphNodePtr n : leaves) {
-        if (*n->block != *eblk && !n->isTerminator()) {
-            errs() << (*n->block != *eblk) << " && " << 
-                (!n->isTerminator()) << "\n";
+    for (NodeId n : leaves) {
+        const GraphNode &node = nodes_[n];
+        if (node.block != eblk && !node.isTerminator()) {
+            errs() << (node.block != eblk) << " && " << 
+                (!node.isTerminator()) << "\n";
             assert(false && "wat");
         }
     }
@@ -694,94 +872,228 @@ template struct pmfix::ContextGraph<pmfix::FlowAnalyzer::Info>;
 
 #pragma region FlowAnalyzer
 
-bool FlowAnalyzer::interpret(ContextGraph<Info>::GraphNodePtr node,
-                             Instruction *start, Instruction *end) {
-    Info &info = node->metadata;
-    PmDesc &pm = node->block->ctx->pm();
-    assert(start->getParent() == end->getParent() && "not in same BB!");
+void FlowAnalyzer::findFlushedLine(void) {
+    const LocationInfo &loc = start_.location();
+    if (!mapper_.instsContains(loc)) return;
+
+    for (Instruction *i : mapper_.insts(loc)) {
+        auto *cb = dyn_cast<CallBase>(i);
+        if (!cb || !utils::isFlush(*i) || !cb->arg_size()) continue;
+
+        line_.ptr = cb->getArgOperand(0);
+        line_.base = GetPointerBaseWithConstantOffset(
+            line_.ptr, line_.offset, m_.getDataLayout());
+        errs() << "Flushed line: " << *line_.ptr << "\n";
+        return;
+    }
+
+    errs() << "Could not find the original flush, any PM store spoils\n";
+}
+
+bool FlowAnalyzer::mayDirty(PmDesc &pm, Value *addr, uint64_t size) const {
+    if (!pm.pointsToPm(addr)) return false;
+    if (!line_.ptr) return true;
+
+    int64_t offset;
+    const Value *base = 
+        GetPointerBaseWithConstantOffset(addr, offset, m_.getDataLayout());
+    if (base == line_.base) {
+        // We don't know how the base is aligned, so the line is somewhere in
+        // (flushed - line size, flushed + line size).
+        int64_t clSize = (int64_t)AddressInfo::cacheLineSize();
+        if (offset >= line_.offset + clSize) return false;
+        if (size != ~0ull && offset + (int64_t)size <= line_.offset - clSize + 1) {
+            return false;
+        }
+        return true;
+    }
+
+    bool res, lineRes;
+    const PtsSet &ptsSet = pm.getPointsToSet(addr, res);
+    const PtsSet &linePtsSet = pm.getPointsToSet(line_.ptr, lineRes);
+    if (!res || !lineRes || ptsSet.empty() || linePtsSet.empty()) return true;
+    return ptsSet.intersects(linePtsSet);
+}
 
-    if (info.updated) return !info.isNotRedundant;
+bool FlowAnalyzer::cleans(Instruction *flush) const {
+    auto *cb = dyn_cast<CallBase>(flush);
+    if (!line_.ptr || !cb || !cb->arg_size()) return false;
+
+    Value *ptr = cb->getArgOperand(0);
+    if (ptr == line_.ptr) return true;
+
+    int64_t offset;
+    const Value *base = 
+        GetPointerBaseWithConstantOffset(ptr, offset, m_.getDataLayout());
+    return base == line_.base && offset == line_.offset;
+}
+
+FlowAnalyzer::Effect FlowAnalyzer::interpret(ContextGraph<Info>::NodeId node,
+                                             Instruction *start, 
+                                             Instruction *stop) {
+    const ContextBlock &blk = graph_[node].block;
+    PmDesc &pm = blk.ctx->pm();
+    const DataLayout &dl = m_.getDataLayout();
 
     // errs() << "Interpret start: " << *start << "\n";
-    // errs() << "Interpret end:   " << *end << "\n";
 
-    Instruction *i = start;
-    bool isStillRedt = true;
-    // We do != end + 1 since end is inclusive
-    while (i != end->getNextNonDebugInstruction()) {
+    Effect effect = KEEPS;
+    Instruction *end = blk.last->getNextNonDebugInstruction();
+    for (Instruction *i = start; i && i != stop && i != end; 
+         i = i->getNextNonDebugInstruction()) {
         if (auto *si = dyn_cast<StoreInst>(i)) {
             Value *v = si->getPointerOperand();
-            if (pm.pointsToPm(v)) {
-                /**
-                 * TODO: if there's a flush which flushes this exactly, we're 
-                 * okay, otherwise there's no hope.
-                 */
-                isStillRedt = false;
+            uint64_t sz = dl.getTypeStoreSize(si->getValueOperand()->getType());
+            if (mayDirty(pm, v, sz)) {
+                effect = SPOILS;
                 // errs() << "spoiler:" << *v << "\n";
             }
+        } else if (utils::isFlush(*i)) {
+            if (cleans(i)) effect = CLEANS;
+        } else if (auto *mi = dyn_cast<MemIntrinsic>(i)) {
+            uint64_t sz = ~0ull;
+            if (auto *len = dyn_cast<ConstantInt>(mi->getLength())) {
+                sz = len->getZExtValue();
+            }
+            if (mayDirty(pm, mi->getRawDest(), sz)) effect = SPOILS;
         } else if (auto *cb = dyn_cast<CallBase>(i)) {
-            const Function *flushFn = utils::getFlush(cb);
-            if (flushFn && !isStillRedt) {
-                errs() << *cb << "\n";
-                assert(false && "TODO");
+            Function *f = cb->getCalledFunction();
+            if (f && f->isIntrinsic()) continue;
+            if (f && !f->isDeclaration()) {
+                // Calls we descend into are blocks of their own, and so are
+                // the PM-clean ones we step over. Recursive calls were cut
+                // short, so we have no idea what they do.
+                if (blk.ctx->contains(cb)) effect = SPOILS;
+                continue;
+            }
+            // Code we can't see may write through any pointer it's given.
+            if (cb->onlyReadsMemory()) continue;
+            for (Value *arg : cb->args()) {
+                if (arg->getType()->isPointerTy() && mayDirty(pm, arg, ~0ull)) {
+                    effect = SPOILS;
+                    break;
+                }
             }
-            
         }
-
-        i = i->getNextNonDebugInstruction();
     }
 
-    info.isNotRedundant = !isStillRedt;
-    info.updated = true;
-
-    return isStillRedt;
+    return effect;
 }
 
-bool FlowAnalyzer::alwaysRedundant() {
-    
-    bool redundant = true;
-    for (auto nptr : graph_.roots) {
-        
-        // For each child, we need to traverse, interpret, and so on.
+void FlowAnalyzer::solve(void) {
+    typedef ContextGraph<Info>::NodeId NodeId;
+    if (solved_) return;
+    solved_ = true;
 
-        // -- Special case. For one node, it's always redundant.
-        if (nptr->children.empty()) {
-            continue;
-        }
+    findFlushedLine();
 
-        bool r = interpret(nptr, nptr->block->traceInst, nptr->block->last);
-        assert(r && "doesn't make sense!");
+    /**
+     * 1. What each block does. The root starts from the original flush, and
+     * the end blocks stop at the redundant one.
+     */
+    std::vector<bool> isRoot(graph_.size(), false);
+    for (NodeId root : graph_.roots) isRoot[root] = true;
+
+    for (NodeId n = 0; n < graph_.size(); ++n) {
+        const ContextBlock &blk = graph_[n].block;
+        Instruction *start = blk.first, *stop = nullptr;
+        // If it's also the end, we can't tell where the original flush was,
+        // so take the whole block and rely on finding it.
+        if (isRoot[n] && !graph_[n].isEnd) start = blk.traceInst;
+        if (graph_[n].isEnd) stop = blk.traceInst;
+        graph_[n].metadata.effect = interpret(n, start, stop);
+    }
 
-        std::deque<ContextGraph<Info>::GraphNodePtr> frontier;
-        std::unordered_set<ContextGraph<Info>::GraphNodePtr> traversed;
+    /**
+     * 2. Forward: may the line be dirty at the start of each block? The 
+     * original flush leaves it clean after the root, whatever came before.
+     */
+    std::deque<NodeId> worklist(graph_.roots.begin(), graph_.roots.end());
+    for (NodeId root : graph_.roots) {
+        // Only matters for a root that's also the end.
+        if (graph_[root].isEnd) graph_[root].metadata.mayBeDirty = true;
+    }
 
-        frontier.insert(frontier.end(), nptr->children.begin(), nptr->children.end());
-        traversed.insert(nptr);
+    while (worklist.size()) {
+        NodeId n = worklist.front();
+        worklist.pop_front();
+
+        Info &info = graph_[n].metadata;
+        info.visited = true;
+        bool dirty = isRoot[n] ? dirtyAfter(info.effect, false)
+                               : dirtyAfter(info.effect, info.mayBeDirty);
+
+        for (NodeId child : graph_.children(n)) {
+            Info &cInfo = graph_[child].metadata;
+            if (isRoot[child]) continue;
+            if (dirty && !cInfo.mayBeDirty) {
+                cInfo.mayBeDirty = true;
+            } else if (cInfo.visited) {
+                continue;
+            }
+            cInfo.visited = true;
+            worklist.push_back(child);
+        }
+    }
 
-        while (frontier.size()) {
-            auto node = frontier.front();
-            frontier.pop_front();
+    alwaysRedundant_ = false;
+    for (NodeId leaf : graph_.leaves) {
+        const Info &info = graph_[leaf].metadata;
+        if (!graph_[leaf].isEnd) continue;
+        if (dirtyAfter(info.effect, info.mayBeDirty)) {
+            alwaysRedundant_ = false;
+            break;
+        }
+        alwaysRedundant_ = true;
+    }
 
-            // Loop check
-            if (traversed.count(node)) continue;
-            traversed.insert(node);
-
-            // For leaves, we interpret just to trace end
-            if (node->children.empty()) {
-                bool r = interpret(node, node->block->first, node->block->traceInst);
-                assert(r && "doesn't make sense!");
-            } else {
-                bool r = interpret(node, node->block->first, node->block->last);
-                redundant = r && redundant;
-                frontier.insert(frontier.end(), node->children.begin(), node->children.end());
+    /**
+     * 3. Backward, for the conditional fix: from where is the end flush
+     * redundant on every path? Greatest fixpoint, as a loop that never 
+     * reaches the end doesn't make it any less redundant. Going back 
+     * through the root resets the condition, so it never matters.
+     */
+    for (NodeId n = 0; n < graph_.size(); ++n) {
+        Info &info = graph_[n].metadata;
+        if (!graph_[n].isEnd) continue;
+        info.staysClean[0] = !dirtyAfter(info.effect, false);
+        info.staysClean[1] = !dirtyAfter(info.effect, true);
+        worklist.insert(worklist.end(), graph_.parents(n).begin(), 
+                        graph_.parents(n).end());
+    }
+
+    while (worklist.size()) {
+        NodeId n = worklist.front();
+        worklist.pop_front();
+        if (isRoot[n] || graph_[n].isEnd) continue;
+
+        Info &info = graph_[n].metadata;
+        bool changed = false;
+        for (int d = 0; d < 2; ++d) {
+            bool dirty = dirtyAfter(info.effect, d);
+            bool clean = true;
+            for (NodeId child : graph_.children(n)) {
+                clean = clean && graph_[child].metadata.staysClean[dirty];
+            }
+            if (info.staysClean[d] && !clean) {
+                info.staysClean[d] = false;
+                changed = true;
             }
         }
+
+        if (changed) {
+            worklist.insert(worklist.end(), graph_.parents(n).begin(), 
+                            graph_.parents(n).end());
+        }
     }
 
-    // Testing: maybe we get fewer mistakes in RECIPE?
-    redundant = false;
+    errs() << "Flow analysis: " << graph_.size() << " nodes, always redundant? "
+        << alwaysRedundant_ << "\n";
+}
 
-    return redundant;
+bool FlowAnalyzer::alwaysRedundant() {
+    solve();
+    return alwaysRedundant_;
 }
 
 std::list<Instruction*> FlowAnalyzer::redundantPaths() {
@@ -789,30 +1101,30 @@ std::list<Instruction*> FlowAnalyzer::redundantPaths() {
 
 #if 1
     errs() << "incoming debug prints\n";
-    for (auto nptr : graph_.roots) {
+    for (auto root : graph_.roots) {
        
-        std::deque<ContextGraph<Info>::GraphNodePtr> frontier;
-        std::unordered_set<ContextGraph<Info>::GraphNodePtr> traversed;
+        std::deque<ContextGraph<Info>::NodeId> frontier;
+        std::vector<bool> traversed(graph_.size(), false);
 
-        frontier.insert(frontier.end(), 
-                        nptr->children.begin(), nptr->children.end());
-        traversed.insert(nptr);
+        auto kids = graph_.children(root);
+        frontier.insert(frontier.end(), kids.begin(), kids.end());
+        traversed[root] = true;
 
         errs() << "++++++++++++++++++++++++++++\n";
-        errs() << "ROOT: " << nptr.get()  << "\n" << nptr->block->str() << "\n";
+        errs() << "ROOT: " << root  << "\n" << graph_[root].block.str() << "\n";
         while (frontier.size()) {
             auto node = frontier.front();
             frontier.pop_front();
 
             // Loop check
-            if (traversed.count(node)) continue;
-            traversed.insert(node);
+            if (traversed[node]) continue;
+            traversed[node] = true;
 
-            errs() << "NODE: " << node.get() << "\n" << node->block->str() << "\n";
+            errs() << "NODE: " << node << "\n" << graph_[node].block.str() << "\n";
             // errs() << "VERDICT (parents): " << "\n";
 
-            frontier.insert(frontier.end(), 
-                            node->children.begin(), node->children.end());
+            auto kids = graph_.children(node);
+            frontier.insert(frontier.end(), kids.begin(), kids.end());
         }
         errs() << "++++++++++++++++++++++++++++\n";
     }
@@ -820,26 +1132,20 @@ std::list<Instruction*> FlowAnalyzer::redundantPaths() {
 #endif
 
     /**
-     * The point here is to find the paths along which the flush is still 
-     * redundant. So, we need to find the point at which, if X was the only parent,
-     * would the flush be redundant? This is sort of two way, as we need to
-     * have no spoiling parents and no spoiling children.
+     * We want the highest points past which the end flush is redundant on 
+     * every path: the line is clean when the block starts, or the block 
+     * doesn't care, and stays clean from there on. Setting the condition
+     * there and stopping covers everything below.
      */
+    solve();
 
-    std::deque<ContextGraph<Info>::GraphNodePtr> frontier;
-    std::unordered_set<ContextGraph<Info>::GraphNodePtr> traversed;
+    std::deque<ContextGraph<Info>::NodeId> frontier;
+    std::vector<bool> traversed(graph_.size(), false);
 
-    /**
-     * 1. First, we iterate through top-down for the parents field.
-     */
-    for (auto nptr : graph_.roots) {
-        assert(nptr->metadata.updated && "huh?");
-        // -- Special case. For one node, it's always redundant.
-        assert(!nptr->children.empty() && "not sure why we're here");
-
-        frontier.insert(frontier.end(), 
-                        nptr->children.begin(), nptr->children.end());
-        traversed.insert(nptr);
+    for (auto root : graph_.roots) {
+        auto kids = graph_.children(root);
+        frontier.insert(frontier.end(), kids.begin(), kids.end());
+        traversed[root] = true;
     }
 
     while (frontier.size()) {
@@ -847,94 +1153,21 @@ std::list<Instruction*> FlowAnalyzer::redundantPaths() {
         frontier.pop_front();
 
         // Loop check
-        if (traversed.count(node)) continue;
-        traversed.insert(node);
-
-        // For leaves, we interpret just to trace end
-        for (auto parent : node->parents) {
-            bool &isRedt = node->metadata.isRedtInParents;
-            Info &pInfo = parent->metadata;
-            // It is redundant if the parent OR grandparents redundant.
-            isRedt = isRedt && (!pInfo.isNotRedundant && pInfo.isRedtInParents);
-        }
-        errs() << "DOWN PROP " << node.get() << " VERDICT " 
-            << node->metadata.isRedtInParents << "\n";
-
-        frontier.insert(frontier.end(), 
-                        node->children.begin(), node->children.end());
-    }
-
-    /**
-     * 2. We need to do the back-prop part now.
-     */
-    traversed.clear();
-
-    for (auto nptr : graph_.leaves) {
-        assert(nptr->metadata.updated && "huh?");
-        // -- Special case. For one node, it's always redundant.
-        assert(!nptr->parents.empty() && "not sure why we're here");
-
-        assert(!nptr->metadata.isNotRedundant && "???");
-
-        frontier.insert(frontier.end(), nptr->parents.begin(), nptr->parents.end());
-        traversed.insert(nptr);  
-    }
-
-    while (frontier.size()) {
-        auto node = frontier.front();
-        frontier.pop_front();
-
-        // Loop check
-        if (traversed.count(node)) continue;
-        traversed.insert(node);
-
-        // For leaves, we interpret just to trace end
-        for (auto child : node->children) {
-            bool &isRedt = node->metadata.isRedtInChildren;
-            Info &cInfo = child->metadata;
-            // It is redundant if the children AND grandchildren redundant.
-            isRedt = isRedt && (!cInfo.isNotRedundant && cInfo.isRedtInChildren);
-        }
-
-        errs() << "UP PROP " << node.get() << " VERDICT " 
-            << node->metadata.isRedtInChildren << "\n";
-
-        frontier.insert(frontier.end(), 
-                        node->parents.begin(), node->parents.end());
-    }
-
-    /**
-     * 3. Now that we have all the path info, we can find the injection points.
-     * 
-     * We traverse from the roots down, and when we see a node which is both
-     * redundant in parents and redundant in children, we add it to the points 
-     * list and stop traversing that path.
-     */
-    traversed.clear();
-
-    for (auto nptr : graph_.roots) {
-        // If it was always provably redundant in the children, then why wouldn't
-        // we go with the catch-all fix?
-        // assert(!nptr->metadata.isRedtInChildren && "then the original fix!");
-
-        frontier.insert(frontier.end(), nptr->children.begin(), nptr->children.end());
-        traversed.insert(nptr);
-    }
-
-    while (frontier.size()) {
-        auto node = frontier.front();
-        frontier.pop_front();
-
-        // Loop check
-        if (traversed.count(node)) continue;
-        traversed.insert(node);
-
-        if (node->metadata.isRedtInChildren && 
-            node->metadata.isRedtInParents) {
-            points.push_back(node->block->first);
+        if (traversed[node]) continue;
+        traversed[node] = true;
+
+        // Dead ends never get to the end flush.
+        if (graph_[node].isTerminator() && !graph_[node].isEnd) continue;
+
+        const Info &info = graph_[node].metadata;
+        bool redundant = info.staysClean[false] && 
+                         (!info.mayBeDirty || info.staysClean[true]);
+        errs() << "NODE " << node << " VERDICT " << redundant << "\n";
+        if (redundant) {
+            points.push_back(graph_[node].block.first);
         } else {
-            frontier.insert(frontier.end(), 
-                            node->children.begin(), node->children.end());
+            auto kids = graph_.children(node);
+            frontier.insert(frontier.end(), kids.begin(), kids.end());
         }
     }
 
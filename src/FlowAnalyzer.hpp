@@ -3,11 +3,17 @@
  * Used to determine if there are any non-PM paths through the program.
  */
 
+#include <list>
 #include <memory>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SparseBitVector.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/Instructions.h"
@@ -19,10 +25,79 @@
 #include "BugReports.hpp"
 
 namespace pmfix {
+    class AliasCache;
+    class DemandAA;
+    class InclusionAA;
+    class MmapAA;
+    class PmSummaries;
+    namespace ptmodel { struct Scope; }
+
     typedef std::shared_ptr<AndersenAAWrapperPass> SharedAndersen; 
-    typedef std::unordered_map<const llvm::Value*,                                
-                               std::unordered_set<const llvm::Value*>> AndersenCache;
-    typedef std::shared_ptr<AndersenCache> SharedAndersenCache;     
+
+    /**
+     * A set of abstract memory objects (allocation sites, mostly), as ids 
+     * from AliasInfo::id.
+     */
+    typedef llvm::SparseBitVector<> PtsSet;
+
+    // A node map, as PmDesc hands out references to the sets.
+    typedef std::unordered_map<const llvm::Value*, PtsSet> AndersenCache;
+
+    /**
+     * Andersen results for one module, shared by all the PmDescs of it. Each
+     * RepairContext owns these for its modules, so nothing here is shared
+     * between repairs.
+     */
+    struct AliasInfo {
+        typedef std::shared_ptr<AliasInfo> Shared;
+
+        llvm::Module *module = nullptr;
+        // Not run at all if the results come from the -alias-cache-dir file,
+        // or with -trace-aa, -reduced-aa, -demand-aa, -parallel-aa or 
+        // -mmap-aa, which answer the queries instead.
+        SharedAndersen anders;
+        std::shared_ptr<AliasCache> disk;
+        std::shared_ptr<DemandAA> demand;
+        std::shared_ptr<InclusionAA> inclusion;
+        std::shared_ptr<MmapAA> mmap;
+        // Built by the first ContextGraph that wants them.
+        std::shared_ptr<PmSummaries> summaries;
+        // Points-to sets we've already built from anders. Values it knows
+        // nothing about get an empty set, and are also kept in unknown.
+        AndersenCache cache;
+        llvm::DenseSet<const llvm::Value*> unknown;
+
+        // Dense numbering of the values in points-to sets. The allocation 
+        // sites come first, anything else is numbered when first seen.
+        std::vector<const llvm::Value*> values;
+        llvm::DenseMap<const llvm::Value*, unsigned> ids;
+
+        unsigned id(const llvm::Value *v);
+
+        const llvm::Value *value(unsigned id) const { return values[id]; }
+
+        /**
+         * Asks the provenance or demand-driven analysis, the in-tree solver,
+         * the cache file or Andersen's for v's points-to set. Runs Andersen's
+         * if the file doesn't cover v.
+         */
+        bool query(const llvm::Value *v,
+                   std::vector<const llvm::Value*> &ptsSet);
+
+        /**
+         * query(), numbered and cached. res is false (and the set empty) if 
+         * there is no alias info for v.
+         */
+        const PtsSet &getPointsToSet(const llvm::Value *v, bool &res);
+
+        /**
+         * Runs the analysis over the module, or loads its results. With 
+         * -demand-aa, nothing is solved until it is asked for. With a slice,
+         * only the part of the module it covers is analyzed.
+         */
+        static Shared create(llvm::Module &m, 
+                             const ptmodel::Scope *slice = nullptr);
+    };
 
     /**
      * Description of the state of persistent memory in the program.
@@ -32,8 +107,14 @@ namespace pmfix {
      */
     class PmDesc {
     private:
-        static SharedAndersen anders_;
-        static SharedAndersenCache cache_;
+        AliasInfo::Shared alias_;
+
+        /**
+         * Copy-on-write, as every call copies its caller's PmDesc and most 
+         * callees never learn anything new. Copies share the sets until one 
+         * of them adds to a set (see addTo), which then gets its own.
+         */
+        typedef std::shared_ptr<PtsSet> SharedPts;
 
         /**
          * There should be no need to clear/reset anything, only on a return when
@@ -41,11 +122,33 @@ namespace pmfix {
          * 
          * The globals, however, should be copied.
          */
-        std::unordered_set<const llvm::Value *> pm_locals_;
-        std::unordered_set<const llvm::Value *> pm_globals_;
+        SharedPts pm_locals_;
+        SharedPts pm_globals_;
+        // pm_locals_ | pm_globals_, which is what the queries want. Shares
+        // pm_globals_ while there are no locals.
+        SharedPts pm_;
+
+        /**
+         * Bumped whenever pm_ grows (or changes on a return), which is the 
+         * only thing the pointsToPm verdicts depend on. A verdict is good if
+         * it was made at the current version.
+         */
+        uint64_t version_ = 0;
+        mutable llvm::DenseMap<const llvm::Value*, 
+                               std::pair<uint64_t, bool>> verdicts_;
 
     public:
-        PmDesc(llvm::Module &m);
+        /**
+         * With -mmap-aa, the PM mapping calls start out known.
+         */
+        PmDesc(AliasInfo::Shared alias);
+
+        /**
+         * Shares the sets, and starts without any verdicts.
+         */
+        PmDesc(const PmDesc &d);
+
+        PmDesc &operator=(const PmDesc &) = delete;
 
         /**
          * Sometimes for trace alias stuff, we may not have alias info for some
@@ -54,15 +157,30 @@ namespace pmfix {
         bool contains(const llvm::Value *v) const;
 
         /**
-         * Goes through the cache.
+         * Goes through the cache. res is false (and the set empty) if there 
+         * is no alias info for v.
+         */
+        const PtsSet &getPointsToSet(const llvm::Value *v, bool &res) const {
+            return alias_->getPointsToSet(v, res);
+        }
+
+        /**
+         * False for the objects that are never PM (stack slots, functions, 
+         * constants), which addKnownPmValue never records.
          */
-        bool getPointsToSet(const llvm::Value *v,                                  
-                            std::unordered_set<const llvm::Value *> &ptsSet) const;
+        static bool mayBePm(const llvm::Value *obj);
 
         /**
          * Get the number of the aliases that point to PM.
          */
-        size_t getNumPmAliases(const std::unordered_set<const llvm::Value *> &ptsSet) const;
+        size_t getNumPmAliases(const PtsSet &ptsSet) const;
+
+        /**
+         * The id of v in points-to sets, and back.
+         */
+        unsigned id(const llvm::Value *v) const { return alias_->id(v); }
+
+        const llvm::Value *value(unsigned id) const { return alias_->value(id); }
 
         /** 
          * Add a known PM value.
@@ -74,7 +192,17 @@ namespace pmfix {
 
         bool pointsToPm(llvm::Value *val) const;
 
-        void doReturn(const PmDesc &d) { pm_globals_ = d.pm_globals_; }
+        /**
+         * Take the globals of the callee we return from. Only the difference
+         * from our own globals is applied.
+         */
+        void doReturn(const PmDesc &d);
+
+        /**
+         * Add everything d knows to be PM, for when two paths reach the same
+         * context.
+         */
+        void merge(const PmDesc &d);
 
         /**
          * Returns true if this is subset of possSuper
@@ -104,27 +232,30 @@ namespace pmfix {
          * A stack is representable by who called it. A single CallBase
          * instruction gives us all the information we need.
          */
-        std::list<llvm::CallBase*> callStack_;
+        std::vector<llvm::CallBase*> callStack_;
+        // The same, for recursion checks.
+        llvm::DenseSet<const llvm::CallBase*> onStack_;
         // Allows us to reuse contexts.
         FnContextPtr parent_;
         // Tracks PM state at the context level.
         PmDesc pm_;
 
         /**
-         * We should also cache the called contexts for all the callsites in
-         * this function.
+         * Contexts are interned by call string: calling through the same call
+         * site from the same context always gives the same context, so the 
+         * graph can reuse its nodes. Weak, as callees keep their parents 
+         * alive rather than the other way around.
          */
-        std::shared_ptr<
-            std::unordered_map<llvm::CallBase*, FnContextPtr>
-        > callBaseCache_;
+        llvm::DenseMap<const llvm::CallBase*, std::weak_ptr<FnContext>> callees_;
+
+        FnContext(AliasInfo::Shared alias) 
+            : callStack_(), parent_(nullptr), pm_(alias) {}
 
-        FnContext(llvm::Module &m) 
-            : callBaseCache_(new std::unordered_map<llvm::CallBase*, FnContextPtr>), 
-              callStack_(), parent_(nullptr), pm_(m) {}
+        FnContext(const FnContextPtr &parent, llvm::CallBase *cb);
 
     public:
 
-        FnContext(const FnContext &fctx) = default;
+        FnContext(const FnContext &fctx) = delete;
         
         /**
          * Also handles propagation of PM.
@@ -138,12 +269,7 @@ namespace pmfix {
 
         bool canReturn() const { return !!parent_; }
 
-        bool contains(llvm::CallBase *cb) const {
-            for (auto *i : callStack_) {
-                if (cb == i) return true;
-            }
-            return false;
-        }
+        bool contains(llvm::CallBase *cb) const { return onStack_.count(cb); }
 
         /**
          * Also handles propagation of PM back
@@ -154,8 +280,8 @@ namespace pmfix {
 
         PmDesc &pm(void) { return pm_; }
 
-        static FnContextPtr create(llvm::Module &m) {
-            return std::shared_ptr<FnContext>(new FnContext(m));
+        static FnContextPtr create(AliasInfo::Shared alias) {
+            return std::shared_ptr<FnContext>(new FnContext(alias));
         }
 
         bool operator==(const FnContext &f) const;
@@ -173,9 +299,6 @@ namespace pmfix {
      * All the successor and parent stuff will be handled in the graph
      */
     struct ContextBlock {
-        typedef std::shared_ptr<ContextBlock> ContextBlockPtr;
-        typedef std::shared_ptr<ContextBlock> Shared;
-
     public:
         FnContext::Shared ctx;
         // Defines the starting boundary of the block (inclusive)
@@ -185,16 +308,22 @@ namespace pmfix {
         // Sometimes, the trace starts in the middle of one of these. So, we
         // want to indicate the interpretation start/end as well.
         llvm::Instruction *traceInst = nullptr;
- 
-        static ContextBlockPtr create(const BugLocationMapper &mapper, 
-                                      TraceEvent &te);
+
+        /**
+         * Not valid if the event couldn't be located.
+         */
+        static ContextBlock create(const BugLocationMapper &mapper, 
+                                   AliasInfo::Shared alias,
+                                   TraceEvent &te);
 
         /** 
          * Just finds the last instruction.
          */
-        static ContextBlockPtr create(FnContext::Shared ctx, 
-                                      llvm::Instruction *first,
-                                      llvm::Instruction *trace);
+        static ContextBlock create(FnContext::Shared ctx, 
+                                   llvm::Instruction *first,
+                                   llvm::Instruction *trace);
+
+        bool valid() const { return !!first; }
 
         std::string str(int indent=0) const;
 
@@ -208,44 +337,64 @@ namespace pmfix {
     };
 
     /**
-     * Represents the
+     * Represents the paths between two trace events, as blocks in their
+     * function contexts.
+     * 
+     * The nodes (and their blocks) live in an arena owned by the graph and 
+     * are addressed by 32-bit ids, so there is no refcounting and the whole
+     * graph goes away at once. A node's children are written all at once
+     * when it is constructed, so they are one run of children_; the parents
+     * are indexed the same way once the graph is done.
      */
     template <typename T>
     struct ContextGraph {
+        typedef uint32_t NodeId;
 
         struct GraphNode {
-            typedef std::shared_ptr<GraphNode> Shared;
-
-            ContextBlock::Shared block;
-            std::unordered_set<Shared> parents;
-            std::unordered_set<Shared> children;
+            ContextBlock block;
+            // Where the children are in children_.
+            uint32_t firstChild = 0;
+            uint32_t numChildren = 0;
             bool constructed = false;
+            // This is the block of the end event, not just a dead end.
+            bool isEnd = false;
             T metadata;
 
-            GraphNode(ContextBlock::Shared b) : block(b) {}
+            GraphNode(const ContextBlock &b) : block(b), metadata() {}
 
-            bool isTerminator() const { return children.empty() && constructed; }
+            bool isTerminator() const { return !numChildren && constructed; }
         };
 
-        typedef std::shared_ptr<GraphNode> GraphNodePtr;
-
     private:
+        std::vector<GraphNode> nodes_;
+        std::vector<NodeId> children_;
+        // The parents of n are parents_[parentStart_[n], parentStart_[n + 1]).
+        std::vector<uint32_t> parentStart_;
+        std::vector<NodeId> parents_;
+
         /**
          * A cache of:
          * 
-         * function context -> { instruction start -> Node }
+         * (function context, instruction start) -> Node
+         * 
+         * The contexts are kept alive by the blocks of the nodes.
          */
-        std::unordered_map<
-            FnContext::Shared,
-            std::unordered_map<
-                llvm::Instruction*,
-                GraphNodePtr
-            >
-        > nodeCache_;
+        llvm::DenseMap<std::pair<const FnContext*, const llvm::Instruction*>,
+                       NodeId> nodeCache_;
+        // Successors found in nodeCache_ rather than added.
+        size_t cacheHits_ = 0;
 
-        std::list<GraphNodePtr> constructSuccessors(GraphNodePtr node);
+        // With -pm-summaries, calls to functions that can't affect PM are 
+        // stepped over instead of descended into.
+        std::shared_ptr<PmSummaries> summaries_;
 
-        void construct(ContextBlock::Shared end);
+        NodeId addNode(const ContextBlock &b);
+
+        void constructSuccessors(NodeId node, std::vector<NodeId> &out);
+
+        void construct(const ContextBlock &end);
+
+        void indexParents(void);
 
     public:
 
@@ -254,12 +403,35 @@ namespace pmfix {
          * we have a one-to-many debug info mapping.
          */
 
-        std::list<GraphNodePtr> roots;
-        std::list<GraphNodePtr> leaves;
+        std::vector<NodeId> roots;
+        std::vector<NodeId> leaves;
 
         bool empty() const { return roots.empty() && leaves.empty(); }
 
+        size_t size() const { return nodes_.size(); }
+
+        /**
+         * How many edges led to a node that was already there (a join, or
+         * the head of a loop).
+         */
+        size_t cacheHits() const { return cacheHits_; }
+
+        GraphNode &operator[](NodeId id) { return nodes_[id]; }
+        const GraphNode &operator[](NodeId id) const { return nodes_[id]; }
+
+        llvm::ArrayRef<NodeId> children(NodeId id) const {
+            const GraphNode &n = nodes_[id];
+            return llvm::makeArrayRef(children_.data() + n.firstChild, 
+                                      n.numChildren);
+        }
+
+        llvm::ArrayRef<NodeId> parents(NodeId id) const {
+            return llvm::makeArrayRef(parents_.data() + parentStart_[id],
+                                      parentStart_[id + 1] - parentStart_[id]);
+        }
+
         ContextGraph(const BugLocationMapper &mapper, 
+                     AliasInfo::Shared alias,
                      TraceEvent &start, 
                      TraceEvent &end);
     };
@@ -268,21 +440,48 @@ namespace pmfix {
      * Analyze the flow between two points and figure out if we can remove 
      * a redundant operation along some paths.
      * 
+     * The start event is a flush, which leaves its cache line clean, and the
+     * end event flushes the same line again. This is a forward dataflow 
+     * analysis over the context graph of whether the line may have been 
+     * dirtied again in between: a PM store that may hit the line dirties it,
+     * and a flush of the same address cleans it. Loops are iterated to a 
+     * fixpoint. The end flush is redundant on a path if the line is clean 
+     * when the path gets there.
+     * 
      * TODO: make more generic.
      */
     class FlowAnalyzer {
     private:
+        /**
+         * What (part of) a block does to the line, whatever its state 
+         * before: the last store or flush that involves it decides.
+         */
+        enum Effect { KEEPS, SPOILS, CLEANS };
+
         /** 
          * The general idea is that we want to find the highest point at which
          * we know the operation is redundant, and instrument that block.
          */
         struct Info {
-            // Use this to cache results
-            bool updated = false;
-            bool isNotRedundant = false;
-            // For path stuff.
-            bool isRedtInParents = true;
-            bool isRedtInChildren = true;
+            Effect effect = KEEPS;
+            // Forward: the line may be dirty when the block starts.
+            bool mayBeDirty = false;
+            bool visited = false;
+            // Backward: staysClean[d] if, starting the block with the line 
+            // dirty (d) or clean (!d), every path on to the end flush gets 
+            // there with the line clean.
+            bool staysClean[2] = {true, true};
+        };
+
+        /**
+         * The abstraction of the line the start event flushes: its address,
+         * and that address as a constant offset from some base. Unknown if
+         * we couldn't find the flush, in which case any PM store dirties it.
+         */
+        struct FlushedLine {
+            const llvm::Value *ptr = nullptr;
+            const llvm::Value *base = nullptr;
+            int64_t offset = 0;
         };
 
         llvm::Module &m_;
@@ -292,22 +491,44 @@ namespace pmfix {
         TraceEvent &end_;
         ContextGraph<Info> graph_;
 
+        FlushedLine line_;
+        bool solved_ = false;
+        bool alwaysRedundant_ = false;
+
+        static bool dirtyAfter(Effect e, bool dirty) {
+            return e == KEEPS ? dirty : e == SPOILS;
+        }
+
+        void findFlushedLine(void);
+
         /**
-         * This "interprets" a node to determine if a flush would still be 
-         * considered redundant at the end.
-         * 
-         * Returns true if the flush is still redundant, false if not provable.
+         * May a write of size bytes (~0 if unknown) at addr dirty the line?
+         */
+        bool mayDirty(PmDesc &pm, llvm::Value *addr, uint64_t size) const;
+
+        bool cleans(llvm::Instruction *flush) const;
+
+        /**
+         * This "interprets" the instructions of a node in [start, stop) (or 
+         * to the end of the node if stop is null) to see what they do to
+         * the line.
+         */
+        Effect interpret(ContextGraph<Info>::NodeId node,
+                         llvm::Instruction *start, llvm::Instruction *stop);
+
+        /**
+         * Runs both directions of the analysis, once.
          */
-        bool interpret(ContextGraph<Info>::GraphNodePtr node,
-                       llvm::Instruction *start, llvm::Instruction *end);
+        void solve(void);
 
     public:
         FlowAnalyzer(llvm::Module &m, 
                      const BugLocationMapper &mapper, 
+                     AliasInfo::Shared alias,
                      TraceEvent &start, 
                      TraceEvent &end) 
             : m_(m), mapper_(mapper), start_(start), end_(end),
-              graph_(mapper, start, end) {}
+              graph_(mapper, alias, start, end) {}
 
         /**
          * Return true if we can do anything at all, false otherwise.
@@ -0,0 +1,458 @@
+#include "InclusionAA.hpp"
+
+#include <algorithm>
+#include <deque>
+#include <numeric>
+
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "PassUtils.hpp"
+#include "PointsToModel.hpp"
+
+using namespace llvm;
+using namespace pmfix;
+using namespace pmfix::ptmodel;
+
+static const unsigned NO_NODE = ~0u;
+
+// Levels smaller than this aren't worth starting threads for.
+static const size_t MIN_PARALLEL_LEVEL = 64;
+
+#pragma region Constraints
+
+InclusionAA::InclusionAA(Module &m, const Scope &scope) 
+    : m_(m), scope_(scope) {
+    build();
+}
+
+unsigned InclusionAA::newNode(void) {
+    complex_.emplace_back();
+    return numNodes_++;
+}
+
+unsigned InclusionAA::object(const Value *v) {
+    auto it = objectIds_.find(v);
+    if (it != objectIds_.end()) return it->second;
+
+    unsigned id = objects_.size();
+    objects_.push_back(v);
+    objectIds_[v] = id;
+    content_.push_back(newNode());
+    return id;
+}
+
+unsigned InclusionAA::node(const Value *v) {
+    auto it = values_.find(v);
+    if (it != values_.end()) return it->second;
+
+    unsigned n = newNode();
+    values_[v] = n;
+
+    // Instructions get their constraints in build().
+    if (scope_.isObject(v)) {
+        addrs_.emplace_back(n, object(v));
+    } else if (isa<Constant>(v)) {
+        SmallVector<const Value*, 2> srcs;
+        copySources(v, srcs);
+        for (const Value *src : srcs) copies_.emplace_back(node(src), n);
+    }
+
+    return n;
+}
+
+unsigned InclusionAA::deref(const Value *v) {
+    auto it = derefs_.find(v);
+    if (it != derefs_.end()) return it->second;
+
+    unsigned n = newNode();
+    derefs_[v] = n;
+    return n;
+}
+
+unsigned InclusionAA::lookup(const Value *v) const {
+    auto it = values_.find(v);
+    return it == values_.end() ? NO_NODE : it->second;
+}
+
+void InclusionAA::addCall(const CallBase *cb, const Function *f,
+                          std::vector<std::pair<unsigned, unsigned>> &copies,
+                          std::vector<std::pair<unsigned, unsigned>> &addrs) const {
+    unsigned result = lookup(cb);
+
+    if (!scope_.hasBody(f)) {
+        if (returnsFirstArg(f) && cb->arg_size()) {
+            unsigned arg = lookup(cb->getArgOperand(0));
+            if (arg != NO_NODE) copies.emplace_back(arg, result);
+        } else {
+            addrs.emplace_back(result, objectIds_.lookup(cb));
+        }
+        return;
+    }
+
+    unsigned nargs = std::min<unsigned>(cb->arg_size(), f->arg_size());
+    for (unsigned i = 0; i < nargs; ++i) {
+        unsigned arg = lookup(cb->getArgOperand(i));
+        unsigned param = lookup(f->arg_begin() + i);
+        if (arg != NO_NODE && param != NO_NODE) copies.emplace_back(arg, param);
+    }
+
+    std::vector<const Value*> rets;
+    returnValues(f, rets);
+    for (const Value *r : rets) {
+        unsigned ret = lookup(r);
+        if (ret != NO_NODE) copies.emplace_back(ret, result);
+    }
+}
+
+void InclusionAA::build(void) {
+    for (const GlobalVariable &g : m_.globals()) node(&g);
+    for (const Function &f : m_) {
+        node(&f);
+
+        // Where calls through pointers can reach.
+        if (f.hasAddressTaken() && scope_.hasBody(&f)) {
+            for (const Argument &a : f.args()) {
+                if (mayHoldPointer(a.getType())) node(&a);
+            }
+            std::vector<const Value*> rets;
+            returnValues(&f, rets);
+            for (const Value *r : rets) node(r);
+        }
+    }
+
+    for (const Function &f : m_) {
+        if (!scope_.hasBody(&f)) continue;
+
+        for (const BasicBlock &b : f) {
+            for (const Instruction &i : b) {
+                auto *cb = dyn_cast<CallBase>(&i);
+                if (!cb) {
+                    if (!mayHoldPointer(i.getType())) continue;
+
+                    unsigned n = node(&i);
+                    if (const Value *from = loadSource(&i)) {
+                        complex_[node(from)].push_back({Complex::LOAD, n, nullptr});
+                    } else {
+                        SmallVector<const Value*, 4> srcs;
+                        copySources(&i, srcs);
+                        for (const Value *src : srcs) {
+                            copies_.emplace_back(node(src), n);
+                        }
+                    }
+                    continue;
+                }
+
+                const Value *dst, *src;
+                if (copiesMemory(cb, dst, src)) {
+                    unsigned d = deref(src);
+                    complex_[node(src)].push_back({Complex::LOAD, d, nullptr});
+                    complex_[node(dst)].push_back({Complex::STORE, d, nullptr});
+                }
+
+                unsigned result = node(cb);
+                for (const Value *arg : cb->args()) {
+                    if (mayHoldPointer(arg->getType())) node(arg);
+                }
+
+                const Value *callee = cb->getCalledValue()->stripPointerCasts();
+                if (auto *f = dyn_cast<Function>(callee)) {
+                    if (!scope_.hasBody(f)) {
+                        object(cb);
+                    } else {
+                        for (const Argument &a : f->args()) {
+                            if (mayHoldPointer(a.getType())) node(&a);
+                        }
+                        std::vector<const Value*> rets;
+                        returnValues(f, rets);
+                        for (const Value *r : rets) node(r);
+                    }
+                    addCall(cb, f, copies_, addrs_);
+                } else if (isa<InlineAsm>(callee)) {
+                    addrs_.emplace_back(result, object(cb));
+                } else {
+                    // If it calls something external, the result is new.
+                    object(cb);
+                    complex_[node(callee)].push_back({Complex::CALL, result, cb});
+                }
+            }
+        }
+    }
+
+    std::vector<std::pair<const Value*, const Value*>> stores;
+    collectStores(m_, scope_, stores);
+    for (const auto &st : stores) {
+        unsigned what = node(st.second);
+        complex_[node(st.first)].push_back({Complex::STORE, what, nullptr});
+    }
+}
+
+void InclusionAA::resolve(const Complex &c, unsigned obj,
+                          std::vector<std::pair<unsigned, unsigned>> &edges,
+                          std::vector<std::pair<unsigned, unsigned>> &addrs) const {
+    switch (c.kind) {
+        case Complex::LOAD:
+            edges.emplace_back(content_[obj], c.other);
+            break;
+        case Complex::STORE:
+            edges.emplace_back(c.other, content_[obj]);
+            break;
+        case Complex::CALL:
+            if (auto *f = dyn_cast<Function>(objects_[obj])) {
+                addCall(c.call, f, edges, addrs);
+            }
+            break;
+    }
+}
+
+#pragma endregion
+
+#pragma region Solvers
+
+void InclusionAA::solveSerial(void) {
+    pts_.assign(numNodes_, ObjSet());
+    rep_.resize(numNodes_);
+    std::iota(rep_.begin(), rep_.end(), 0);
+
+    std::vector<std::vector<unsigned>> succs(numNodes_);
+    DenseSet<std::pair<unsigned, unsigned>> edges;
+    // What each node's complex constraints have been resolved against.
+    std::vector<ObjSet> done(numNodes_);
+
+    std::deque<unsigned> work;
+    std::vector<bool> queued(numNodes_, false);
+    auto push = [&] (unsigned n) {
+        if (!queued[n]) {
+            queued[n] = true;
+            work.push_back(n);
+        }
+    };
+
+    auto addEdge = [&] (unsigned a, unsigned b) {
+        if (a == b || !edges.insert({a, b}).second) return;
+        succs[a].push_back(b);
+        if (pts_[b] |= pts_[a]) push(b);
+    };
+
+    for (const auto &e : copies_) addEdge(e.first, e.second);
+    for (const auto &a : addrs_) {
+        if (pts_[a.first].test_and_set(a.second)) push(a.first);
+    }
+
+    std::vector<std::pair<unsigned, unsigned>> newEdges, newAddrs;
+    while (!work.empty()) {
+        unsigned n = work.front();
+        work.pop_front();
+        queued[n] = false;
+
+        if (!complex_[n].empty()) {
+            ObjSet delta(pts_[n]);
+            delta.intersectWithComplement(done[n]);
+            if (!delta.empty()) {
+                done[n] |= delta;
+
+                newEdges.clear();
+                newAddrs.clear();
+                for (const Complex &c : complex_[n]) {
+                    for (unsigned obj : delta) resolve(c, obj, newEdges, newAddrs);
+                }
+
+                for (const auto &e : newEdges) addEdge(e.first, e.second);
+                for (const auto &a : newAddrs) {
+                    if (pts_[a.first].test_and_set(a.second)) push(a.first);
+                }
+            }
+        }
+
+        for (unsigned s : succs[n]) {
+            if (pts_[s] |= pts_[n]) push(s);
+        }
+    }
+}
+
+void InclusionAA::solveParallel(void) {
+    pts_.assign(numNodes_, ObjSet());
+    rep_.resize(numNodes_);
+    std::iota(rep_.begin(), rep_.end(), 0);
+
+    // The copy graph, as predecessors so a node can pull into its own set.
+    std::vector<std::vector<unsigned>> preds(numNodes_);
+    for (const auto &e : copies_) preds[e.second].push_back(e.first);
+    for (const auto &a : addrs_) pts_[a.first].set(a.second);
+
+    DenseSet<std::pair<unsigned, unsigned>> edges(copies_.size());
+    for (const auto &e : copies_) edges.insert(e);
+
+    std::vector<ObjSet> done(numNodes_);
+    std::vector<unsigned> withComplex;
+    for (unsigned n = 0; n < numNodes_; ++n) {
+        if (!complex_[n].empty()) withComplex.push_back(n);
+    }
+
+    std::vector<int> index(numNodes_), low(numNodes_);
+    std::vector<bool> onStack(numNodes_);
+    std::vector<unsigned> stack, order, level(numNodes_);
+    std::vector<std::pair<unsigned, size_t>> calls;
+
+    size_t waves = 0;
+    for (bool changed = true; changed; ++waves) {
+        /**
+         * 1. Collapse cycles (Tarjan's, over the predecessor edges). SCCs 
+         * come out with all their predecessors before them, which is the 
+         * order to propagate in.
+         */
+        std::fill(index.begin(), index.end(), -1);
+        order.clear();
+        int next = 0;
+        for (unsigned s = 0; s < numNodes_; ++s) {
+            if (rep_[s] != s || index[s] >= 0) continue;
+
+            index[s] = low[s] = next++;
+            stack.push_back(s);
+            onStack[s] = true;
+            calls.push_back({s, 0});
+
+            while (!calls.empty()) {
+                unsigned v = calls.back().first;
+                if (calls.back().second < preds[v].size()) {
+                    unsigned w = preds[v][calls.back().second++];
+                    if (index[w] < 0) {
+                        index[w] = low[w] = next++;
+                        stack.push_back(w);
+                        onStack[w] = true;
+                        calls.push_back({w, 0});
+                    } else if (onStack[w]) {
+                        low[v] = std::min(low[v], index[w]);
+                    }
+                    continue;
+                }
+
+                calls.pop_back();
+                if (!calls.empty()) {
+                    unsigned u = calls.back().first;
+                    low[u] = std::min(low[u], low[v]);
+                }
+                if (low[v] != index[v]) continue;
+
+                unsigned w;
+                do {
+                    w = stack.back();
+                    stack.pop_back();
+                    onStack[w] = false;
+                    if (w == v) break;
+
+                    rep_[w] = v;
+                    pts_[v] |= pts_[w];
+                    pts_[w].clear();
+                    preds[v].insert(preds[v].end(), preds[w].begin(), preds[w].end());
+                    std::vector<unsigned>().swap(preds[w]);
+                } while (true);
+                order.push_back(v);
+            }
+        }
+
+        for (unsigned n = 0; n < numNodes_; ++n) {
+            unsigned r = rep_[n];
+            while (rep_[r] != r) r = rep_[r];
+            rep_[n] = r;
+        }
+
+        /**
+         * 2. Propagate through the DAG a level at a time.
+         */
+        std::vector<std::vector<unsigned>> levels;
+        for (unsigned r : order) {
+            std::vector<unsigned> &ps = preds[r];
+            for (unsigned &p : ps) p = rep_[p];
+            std::sort(ps.begin(), ps.end());
+            ps.erase(std::unique(ps.begin(), ps.end()), ps.end());
+            ps.erase(std::remove(ps.begin(), ps.end(), r), ps.end());
+
+            unsigned l = 0;
+            for (unsigned p : ps) l = std::max(l, level[p] + 1);
+            level[r] = l;
+            if (l >= levels.size()) levels.resize(l + 1);
+            levels[l].push_back(r);
+        }
+
+        for (size_t l = 1; l < levels.size(); ++l) {
+            const std::vector<unsigned> &nodes = levels[l];
+            auto pull = [&] (size_t k) {
+                unsigned r = nodes[k];
+                for (unsigned p : preds[r]) pts_[r] |= pts_[p];
+            };
+
+            if (nodes.size() < MIN_PARALLEL_LEVEL) {
+                for (size_t k = 0; k < nodes.size(); ++k) pull(k);
+            } else {
+                utils::parallelFor(nodes.size(), pull);
+            }
+        }
+
+        /**
+         * 3. Resolve the complex constraints against what's new.
+         */
+        std::vector<std::vector<std::pair<unsigned, unsigned>>> 
+            newEdges(withComplex.size()), newAddrs(withComplex.size());
+        utils::parallelFor(withComplex.size(), [&] (size_t k) {
+            unsigned n = withComplex[k];
+            ObjSet delta(pts_[rep_[n]]);
+            delta.intersectWithComplement(done[n]);
+            if (delta.empty()) return;
+
+            done[n] |= delta;
+            for (const Complex &c : complex_[n]) {
+                for (unsigned obj : delta) resolve(c, obj, newEdges[k], newAddrs[k]);
+            }
+        });
+
+        changed = false;
+        for (size_t k = 0; k < withComplex.size(); ++k) {
+            for (const auto &e : newEdges[k]) {
+                if (!edges.insert(e).second) continue;
+                unsigned a = rep_[e.first], b = rep_[e.second];
+                if (a == b) continue;
+                preds[b].push_back(a);
+                changed = true;
+            }
+            for (const auto &a : newAddrs[k]) {
+                if (pts_[rep_[a.first]].test_and_set(a.second)) changed = true;
+            }
+        }
+    }
+
+    errs() << "InclusionAA: " << numNodes_ << " nodes, " << objects_.size() 
+        << " objects, solved in " << waves << " waves\n";
+}
+
+void InclusionAA::solve(bool parallel) {
+    if (parallel) solveParallel();
+    else solveSerial();
+}
+
+#pragma endregion
+
+#pragma region Queries
+
+bool InclusionAA::getPointsToSet(const Value *v, 
+                                 std::vector<const Value*> &ptsSet) const {
+    if (!v->getType()->isPointerTy()) return false;
+
+    unsigned n = lookup(v);
+    if (n == NO_NODE) return true;
+
+    for (unsigned id : pts_[rep_[n]]) ptsSet.push_back(objects_[id]);
+    return true;
+}
+
+bool InclusionAA::sameAs(const InclusionAA &other) const {
+    if (numNodes_ != other.numNodes_ || objects_ != other.objects_) return false;
+
+    for (unsigned n = 0; n < numNodes_; ++n) {
+        if (pts_[rep_[n]] != other.pts_[other.rep_[n]]) return false;
+    }
+    return true;
+}
+
+#pragma endregion
@@ -0,0 +1,137 @@
+#pragma once
+/**
+ * Whole-module inclusion-based (Andersen-style) points-to analysis, with a
+ * parallel solver (-parallel-aa).
+ *
+ * The constraints are read off the IR with the same rules as DemandAA (see 
+ * PointsToModel.hpp). There are two solvers for them:
+ *
+ *  - serial: the textbook worklist algorithm.
+ *  - parallel: wave propagation (Pereira and Berlin, "Wave Propagation and 
+ *    Deep Propagation for Pointer Analysis", CGO '09). Each wave collapses 
+ *    the cycles of the copy graph, pushes points-to sets through the 
+ *    resulting DAG a topological level at a time, then resolves the loads,
+ *    stores and indirect calls against what changed. Nodes in a level only 
+ *    read from earlier levels and each writes only its own set, and the 
+ *    complex constraints only read sets, so the parallel parts need no locks.
+ *    New edges are merged between phases.
+ *
+ * Both compute the least solution, so they must agree exactly; 
+ * -verify-parallel-aa runs both and checks.
+ */
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SparseBitVector.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/Module.h"
+
+#include "PointsToModel.hpp"
+
+namespace pmfix {
+
+class InclusionAA {
+private:
+    typedef llvm::SparseBitVector<> ObjSet;
+
+    /**
+     * A constraint on whatever the node it's filed under points to.
+     */
+    struct Complex {
+        enum Kind { 
+            // other = *node
+            LOAD, 
+            // *node = other
+            STORE, 
+            // call is an indirect call through node, and other is its result.
+            CALL 
+        };
+
+        Kind kind;
+        unsigned other;
+        const llvm::CallBase *call;
+    };
+
+    llvm::Module &m_;
+    ptmodel::Scope scope_;
+
+    std::vector<const llvm::Value*> objects_;
+    llvm::DenseMap<const llvm::Value*, unsigned> objectIds_;
+
+    // Nodes: a pointer value, the contents of an object (content_, by 
+    // object id), or the contents of a memcpy source (derefs_).
+    unsigned numNodes_ = 0;
+    llvm::DenseMap<const llvm::Value*, unsigned> values_;
+    std::vector<unsigned> content_;
+    llvm::DenseMap<const llvm::Value*, unsigned> derefs_;
+
+    std::vector<std::pair<unsigned, unsigned>> addrs_;   // (node, object)
+    std::vector<std::pair<unsigned, unsigned>> copies_;  // (from, to)
+    std::vector<std::vector<Complex>> complex_;          // by node
+
+    // The solution. Nodes in a cycle share the set of their representative.
+    std::vector<ObjSet> pts_;
+    std::vector<unsigned> rep_;
+
+    unsigned newNode(void);
+
+    unsigned object(const llvm::Value *v);
+
+    unsigned node(const llvm::Value *v);
+
+    unsigned deref(const llvm::Value *v);
+
+    unsigned lookup(const llvm::Value *v) const;
+
+    void build(void);
+
+    /**
+     * Edges for a call of f at cb. The nodes involved must already exist.
+     */
+    void addCall(const llvm::CallBase *cb, const llvm::Function *f,
+                 std::vector<std::pair<unsigned, unsigned>> &copies,
+                 std::vector<std::pair<unsigned, unsigned>> &addrs) const;
+
+    /**
+     * The edges and objects that a complex constraint adds for an object
+     * its node newly points to. Only reads the constraint graph.
+     */
+    void resolve(const Complex &c, unsigned obj,
+                 std::vector<std::pair<unsigned, unsigned>> &edges,
+                 std::vector<std::pair<unsigned, unsigned>> &addrs) const;
+
+    void solveSerial(void);
+
+    void solveParallel(void);
+
+public:
+    /**
+     * Collects the constraints. Nothing is solved yet.
+     */
+    InclusionAA(llvm::Module &m, const ptmodel::Scope &scope = ptmodel::Scope());
+
+    InclusionAA(const InclusionAA &) = delete;
+
+    void solve(bool parallel);
+
+    /**
+     * Same contract as Andersen's: returns false if v isn't a pointer.
+     */
+    bool getPointsToSet(const llvm::Value *v, 
+                        std::vector<const llvm::Value*> &ptsSet) const;
+
+    void getAllAllocationSites(std::vector<const llvm::Value*> &sites) const {
+        sites = objects_;
+    }
+
+    /**
+     * True if both solved the same module to the same sets.
+     */
+    bool sameAs(const InclusionAA &other) const;
+};
+
+}
@@ -0,0 +1,316 @@
+#include "MapperCache.hpp"
+
+#include <cstring>
+#include <limits>
+#include <unordered_map>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "CacheFile.hpp"
+
+using namespace llvm;
+using namespace pmfix;
+using namespace pmfix::utils;
+
+constexpr char MapperCacheHeader::MAGIC[8];
+constexpr uint32_t MapperCacheHeader::VERSION;
+
+namespace {
+
+template<typename T>
+void put(std::vector<uint8_t> &buf, const T &val) {
+    const uint8_t *p = reinterpret_cast<const uint8_t*>(&val);
+    buf.insert(buf.end(), p, p + sizeof(T));
+}
+
+void put(std::vector<uint8_t> &buf, StringRef s) {
+    put(buf, (uint64_t)s.size());
+    buf.insert(buf.end(), s.bytes_begin(), s.bytes_end());
+}
+
+}
+
+MapperCache::MapperCache(Module &m, const std::string &dir) : m_(m) {
+    scan();
+
+    SmallString<32> digest = hash_.digest();
+    SmallString<128> path(dir);
+    sys::path::append(path, Twine(digest) + ".pmfxmap");
+    path_ = path.str();
+}
+
+void MapperCache::scan(void) {
+    MD5 hash;
+    DenseMap<const DIFile*, uint32_t> files;
+    std::vector<uint8_t> buf;
+
+    for (Function &f : m_) {
+        functions_.push_back(blocks_.size());
+        buf.clear();
+        put(buf, f.getName());
+
+        for (BasicBlock &b : f) {
+            blocks_.push_back(insts_.size());
+            put(buf, UINT32_MAX);
+
+            for (Instruction &i : b) {
+                insts_.push_back(&i);
+                put(buf, i.getOpcode());
+
+                if (auto *cb = dyn_cast<CallBase>(&i)) {
+                    Function *callee = cb->getCalledFunction();
+                    put(buf, callee ? (uint32_t)callee->getIntrinsicID() : 0u);
+                }
+
+                // Everything BugLocationMapper::indexFunction looks at.
+                auto *di = dyn_cast_or_null<DILocation>(
+                    i.getMetadata(LLVMContext::MD_dbg));
+                if (!di) {
+                    put(buf, (uint8_t)0);
+                    continue;
+                }
+
+                put(buf, (uint8_t)1);
+                put(buf, di->getLine());
+                const DIFile *df = di->getScope()->getFile();
+                auto res = files.insert({df, (uint32_t)files.size()});
+                put(buf, res.first->second);
+                if (res.second) put(buf, df->getFilename());
+            }
+        }
+
+        hash.update(makeArrayRef(buf));
+    }
+
+    hash.final(hash_);
+}
+
+Instruction *MapperCache::inst(uint32_t f, uint32_t b, uint32_t i) const {
+    if (f >= functions_.size()) return nullptr;
+    uint64_t blockEnd = f + 1 < functions_.size() ? functions_[f + 1]
+                                                  : blocks_.size();
+    uint64_t block = (uint64_t)functions_[f] + b;
+    if (block >= blockEnd) return nullptr;
+
+    uint64_t instEnd = block + 1 < blocks_.size() ? blocks_[block + 1]
+                                                  : insts_.size();
+    uint64_t flat = (uint64_t)blocks_[block] + i;
+    if (flat >= instEnd) return nullptr;
+
+    return insts_[flat];
+}
+
+MapperCacheInst MapperCache::ordinals(uint32_t flat) const {
+    // Blocks are never empty, but functions can be.
+    uint32_t block = std::upper_bound(blocks_.begin(), blocks_.end(), flat) -
+                     blocks_.begin() - 1;
+    uint32_t f = std::upper_bound(functions_.begin(), functions_.end(), block) -
+                 functions_.begin() - 1;
+
+    MapperCacheInst mi;
+    mi.function = f;
+    mi.block = block - functions_[f];
+    mi.inst = flat - blocks_[block];
+    return mi;
+}
+
+bool MapperCache::load(BugLocationMapper &mapper) const {
+    // No null terminator needed, which lets large files get mmap'd.
+    auto bufOrErr = MemoryBuffer::getFile(path_, -1,
+                                          /*RequiresNullTerminator=*/false);
+    // Not being there is the usual case.
+    if (!bufOrErr) return false;
+    const MemoryBuffer &buf = *bufOrErr.get();
+
+    if (buf.getBufferSize() < sizeof(MapperCacheHeader)) return false;
+    auto *header = reinterpret_cast<const MapperCacheHeader*>(
+        buf.getBufferStart());
+
+    if (memcmp(header->magic, MapperCacheHeader::MAGIC,
+               sizeof(MapperCacheHeader::MAGIC)) ||
+        header->version != MapperCacheHeader::VERSION ||
+        memcmp(header->hash, hash_.Bytes.data(), sizeof(header->hash))) {
+        errs() << "Ignoring stale location index " << path_ << "\n";
+        return false;
+    }
+
+    ArrayRef<uint64_t> stringOffsets;
+    ArrayRef<MapperCacheLocation> locations;
+    ArrayRef<MapperCacheInst> insts;
+    ArrayRef<MapperCacheFixLoc> fixLocs;
+    // There is one more offset than strings, so that mustn't wrap.
+    if (header->numStrings == std::numeric_limits<uint64_t>::max() ||
+        !section(buf, header->stringsOffset, header->numStrings + 1, stringOffsets) ||
+        !section(buf, header->locationsOffset, header->numLocations, locations) ||
+        !section(buf, header->instsOffset, header->numInsts, insts) ||
+        !section(buf, header->fixLocsOffset, header->numFixLocs, fixLocs)) {
+        errs() << "Malformed location index " << path_ << "!\n";
+        return false;
+    }
+
+    // String bytes directly follow the offset table.
+    uint64_t dataStart = header->stringsOffset +
+        stringOffsets.size() * sizeof(uint64_t);
+    if (!sliceFits(dataStart, stringOffsets.back(), buf.getBufferSize())) {
+        errs() << "Malformed location index " << path_ << "!\n";
+        return false;
+    }
+    // Every string has at least its NUL, so the offsets strictly increase.
+    for (size_t i = 0; i + 1 < stringOffsets.size(); ++i) {
+        if (stringOffsets[i] >= stringOffsets[i + 1]) {
+            errs() << "Malformed location index " << path_ << "!\n";
+            return false;
+        }
+    }
+    const char *stringData = buf.getBufferStart() + dataStart;
+    auto string = [&] (uint32_t idx) {
+        return StringRef(stringData + stringOffsets[idx],
+                         stringOffsets[idx + 1] - stringOffsets[idx] - 1);
+    };
+
+    // Rebind into fresh tables, so a bad file leaves the mapper alone.
+    decltype(mapper.locMap_) locMap;
+    decltype(mapper.fixLocMap_) fixLocMap;
+    decltype(mapper.sites_) sites;
+
+    for (const MapperCacheLocation &ml : locations) {
+        if (ml.function >= header->numStrings || ml.file >= header->numStrings ||
+            !sliceFits(ml.firstInst, ml.numInsts, insts.size()) ||
+            !sliceFits(ml.firstFixLoc, ml.numFixLocs, fixLocs.size())) {
+            errs() << "Malformed location index " << path_ << "!\n";
+            return false;
+        }
+
+        LocationInfo li;
+        li.function = string(ml.function);
+        li.file = string(ml.file);
+        li.line = ml.line;
+
+        std::list<Instruction*> &locInsts = locMap[li];
+        for (const MapperCacheInst &mi : insts.slice(ml.firstInst, ml.numInsts)) {
+            Instruction *i = inst(mi.function, mi.block, mi.inst);
+            if (!i) {
+                errs() << "Bad instruction in location index " << path_ << "!\n";
+                return false;
+            }
+            locInsts.push_back(i);
+        }
+
+        std::list<FixLoc> locs;
+        for (const MapperCacheFixLoc &mf :
+                fixLocs.slice(ml.firstFixLoc, ml.numFixLocs)) {
+            Instruction *first = inst(mf.function, mf.block, mf.first);
+            Instruction *last = inst(mf.function, mf.block, mf.last);
+            if (!first || !last) {
+                errs() << "Bad instruction in location index " << path_ << "!\n";
+                return false;
+            }
+            locs.emplace_back(first, last, li);
+        }
+
+        fixLocMap[li] = sites.size();
+        sites.push_back(std::move(locs));
+    }
+
+    if (fixLocMap.empty()) return false;
+
+    mapper.locMap_ = std::move(locMap);
+    mapper.fixLocMap_ = std::move(fixLocMap);
+    mapper.sites_ = std::move(sites);
+    return true;
+}
+
+bool MapperCache::save(const BugLocationMapper &mapper) const {
+    DenseMap<const Instruction*, uint32_t> flat;
+    flat.reserve(insts_.size());
+    for (uint32_t k = 0; k < insts_.size(); ++k) flat[insts_[k]] = k;
+
+    std::vector<const LocationInfo*> bySite(mapper.sites_.size(), nullptr);
+    for (const auto &p : mapper.fixLocMap_) bySite[p.second] = &p.first;
+
+    std::vector<std::string> strings;
+    StringMap<uint32_t> stringIds;
+    auto internString = [&] (const std::string &s) {
+        auto res = stringIds.insert({s, (uint32_t)strings.size()});
+        if (res.second) strings.push_back(s);
+        return res.first->second;
+    };
+
+    std::vector<MapperCacheLocation> locations;
+    std::vector<MapperCacheInst> insts;
+    std::vector<MapperCacheFixLoc> fixLocs;
+    locations.reserve(bySite.size());
+
+    for (size_t site = 0; site < bySite.size(); ++site) {
+        const LocationInfo &li = *bySite[site];
+
+        MapperCacheLocation ml;
+        ml.function = internString(li.function);
+        ml.file = internString(li.file);
+        ml.line = li.line;
+        ml.firstInst = insts.size();
+        ml.firstFixLoc = fixLocs.size();
+
+        for (Instruction *i : mapper.locMap_.at(li)) {
+            insts.push_back(ordinals(flat.lookup(i)));
+        }
+
+        for (const FixLoc &fl : mapper.sites_[site]) {
+            MapperCacheInst first = ordinals(flat.lookup(fl.first));
+            MapperCacheInst last = ordinals(flat.lookup(fl.last));
+            assert(first.function == last.function && first.block == last.block &&
+                   "fix locations should be in one block!");
+
+            MapperCacheFixLoc mf;
+            mf.function = first.function;
+            mf.block = first.block;
+            mf.first = first.inst;
+            mf.last = last.inst;
+            fixLocs.push_back(mf);
+        }
+
+        ml.numInsts = insts.size() - ml.firstInst;
+        ml.numFixLocs = fixLocs.size() - ml.firstFixLoc;
+        locations.push_back(ml);
+    }
+
+    std::vector<uint64_t> stringOffsets;
+    std::string stringData;
+    for (const std::string &s : strings) {
+        stringOffsets.push_back(stringData.size());
+        stringData.append(s);
+        stringData.push_back('\0');
+    }
+    stringOffsets.push_back(stringData.size());
+
+    MapperCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MapperCacheHeader::MAGIC, sizeof(header.magic));
+    header.version = MapperCacheHeader::VERSION;
+    memcpy(header.hash, hash_.Bytes.data(), sizeof(header.hash));
+
+    std::string out(sizeof(header), '\0');
+    header.numStrings = strings.size();
+    header.stringsOffset = out.size();
+    putArray(out, stringOffsets);
+    out.append(stringData);
+    alignSection(out);
+    header.numLocations = locations.size();
+    header.locationsOffset = out.size();
+    putArray(out, locations);
+    header.numInsts = insts.size();
+    header.instsOffset = out.size();
+    putArray(out, insts);
+    header.numFixLocs = fixLocs.size();
+    header.fixLocsOffset = out.size();
+    putArray(out, fixLocs);
+    memcpy(&out[0], &header, sizeof(header));
+
+    return writeFileAtomically(path_, out, "location index");
+}
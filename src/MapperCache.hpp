@@ -0,0 +1,137 @@
+#pragma once
+/**
+ * On-disk cache of the BugLocationMapper index.
+ *
+ * Building the index walks every instruction of the module and orders the
+ * instructions of each source location, which on a linked library is most of
+ * the startup time. We usually repair the same bitcode against many traces, so
+ * the index is saved with instructions as (function, block, instruction)
+ * ordinals, and later runs map it and rebind the ordinals to the module.
+ *
+ * The file is keyed by a hash of everything the index depends on: function
+ * names, and the opcode and debug location of every instruction. So any
+ * change to the module that could move an ordinal gives a different key.
+ *
+ * Layout (all little-endian, every section 8-byte aligned):
+ *
+ *  [MapperCacheHeader]
+ *  [uint64_t string offsets (numStrings + 1)][string bytes, NUL separated]
+ *  [MapperCacheLocation x numLocations]
+ *  [MapperCacheInst x numInsts]
+ *  [MapperCacheFixLoc x numFixLocs]
+ */
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MD5.h"
+
+#include "BugReports.hpp"
+
+namespace pmfix {
+
+struct MapperCacheHeader {
+    static constexpr char MAGIC[8] = {'P', 'M', 'F', 'X', 'M', 'A', 'P', '\0'};
+    static constexpr uint32_t VERSION = 1;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    // Module hash, see MapperCache.
+    uint8_t hash[16];
+    uint64_t numStrings;
+    uint64_t stringsOffset;
+    uint64_t numLocations;
+    uint64_t locationsOffset;
+    uint64_t numInsts;
+    uint64_t instsOffset;
+    uint64_t numFixLocs;
+    uint64_t fixLocsOffset;
+};
+static_assert(sizeof(MapperCacheHeader) == 96, "header layout changed!");
+
+/**
+ * A source location. Its index in the file is its site id.
+ */
+struct MapperCacheLocation {
+    uint32_t function;
+    uint32_t file;
+    int64_t line;
+    // Every instruction at the location, in module order.
+    uint64_t firstInst;
+    // The fix locations of the site.
+    uint64_t firstFixLoc;
+    uint32_t numInsts;
+    uint32_t numFixLocs;
+};
+static_assert(sizeof(MapperCacheLocation) == 40, "location layout changed!");
+
+struct MapperCacheInst {
+    uint32_t function;
+    uint32_t block;
+    uint32_t inst;
+};
+static_assert(sizeof(MapperCacheInst) == 12, "inst layout changed!");
+
+/**
+ * First and last instruction, always in the same block.
+ */
+struct MapperCacheFixLoc {
+    uint32_t function;
+    uint32_t block;
+    uint32_t first;
+    uint32_t last;
+};
+static_assert(sizeof(MapperCacheFixLoc) == 16, "fix loc layout changed!");
+
+class MapperCache {
+private:
+    llvm::Module &m_;
+
+    // Every instruction of the module in order, and the index of the first
+    // block of each function and of the first instruction of each block.
+    std::vector<llvm::Instruction*> insts_;
+    std::vector<uint32_t> functions_;
+    std::vector<uint32_t> blocks_;
+
+    llvm::MD5::MD5Result hash_;
+    std::string path_;
+
+    /**
+     * Walks the module once, to number the instructions and hash it.
+     */
+    void scan(void);
+
+    llvm::Instruction *inst(uint32_t f, uint32_t b, uint32_t i) const;
+
+    /**
+     * Ordinals of an instruction, for saving.
+     */
+    MapperCacheInst ordinals(uint32_t flat) const;
+
+public:
+    /**
+     * Cache files live in the given directory, named after the module hash.
+     */
+    MapperCache(llvm::Module &m, const std::string &dir);
+
+    const std::string &path(void) const { return path_; }
+
+    /**
+     * Fill in the mapper from the cache file. Returns false, leaving the
+     * mapper untouched, if there is no usable cache file for this module.
+     */
+    bool load(BugLocationMapper &mapper) const;
+
+    /**
+     * Write the mapper's index to the cache file. Returns false (with a
+     * message) on failure; the mapper works either way.
+     */
+    bool save(const BugLocationMapper &mapper) const;
+};
+
+}
@@ -0,0 +1,389 @@
+#include "MmapAA.hpp"
+
+#include <algorithm>
+#include <deque>
+
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/IR/GetElementPtrTypeIterator.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "PointsToModel.hpp"
+
+using namespace llvm;
+using namespace pmfix;
+using namespace pmfix::ptmodel;
+
+// From <sys/mman.h>. The low two bits are the mapping type, not flags:
+// MAP_SHARED is 0x01, MAP_PRIVATE 0x02 and MAP_SHARED_VALIDATE 0x03.
+static const uint64_t MAP_TYPE_MASK = 0x03;
+static const uint64_t MAP_SHARED_TYPE = 0x01;
+static const uint64_t MAP_SHARED_VALIDATE_TYPE = 0x03;
+static const uint64_t MAP_ANONYMOUS_FLAG = 0x20;
+
+#pragma region Graph
+
+MmapAA::MmapAA(Module &m) : dl_(m.getDataLayout()) {
+    build(m);
+    solve();
+
+    errs() << "MmapAA: " << nodes_.size() << " nodes, " << roots_.size()
+        << " roots, " << mappingCalls_.size() << " mappings\n";
+}
+
+bool MmapAA::isMapping(const CallBase *cb) {
+    const Function *f = dyn_cast<Function>(
+        cb->getCalledValue()->stripPointerCasts());
+    if (!f || !f->isDeclaration()) return false;
+
+    StringRef name = f->getName();
+    bool pmdk = StringSwitch<bool>(name)
+        .Cases("pmem_map_file", "pmem_map", "pmem2_map_get_address", true)
+        .Cases("pmemobj_direct", "pmemobj_open", "pmemobj_create", true)
+        .Cases("pmemlog_open", "pmemlog_create", true)
+        .Cases("pmemblk_open", "pmemblk_create", true)
+        .Default(false);
+    if (pmdk) return true;
+
+    if ((name != "mmap" && name != "mmap64") || cb->arg_size() < 5) {
+        return false;
+    }
+
+    // Only shared mappings of a file can be PM. If we can't tell, assume it
+    // is, as a missed flush is worse than an extra one.
+    auto *fd = dyn_cast<ConstantInt>(cb->getArgOperand(4));
+    if (fd && fd->isMinusOne()) return false;
+    if (auto *flags = dyn_cast<ConstantInt>(cb->getArgOperand(3))) {
+        uint64_t f = flags->getZExtValue();
+        uint64_t type = f & MAP_TYPE_MASK;
+        return (type == MAP_SHARED_TYPE || type == MAP_SHARED_VALIDATE_TYPE) &&
+               !(f & MAP_ANONYMOUS_FLAG);
+    }
+    return true;
+}
+
+bool MmapAA::carries(Type *t) const {
+    return mayHoldPointer(t) || t->isIntegerTy(dl_.getPointerSizeInBits());
+}
+
+unsigned MmapAA::newNode(void) {
+    nodes_.emplace_back();
+    return nodes_.size() - 1;
+}
+
+unsigned MmapAA::node(const Value *v) {
+    auto it = values_.find(v);
+    if (it != values_.end()) return it->second;
+
+    unsigned n = newNode();
+    values_[v] = n;
+
+    // Instructions get their edges in build().
+    if (isObject(v)) {
+        (void)root(v);
+    } else if (auto *ce = dyn_cast<ConstantExpr>(v)) {
+        if (ce->getOpcode() == Instruction::IntToPtr) {
+            edge(node(ce->getOperand(0)), n);
+        } else {
+            SmallVector<const Value*, 2> srcs;
+            copySources(ce, srcs);
+            for (const Value *src : srcs) edge(node(src), n);
+        }
+    } else if (auto *ga = dyn_cast<GlobalAlias>(v)) {
+        edge(node(ga->getAliasee()), n);
+    }
+
+    return n;
+}
+
+unsigned MmapAA::root(const Value *v) {
+    unsigned id;
+    auto it = rootIds_.find(v);
+    if (it != rootIds_.end()) {
+        id = it->second;
+    } else {
+        id = roots_.size();
+        roots_.push_back(v);
+        rootIds_[v] = id;
+    }
+
+    nodes_[node(v)].roots.set(id);
+    return id;
+}
+
+static const Value *baseOf(const Value *v) {
+    while (true) {
+        v = v->stripPointerCasts();
+        auto *gep = dyn_cast<GEPOperator>(v);
+        if (!gep) return v;
+        v = gep->getPointerOperand();
+    }
+}
+
+/**
+ * True if every use of v (or of addresses derived from it) is as the
+ * address of a load or store.
+ */
+static bool onlyAccessed(const Value *v) {
+    for (const Use &u : v->uses()) {
+        const User *user = u.getUser();
+        if (isa<GEPOperator>(user) || isa<BitCastOperator>(user)) {
+            if (!onlyAccessed(user)) return false;
+        } else if (isa<LoadInst>(user)) {
+            continue;
+        } else if (auto *si = dyn_cast<StoreInst>(user)) {
+            if (si->getValueOperand() == v) return false;
+        } else if (auto *ii = dyn_cast<IntrinsicInst>(user)) {
+            if (!isa<DbgInfoIntrinsic>(ii) && !ii->isLifetimeStartOrEnd()) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool MmapAA::isPrivate(const Value *base) {
+    auto it = private_.find(base);
+    if (it != private_.end()) return it->second;
+
+    bool priv = false;
+    if (isa<AllocaInst>(base)) {
+        priv = onlyAccessed(base);
+    } else if (auto *g = dyn_cast<GlobalVariable>(base)) {
+        priv = g->hasLocalLinkage() && onlyAccessed(g);
+    }
+
+    private_[base] = priv;
+    return priv;
+}
+
+unsigned MmapAA::cell(const Value *addr, Type *t) {
+    const Value *base = baseOf(addr);
+    if (isPrivate(base)) {
+        auto it = privateCells_.find(base);
+        if (it != privateCells_.end()) return it->second;
+
+        unsigned c = newNode();
+        privateCells_[base] = c;
+        return c;
+    }
+
+    std::pair<Type*, unsigned> key(t, ~0u);
+    if (auto *gep = dyn_cast<GEPOperator>(addr->stripPointerCasts())) {
+        // Field of the last index, if that one indexes a struct.
+        StructType *st = nullptr;
+        unsigned field = 0;
+        for (auto gi = gep_type_begin(gep), ge = gep_type_end(gep);
+             gi != ge; ++gi) {
+            st = gi.getStructTypeOrNull();
+            if (st) field = cast<ConstantInt>(gi.getOperand())->getZExtValue();
+        }
+        if (st) key = std::make_pair(st, field);
+    }
+
+    auto it = sharedCells_.find(key);
+    if (it != sharedCells_.end()) return it->second;
+
+    unsigned c = newNode();
+    sharedCells_[key] = c;
+    return c;
+}
+
+void MmapAA::edge(unsigned from, unsigned to) {
+    if (from != to) nodes_[from].succs.push_back(to);
+}
+
+void MmapAA::bindCall(const CallBase *cb, const Function *f) {
+    unsigned nargs = std::min<unsigned>(cb->arg_size(), f->arg_size());
+    for (unsigned i = 0; i < nargs; ++i) {
+        const Value *arg = cb->getArgOperand(i);
+        if (carries(arg->getType())) edge(node(arg), node(f->arg_begin() + i));
+    }
+
+    if (!carries(cb->getType())) return;
+    std::vector<const Value*> rets;
+    returnValues(f, rets);
+    for (const Value *r : rets) edge(node(r), node(cb));
+}
+
+void MmapAA::addCall(const CallBase *cb) {
+    const Value *dst, *src;
+    if (copiesMemory(cb, dst, src)) {
+        Type *dt = cast<PointerType>(dst->stripPointerCasts()->getType())
+            ->getElementType();
+        Type *st = cast<PointerType>(src->stripPointerCasts()->getType())
+            ->getElementType();
+        edge(cell(src, st), cell(dst, dt));
+    }
+
+    bool result = carries(cb->getType());
+    const Value *callee = cb->getCalledValue()->stripPointerCasts();
+
+    if (auto *f = dyn_cast<Function>(callee)) {
+        if (!f->isDeclaration()) {
+            bindCall(cb, f);
+        } else if (isMapping(cb)) {
+            mappings_.set(root(cb));
+            mappingCalls_.push_back(cb);
+        } else if (returnsFirstArg(f)) {
+            if (result && cb->arg_size()) {
+                edge(node(cb->getArgOperand(0)), node(cb));
+            }
+        } else if (result) {
+            (void)root(cb);
+        }
+    } else if (isa<InlineAsm>(callee)) {
+        if (result) (void)root(cb);
+    } else {
+        auto it = byType_.find(cb->getFunctionType());
+        if (it == byType_.end()) {
+            if (result) (void)root(cb);
+            return;
+        }
+        for (const Function *f : it->second) bindCall(cb, f);
+    }
+}
+
+void MmapAA::build(Module &m) {
+    for (const GlobalVariable &g : m.globals()) {
+        (void)node(&g);
+
+        if (!g.hasInitializer()) continue;
+        std::vector<const Constant*> inits;
+        constantPointers(g.getInitializer(), inits);
+        for (const Constant *c : inits) edge(node(c), cell(&g, c->getType()));
+    }
+
+    std::vector<const CallBase*> calls;
+    for (const Function &f : m) {
+        if (f.isDeclaration()) continue;
+
+        // Entry points and callbacks may be called from outside the module.
+        bool entry = f.hasAddressTaken();
+        if (entry) {
+            byType_[f.getFunctionType()].push_back(&f);
+        } else {
+            calls.clear();
+            directCalls(&f, Scope(), calls);
+            entry = calls.empty();
+        }
+
+        if (!entry) continue;
+        for (const Argument &a : f.args()) {
+            if (carries(a.getType())) (void)root(&a);
+        }
+    }
+
+    for (const Function &f : m) {
+        for (const BasicBlock &b : f) {
+            for (const Instruction &i : b) {
+                if (auto *cb = dyn_cast<CallBase>(&i)) {
+                    addCall(cb);
+                    continue;
+                }
+
+                if (auto *si = dyn_cast<StoreInst>(&i)) {
+                    const Value *val = si->getValueOperand();
+                    if (carries(val->getType())) {
+                        edge(node(val), cell(si->getPointerOperand(), val->getType()));
+                    }
+                    continue;
+                }
+
+                if (auto *cx = dyn_cast<AtomicCmpXchgInst>(&i)) {
+                    const Value *val = cx->getNewValOperand();
+                    if (carries(val->getType())) {
+                        edge(node(val), cell(cx->getPointerOperand(), val->getType()));
+                    }
+                }
+
+                if (!carries(i.getType())) continue;
+                unsigned n = node(&i);
+
+                if (const Value *from = loadSource(&i)) {
+                    // cmpxchg gives back a pair, the loaded value is first.
+                    Type *t = i.getType();
+                    if (auto *st = dyn_cast<StructType>(t)) t = st->getElementType(0);
+
+                    edge(cell(from, t), n);
+                    nodes_[node(from)].loads.push_back(n);
+                } else if (isa<IntToPtrInst>(&i)) {
+                    edge(node(i.getOperand(0)), n);
+                } else if (auto *bo = dyn_cast<BinaryOperator>(&i)) {
+                    switch (bo->getOpcode()) {
+                        case Instruction::Add:
+                        case Instruction::Sub:
+                        case Instruction::And:
+                        case Instruction::Or:
+                            edge(node(bo->getOperand(0)), n);
+                            edge(node(bo->getOperand(1)), n);
+                            break;
+                        default:
+                            break;
+                    }
+                } else {
+                    SmallVector<const Value*, 4> srcs;
+                    copySources(&i, srcs);
+                    for (const Value *src : srcs) edge(node(src), n);
+                }
+            }
+        }
+    }
+}
+
+void MmapAA::solve(void) {
+    std::deque<unsigned> work;
+    std::vector<bool> queued(nodes_.size(), false);
+    for (unsigned n = 0; n < nodes_.size(); ++n) {
+        if (!nodes_[n].roots.empty()) {
+            queued[n] = true;
+            work.push_back(n);
+        }
+    }
+
+    while (!work.empty()) {
+        unsigned n = work.front();
+        work.pop_front();
+        queued[n] = false;
+
+        const RootSet &roots = nodes_[n].roots;
+        for (unsigned s : nodes_[n].succs) {
+            if ((nodes_[s].roots |= roots) && !queued[s]) {
+                queued[s] = true;
+                work.push_back(s);
+            }
+        }
+
+        if (nodes_[n].loads.empty() || !roots.intersects(mappings_)) continue;
+        RootSet mapped(roots);
+        mapped &= mappings_;
+        for (unsigned l : nodes_[n].loads) {
+            if ((nodes_[l].roots |= mapped) && !queued[l]) {
+                queued[l] = true;
+                work.push_back(l);
+            }
+        }
+    }
+}
+
+#pragma endregion
+
+#pragma region Queries
+
+bool MmapAA::getPointsToSet(const Value *v,
+                            std::vector<const Value*> &ptsSet) const {
+    if (!v->getType()->isPointerTy()) return false;
+
+    auto it = values_.find(v);
+    if (it == values_.end()) return true;
+
+    for (unsigned id : nodes_[it->second].roots) ptsSet.push_back(roots_[id]);
+    return true;
+}
+
+#pragma endregion
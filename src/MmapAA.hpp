@@ -0,0 +1,129 @@
+#pragma once
+/**
+ * Where pointers come from, for telling PM from volatile memory (-mmap-aa).
+ *
+ * Instead of points-to sets over all memory, this tracks each pointer's
+ * provenance: the roots it is derived from. A root is where a pointer enters
+ * the program without being derived from another one: the calls that map PM
+ * (pmem_map_file, file-backed shared mmap, pmemobj_direct, the pool open and
+ * create routines), other external calls, allocas, globals, and the
+ * arguments of functions nothing in the module calls. Provenance flows
+ * through casts, GEPs, phis, selects, pointer-sized integer arithmetic, call
+ * arguments and returns, and through memory. The roots are reported as the
+ * allocation sites, so PmDesc works as it does with Andersen's, and the
+ * mapping calls start out known to be PM.
+ *
+ * Memory is modeled without a points-to solve: an alloca or internal global
+ * whose address is only ever loaded from and stored to is a cell of its own,
+ * and every other access goes to a cell for its struct field (or, if it isn't
+ * a field access, its type). Loads and stores are then just copies to and
+ * from cells. Also, a pointer loaded out of a mapping is assumed to point
+ * into the same mapping, as persistent structures link within their pool.
+ *
+ * So it is one pass over the module to build a copy graph, and one
+ * propagation over it. It is less precise than Andersen's, mostly where
+ * pointers to PM and to volatile memory share a struct field.
+ */
+
+#include <vector>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SparseBitVector.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/Module.h"
+
+namespace pmfix {
+
+class MmapAA {
+private:
+    typedef llvm::SparseBitVector<> RootSet;
+
+    struct Node {
+        // Root ids, see roots_.
+        RootSet roots;
+        std::vector<unsigned> succs;
+        // Loads through this pointer, which inherit its mappings.
+        std::vector<unsigned> loads;
+    };
+
+    const llvm::DataLayout &dl_;
+
+    std::vector<const llvm::Value*> roots_;
+    llvm::DenseMap<const llvm::Value*, unsigned> rootIds_;
+    // The roots that are PM mappings.
+    RootSet mappings_;
+    std::vector<const llvm::Value*> mappingCalls_;
+
+    std::vector<Node> nodes_;
+    llvm::DenseMap<const llvm::Value*, unsigned> values_;
+    // Cells of objects that don't escape, by object, and of everything else,
+    // by (struct, field) or (type, ~0u).
+    llvm::DenseMap<const llvm::Value*, unsigned> privateCells_;
+    llvm::DenseMap<std::pair<llvm::Type*, unsigned>, unsigned> sharedCells_;
+    llvm::DenseMap<const llvm::Value*, bool> private_;
+
+    // Address-taken functions, for resolving indirect calls by signature.
+    llvm::DenseMap<llvm::FunctionType*, std::vector<const llvm::Function*>>
+        byType_;
+
+    /**
+     * Pointers, and integers wide enough to hold one.
+     */
+    bool carries(llvm::Type *t) const;
+
+    unsigned newNode(void);
+
+    unsigned node(const llvm::Value *v);
+
+    unsigned root(const llvm::Value *v);
+
+    bool isPrivate(const llvm::Value *base);
+
+    /**
+     * The cell an access of type t at addr goes to.
+     */
+    unsigned cell(const llvm::Value *addr, llvm::Type *t);
+
+    void edge(unsigned from, unsigned to);
+
+    void bindCall(const llvm::CallBase *cb, const llvm::Function *f);
+
+    void addCall(const llvm::CallBase *cb);
+
+    void build(llvm::Module &m);
+
+    void solve(void);
+
+public:
+    /**
+     * Does the whole analysis.
+     */
+    MmapAA(llvm::Module &m);
+
+    MmapAA(const MmapAA &) = delete;
+
+    /**
+     * True if cb returns a pointer to PM.
+     */
+    static bool isMapping(const llvm::CallBase *cb);
+
+    /**
+     * Same contract as Andersen's: returns false if v isn't a pointer. The
+     * set is the roots v may be derived from.
+     */
+    bool getPointsToSet(const llvm::Value *v,
+                        std::vector<const llvm::Value*> &ptsSet) const;
+
+    void getAllAllocationSites(std::vector<const llvm::Value*> &sites) const {
+        sites = roots_;
+    }
+
+    /**
+     * The calls that map PM, which are known PM values to start with.
+     */
+    const std::vector<const llvm::Value*> &mappings(void) const {
+        return mappingCalls_;
+    }
+};
+
+}
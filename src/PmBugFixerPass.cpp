@@ -15,10 +15,7 @@
 #include <tuple>
 #include <queue>
 
-#include "yaml-cpp/yaml.h"
-
-#include "BugReports.hpp"
-#include "BugFixer.hpp"
+#include "RepairContext.hpp"
 
 using namespace llvm;
 using namespace std;
@@ -27,9 +24,6 @@ namespace pmfix {
 
 cl::opt<std::string> TraceFile("trace-file", cl::desc("<trace file>"));
 
-cl::list<std::string> Immutables("immutable-fns", cl::desc("Something"), 
-                                 cl::ZeroOrMore, cl::CommaSeparated);
-
 struct PmBugFixerPass : public ModulePass {
     static char ID; // For LLVM purposes.
 
@@ -42,33 +36,13 @@ struct PmBugFixerPass : public ModulePass {
     }
 
     bool runOnModule(Module &m) override {
-        // {
-        //     auto &mapper = BugLocationMapper::getInstance(m);
-        // }
-
-        YAML::Node trace_info_doc = YAML::LoadFile(TraceFile);
-        TraceInfo ti = TraceInfoBuilder(m, trace_info_doc).build();
-        // errs() << "TraceInfo string:\n" << ti.str() << '\n';
-        if (ti.empty()) {
-            errs() << "Err: trace is empty!!!\n";;
+        RepairContext ctx(m);
+        Expected<bool> modified = ctx.repair(TraceFile);
+        if (!modified) {
+            errs() << "Err: " << toString(modified.takeError()) << "\n";
             return false;
         }
-        
-        // Construct bug fixer
-        BugFixer fixer(m, ti);
-        errs() << "fixer built!\n";
-        for (const std::string &fnName : Immutables) {
-            fixer.addImmutableFunction(fnName);
-        } 
-
-        bool modified = fixer.doRepair();
-
-        if (modified)
-            errs() << "Modified!\n";
-        else
-            errs() << "Not modified!\n";   
-
-        return modified;
+        return *modified;
     }
 };
 
@@ -0,0 +1,132 @@
+#include "PmSummary.hpp"
+
+#include <utility>
+#include <vector>
+
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "PassUtils.hpp"
+
+using namespace llvm;
+using namespace pmfix;
+
+PmSummaries::PmSummaries(Module &m, AliasInfo &alias) : alias_(alias) {
+    CallGraph cg(m);
+
+    size_t nclean = 0;
+    // Callees come before their callers.
+    for (scc_iterator<CallGraph*> it = scc_begin(&cg); !it.isAtEnd(); ++it) {
+        std::vector<std::pair<const Function*, FnSummary>> scc;
+        FnSummary sum;
+        for (CallGraphNode *n : *it) {
+            const Function *f = n->getFunction();
+            if (!f || f->isDeclaration()) continue;
+            scc.emplace_back(f, summarizeBody(*f));
+            sum.include(scc.back().second);
+        }
+
+        for (auto &p : scc) {
+            for (const Instruction &i : instructions(*p.first)) {
+                const auto *cb = dyn_cast<CallBase>(&i);
+                if (!cb) continue;
+                const Function *callee = cb->getCalledFunction();
+                if (!callee || callee->isDeclaration()) continue;
+                // Members of this SCC aren't summarized yet, but they're all
+                // in sum already.
+                auto sit = summaries_.find(callee);
+                if (sit != summaries_.end()) sum.include(sit->second);
+            }
+        }
+
+        // A recursive cycle has to be taken as a whole, apart from what each
+        // function returns.
+        for (auto &p : scc) {
+            FnSummary &fsum = summaries_[p.first];
+            fsum = sum;
+            fsum.mayReturnPm = p.second.mayReturnPm;
+            if (fsum.clean()) nclean++;
+        }
+    }
+
+    errs() << "PmSummaries: " << nclean << " of " << summaries_.size()
+        << " functions can't affect PM\n";
+}
+
+bool PmSummaries::mayPointToPm(const Value *addr) {
+    // Cheap, and saves a query for most of the stack traffic.
+    if (isa<AllocaInst>(addr->stripInBoundsOffsets())) return false;
+
+    bool res;
+    const PtsSet &ptsSet = alias_.getPointsToSet(addr, res);
+    if (!res) return true;
+    // Like pointsToPm, which then checks the value itself.
+    if (ptsSet.empty()) return PmDesc::mayBePm(addr);
+
+    for (unsigned i : ptsSet) {
+        if (PmDesc::mayBePm(alias_.value(i))) return true;
+    }
+    return false;
+}
+
+FnSummary PmSummaries::summarizeBody(const Function &f) {
+    FnSummary sum;
+
+    for (const Instruction &i : instructions(f)) {
+        if (utils::isFlush(i)) sum.mayFlush = true;
+        if (utils::isFence(i)) sum.mayFence = true;
+
+        if (const auto *si = dyn_cast<StoreInst>(&i)) {
+            if (!sum.mayStorePm && mayPointToPm(si->getPointerOperand())) {
+                sum.mayStorePm = true;
+            }
+        } else if (const auto *mi = dyn_cast<MemIntrinsic>(&i)) {
+            if (!sum.mayStorePm && mayPointToPm(mi->getRawDest())) {
+                sum.mayStorePm = true;
+            }
+        } else if (const auto *ri = dyn_cast<ReturnInst>(&i)) {
+            const Value *v = ri->getReturnValue();
+            if (v && v->getType()->isPointerTy() && !sum.mayReturnPm &&
+                mayPointToPm(v)) {
+                sum.mayReturnPm = true;
+            }
+        } else if (const auto *cb = dyn_cast<CallBase>(&i)) {
+            // Code we can't see (pmem_memcpy_persist, say) may write
+            // through any pointer it's given.
+            const Function *callee = cb->getCalledFunction();
+            if (callee && (callee->isIntrinsic() || !callee->isDeclaration())) {
+                continue;
+            }
+            if (sum.mayStorePm || cb->onlyReadsMemory()) continue;
+            for (const Use &arg : cb->args()) {
+                if (arg->getType()->isPointerTy() && mayPointToPm(arg)) {
+                    sum.mayStorePm = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    return sum;
+}
+
+FnSummary PmSummaries::operator[](const Function *f) const {
+    auto it = summaries_.find(f);
+    if (it != summaries_.end()) return it->second;
+
+    FnSummary dirty;
+    dirty.mayStorePm = dirty.mayFlush = dirty.mayFence = true;
+    dirty.mayReturnPm = true;
+    return dirty;
+}
+
+std::shared_ptr<PmSummaries> PmSummaries::get(AliasInfo &alias) {
+    assert(alias.module && "no module to summarize!");
+    if (!alias.summaries) {
+        alias.summaries = std::make_shared<PmSummaries>(*alias.module, alias);
+    }
+    return alias.summaries;
+}
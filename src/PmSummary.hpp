@@ -0,0 +1,83 @@
+#pragma once
+/**
+ * What each function may do to PM, including everything it calls, so the
+ * flow graphs can step over calls that can't matter to them.
+ *
+ * The summaries are computed once per module, bottom-up over the SCCs of the
+ * call graph, so a function's summary covers its (direct) callees and every
+ * function in a recursive cycle gets the same one. They don't depend on
+ * which values are known to be PM: a store may touch PM unless the points-to
+ * set of its address only holds objects that are never PM (see
+ * PmDesc::mayBePm), so they hold in every context.
+ */
+
+#include <memory>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+
+#include "FlowAnalyzer.hpp"
+
+namespace pmfix {
+
+struct FnSummary {
+    // Stores (or memory intrinsics) that may write PM.
+    bool mayStorePm = false;
+    bool mayFlush = false;
+    bool mayFence = false;
+    // May return a pointer to PM, which the caller then knows about. Not
+    // inherited from callees.
+    bool mayReturnPm = false;
+
+    /**
+     * Nothing in it can make a difference to the caller's PM state.
+     */
+    bool clean() const {
+        return !mayStorePm && !mayFlush && !mayFence && !mayReturnPm;
+    }
+
+    /**
+     * Takes on the effects of a callee.
+     */
+    void include(const FnSummary &callee) {
+        mayStorePm |= callee.mayStorePm;
+        mayFlush |= callee.mayFlush;
+        mayFence |= callee.mayFence;
+    }
+};
+
+class PmSummaries {
+private:
+    AliasInfo &alias_;
+    llvm::DenseMap<const llvm::Function*, FnSummary> summaries_;
+
+    /**
+     * True if some object addr may point to could be PM.
+     */
+    bool mayPointToPm(const llvm::Value *addr);
+
+    /**
+     * Just the function's own instructions.
+     */
+    FnSummary summarizeBody(const llvm::Function &f);
+
+public:
+    PmSummaries(llvm::Module &m, AliasInfo &alias);
+
+    PmSummaries(const PmSummaries &) = delete;
+
+    /**
+     * Declarations (and anything else we haven't seen) are never clean.
+     */
+    FnSummary operator[](const llvm::Function *f) const;
+
+    bool isClean(const llvm::Function *f) const { return (*this)[f].clean(); }
+
+    /**
+     * The module's summaries, computing them the first time.
+     */
+    static std::shared_ptr<PmSummaries> get(AliasInfo &alias);
+};
+
+}
@@ -0,0 +1,397 @@
+#include "PmemcheckLog.hpp"
+#include "PassUtils.hpp"
+
+#include <cctype>
+#include <map>
+#include <tuple>
+#include <unordered_map>
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+using namespace pmfix;
+
+#pragma region Parser
+
+/**
+ * Does the actual work of PmemcheckLog::create(). Mirrors the pmemcheck
+ * parser in tools/parse-trace; keep the two in sync.
+ */
+class PmemcheckLog::Parser {
+private:
+    /**
+     * Output of one worker. Stacks are deduplicated by their text within the
+     * chunk, and events refer to them by chunk-local index until the merge.
+     */
+    struct Chunk {
+        StringRef text;
+        std::vector<BinaryEvent> events;
+        StringMap<uint32_t> stackIdx;
+        std::vector<std::vector<LocationInfo>> stacks;
+    };
+
+    PmemcheckLog &log_;
+
+    std::unordered_map<LocationInfo, uint32_t, LocationInfo::Hash,
+                       LocationInfo::ExactEqual> locIds_;
+    std::map<std::vector<uint32_t>, uint32_t> stackIds_;
+
+    static bool parseHex(StringRef str, uint64_t &val) {
+        str = str.trim();
+        if (!str.consume_front("0x")) str.consume_front("0X");
+        return !str.getAsInteger(16, val);
+    }
+
+    /**
+     * Strips the "==pid==" valgrind prefix. Returns "" if there is none.
+     */
+    static StringRef stripPid(StringRef line) {
+        if (!line.startswith("==")) return StringRef();
+        size_t end = line.find("==", 2);
+        if (end == StringRef::npos) return StringRef();
+        return line.substr(end + 2).ltrim();
+    }
+
+    /**
+     * "0x4011A3: fn (file.c:12)", or "0x4011A3: fn (in /lib/ld.so)" for code
+     * without line info (e.g. in the linker).
+     */
+    static bool parseFrame(StringRef frame, LocationInfo &li) {
+        frame = frame.trim();
+        size_t colon = frame.find(": ");
+        if (colon == StringRef::npos || !colon) return false;
+        for (char c : frame.substr(0, colon)) {
+            if (!isalnum(c) && c != '_') return false;
+        }
+
+        StringRef body = frame.substr(colon + 2);
+        size_t open = body.rfind(" (");
+        if (open == StringRef::npos || !open || !body.endswith(")")) return false;
+        StringRef fn = body.substr(0, open);
+        StringRef where = body.substr(open + 2).drop_back();
+
+        StringRef file, line;
+        std::tie(file, line) = where.rsplit(':');
+        int64_t lineNo;
+        if (!file.empty() && !line.empty() && line != where &&
+            !line.getAsInteger(10, lineNo) && lineNo >= 0) {
+            li.function = fn;
+            li.file = file;
+            li.line = lineNo;
+            return true;
+        }
+
+        if (where.consume_front("in ") && !where.empty()) {
+            li.function = fn;
+            li.file = where;
+            li.line = -1;
+            return true;
+        }
+
+        return false;
+    }
+
+    /**
+     * Parses ';' separated frames, up to the first one that isn't a frame.
+     */
+    static std::vector<LocationInfo> parseStack(StringRef frames) {
+        std::vector<LocationInfo> stack;
+        SmallVector<StringRef, 16> parts;
+        frames.split(parts, ';', -1, false);
+        for (StringRef f : parts) {
+            LocationInfo li;
+            if (!parseFrame(f, li)) break;
+            stack.push_back(li);
+        }
+        return stack;
+    }
+
+    /**
+     * One line of the store log, which holds any number of '|' separated
+     * events:
+     *  STORE;addr;value;size;frames...
+     *  FLUSH;addr;size;frames...
+     *  FENCE;frames...
+     * Anything else (START, REGISTER_FILE, ...) is skipped.
+     */
+    static void parseLine(StringRef line, Chunk &c) {
+        SmallVector<StringRef, 8> events;
+        line.split(events, '|', -1, false);
+        for (StringRef ev : events) {
+            StringRef kind, rest;
+            std::tie(kind, rest) = ev.trim().split(';');
+            if (kind == "STOP") break;
+
+            BinaryEvent be = {};
+            if (kind == "FENCE") {
+                be.type = TraceEvent::FENCE;
+            } else if (kind == "STORE" || kind == "FLUSH") {
+                StringRef addr, value, size;
+                std::tie(addr, rest) = rest.split(';');
+                if (kind == "STORE") {
+                    be.type = TraceEvent::STORE;
+                    std::tie(value, rest) = rest.split(';');
+                } else {
+                    be.type = TraceEvent::FLUSH;
+                }
+                std::tie(size, rest) = rest.split(';');
+
+                bool ok = parseHex(addr, be.address) && parseHex(size, be.length);
+                if (!ok) {
+                    errs() << "Bad pmemcheck event \"" << ev << "\"\n";
+                    assert(false && "Error in parsing!");
+                    continue;
+                }
+            } else {
+                continue;
+            }
+
+            // rest is now just the frames.
+            auto it = c.stackIdx.find(rest);
+            if (it == c.stackIdx.end()) {
+                c.stacks.push_back(parseStack(rest));
+                assert(!c.stacks.back().empty() && "Empty stack!");
+                it = c.stackIdx.insert({rest, c.stacks.size() - 1}).first;
+            }
+            be.stack = it->second;
+
+            c.events.push_back(be);
+        }
+    }
+
+    uint32_t internStack(const std::vector<LocationInfo> &stack) {
+        std::vector<uint32_t> ids;
+        for (const LocationInfo &li : stack) {
+            auto res = locIds_.emplace(li, log_.locations_.size());
+            if (res.second) log_.locations_.push_back(li);
+            ids.push_back(res.first->second);
+        }
+
+        auto it = stackIds_.find(ids);
+        if (it != stackIds_.end()) return it->second;
+
+        BinaryStack bs = {};
+        bs.firstFrame = log_.frames_.size();
+        bs.numFrames = ids.size();
+        log_.frames_.insert(log_.frames_.end(), ids.begin(), ids.end());
+        log_.stacks_.push_back(bs);
+
+        uint32_t id = log_.stacks_.size() - 1;
+        stackIds_[ids] = id;
+        return id;
+    }
+
+    /**
+     * The bug summary valgrind prints after the store log.
+     */
+    std::vector<BinaryEvent> parseSummary(StringRef text);
+
+    std::vector<BinaryEvent> &addBlock(std::vector<BinaryEvent> &&events) {
+        for (BinaryEvent &be : events) {
+            be.timestamp = log_.numEvents_++;
+            be.location = log_.frames_[log_.stacks_[be.stack].firstFrame];
+        }
+        log_.blocks_.push_back(std::move(events));
+        return log_.blocks_.back();
+    }
+
+public:
+    Parser(PmemcheckLog &log) : log_(log) {}
+
+    bool parse(void);
+};
+
+std::vector<BinaryEvent> PmemcheckLog::Parser::parseSummary(StringRef text) {
+    std::vector<BinaryEvent> bugs;
+
+    SmallVector<StringRef, 64> lines;
+    text.split(lines, '\n');
+
+    static const char *nbugsMsg = "Number of stores not made persistent: ";
+    static const char *nperfMsg = "Number of unnecessary flushes: ";
+
+    bool inBugs = false;
+    bool isPerf = false;
+    uint64_t remaining = 0;
+    int64_t lastBugNo = -1;
+
+    for (size_t i = 0; i < lines.size(); ++i) {
+        StringRef msg = stripPid(lines[i]);
+
+        if (!inBugs) {
+            uint64_t n;
+            if (msg.consume_front(nbugsMsg)) {
+                if (!msg.consumeInteger(10, n) && n > 0) {
+                    inBugs = true;
+                    isPerf = false;
+                    remaining = n;
+                    assert(i + 1 < lines.size() &&
+                        lines[i + 1].contains("Stores not made persistent properly"));
+                }
+                // Skip the heading.
+                i++;
+            } else if (msg.consume_front(nperfMsg)) {
+                if (!msg.consumeInteger(10, n)) {
+                    inBugs = true;
+                    isPerf = true;
+                    remaining = n;
+                }
+            }
+            continue;
+        }
+
+        if (!remaining) {
+            // End of interesting stuff.
+            break;
+        }
+
+        // "[N] at frame", then "by frame" for each caller, then the address.
+        std::vector<LocationInfo> stack;
+        size_t st = 0;
+        while (i + st < lines.size() && (st == 0 || lines[i + st].contains("by"))) {
+            StringRef sep = st == 0 ? " at " : " by ";
+            LocationInfo li;
+            if (parseFrame(lines[i + st].rsplit(sep).second, li)) {
+                stack.push_back(li);
+            }
+            st++;
+        }
+        assert(!stack.empty() && "Empty stack!");
+        assert(i + st < lines.size() && "Truncated bug report!");
+
+        StringRef head = msg;
+        uint64_t bugNo = 0;
+        bool ok = head.consume_front("[") && !head.consumeInteger(10, bugNo);
+        assert(ok && "Bad bug report!");
+        if (bugNo != (uint64_t)(lastBugNo + 1)) {
+            errs() << bugNo << " != " << lastBugNo + 1 << "\n";
+        }
+        assert(bugNo == (uint64_t)(lastBugNo + 1));
+        lastBugNo = bugNo;
+
+        // "Address: 0x... size: N [state: ...]"
+        StringRef addr = stripPid(lines[i + st]);
+        BinaryEvent be = {};
+        ok = addr.consume_front("Address:");
+        addr = addr.ltrim();
+        StringRef addrStr = addr.take_until([] (char c) { return isspace(c); });
+        addr = addr.drop_front(addrStr.size()).ltrim();
+        ok = ok && parseHex(addrStr, be.address) && addr.consume_front("size:");
+        addr = addr.ltrim();
+        ok = ok && !addr.consumeInteger(10, be.length);
+        if (!ok) {
+            errs() << "Bad bug report \"" << lines[i + st] << "\"\n";
+            assert(false && "Bad bug report!");
+        }
+
+        be.type = isPerf ? TraceEvent::REQUIRED_FLUSH : TraceEvent::ASSERT_PERSISTED;
+        be.flags = BinaryEvent::IS_BUG;
+        be.stack = internStack(stack);
+        bugs.push_back(be);
+
+        i += st;
+        remaining--;
+        if (!remaining && !isPerf) {
+            // The performance bugs may come next.
+            inBugs = false;
+            lastBugNo = -1;
+        }
+    }
+
+    return bugs;
+}
+
+bool PmemcheckLog::Parser::parse(void) {
+    StringRef text = log_.buffer_->getBuffer();
+
+    /**
+     * Find the store log. It starts at the first line with an event on it
+     * and ends at the line with STOP (which is not parsed, just like in
+     * parse-trace).
+     */
+    size_t start = StringRef::npos;
+    for (const char *marker : {"START|", "|STORE", "|FLUSH", "|FENCE"}) {
+        start = std::min(start, text.find(marker));
+    }
+    if (start == StringRef::npos) return false;
+    start = text.rfind('\n', start) + 1;
+
+    size_t startEnd = text.find('\n', start);
+    size_t stop = text.find("|STOP", startEnd);
+    StringRef summary;
+    if (stop != StringRef::npos) {
+        stop = text.rfind('\n', stop) + 1;
+        size_t stopEnd = text.find('\n', stop);
+        if (stopEnd != StringRef::npos) summary = text.substr(stopEnd + 1);
+    }
+    StringRef storeLog = text.slice(start, stop);
+
+    // Split at line boundaries, a few chunks per thread to even out the load.
+    size_t target = std::max<size_t>(storeLog.size() / (utils::numThreads() * 4),
+                                     1 << 20);
+    std::vector<Chunk> chunks;
+    for (size_t pos = 0; pos < storeLog.size(); ) {
+        size_t end = storeLog.find('\n', std::min(pos + target, storeLog.size()));
+        end = end == StringRef::npos ? storeLog.size() : end + 1;
+        chunks.emplace_back();
+        chunks.back().text = storeLog.slice(pos, end);
+        pos = end;
+    }
+
+    utils::parallelFor(chunks.size(), [&chunks] (size_t i) {
+        Chunk &c = chunks[i];
+        StringRef rest = c.text;
+        while (!rest.empty()) {
+            StringRef line;
+            std::tie(line, rest) = rest.split('\n');
+            parseLine(line, c);
+        }
+    });
+
+    // Merge in order, so the event order (and timestamps) is the log's.
+    for (Chunk &c : chunks) {
+        std::vector<uint32_t> stackIds;
+        for (const auto &stack : c.stacks) {
+            stackIds.push_back(internStack(stack));
+        }
+        for (BinaryEvent &be : c.events) {
+            be.stack = stackIds[be.stack];
+        }
+        addBlock(std::move(c.events));
+    }
+
+    size_t nbugs = addBlock(parseSummary(summary)).size();
+
+    errs() << "Parsed pmemcheck log: " << log_.numEvents_ << " events ("
+        << nbugs << " bugs), " << log_.stacks_.size() << " stacks, in "
+        << chunks.size() << " chunks\n";
+
+    return true;
+}
+
+#pragma endregion
+
+#pragma region PmemcheckLog
+
+std::unique_ptr<PmemcheckLog> PmemcheckLog::create(const std::string &path) {
+    auto bufOrErr = MemoryBuffer::getFile(path, -1,
+                                          /*RequiresNullTerminator=*/false);
+    if (!bufOrErr) {
+        errs() << "Could not open pmemcheck log " << path << ": "
+            << bufOrErr.getError().message() << "\n";
+        return nullptr;
+    }
+
+    std::unique_ptr<PmemcheckLog> log(new PmemcheckLog(std::move(bufOrErr.get())));
+    Parser parser(*log);
+    if (!parser.parse()) {
+        errs() << "No store log found in " << path << "!\n";
+        return nullptr;
+    }
+
+    return log;
+}
+
+#pragma endregion
@@ -0,0 +1,83 @@
+#pragma once
+/**
+ * Reads the raw log of a pmemcheck run, so the pass doesn't need the
+ * tools/parse-trace step in between.
+ *
+ * The log has two parts: the store log (lines of "|STORE;...|FLUSH;..." events,
+ * from START to STOP) and, after it, valgrind's summary of the bugs found. The
+ * store log is nearly all of the file, so it is split at line boundaries and
+ * parsed on the worker pool; the summary is small and is parsed serially.
+ *
+ * Parsed events use the same records and tables as a binary trace (see
+ * BinaryTrace.hpp), so TraceInfoBuilder consumes both the same way. Like
+ * parse-trace, this produces a GENERIC trace.
+ */
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include "BugReports.hpp"
+#include "BinaryTrace.hpp"
+
+namespace pmfix {
+
+class PmemcheckLog {
+private:
+    std::unique_ptr<llvm::MemoryBuffer> buffer_;
+
+    std::vector<LocationInfo> locations_;
+    std::vector<BinaryStack> stacks_;
+    std::vector<uint32_t> frames_;
+    // One block per parse chunk, plus one for the bug summary.
+    std::vector<std::vector<BinaryEvent>> blocks_;
+    size_t numEvents_ = 0;
+
+    class Parser;
+
+    PmemcheckLog(std::unique_ptr<llvm::MemoryBuffer> buffer)
+        : buffer_(std::move(buffer)) {}
+
+public:
+    /**
+     * Maps and parses the given log. Returns nullptr if the file could not be
+     * opened or has no store log in it.
+     */
+    static std::unique_ptr<PmemcheckLog> create(const std::string &path);
+
+    TraceEvent::Source source(void) const { return TraceEvent::GENERIC; }
+
+    size_t numEvents(void) const { return numEvents_; }
+
+    size_t numLocations(void) const { return locations_.size(); }
+
+    size_t numStacks(void) const { return stacks_.size(); }
+
+    size_t numBlocks(void) const { return blocks_.size(); }
+
+    const LocationInfo &location(uint32_t idx) const { return locations_[idx]; }
+
+    /**
+     * Location ids of the given stack, innermost frame first.
+     */
+    llvm::ArrayRef<uint32_t> stack(uint32_t idx) const {
+        const BinaryStack &bs = stacks_[idx];
+        return llvm::makeArrayRef(frames_).slice(bs.firstFrame, bs.numFrames);
+    }
+
+    /**
+     * Same interface as BinaryTraceFile::block(). Blocks are kept parsed, so
+     * scratch is never used.
+     */
+    llvm::ArrayRef<BinaryEvent> block(size_t idx,
+                                      std::vector<BinaryEvent> &scratch) const {
+        return blocks_[idx];
+    }
+};
+
+}
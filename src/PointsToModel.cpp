@@ -0,0 +1,165 @@
+#include "PointsToModel.hpp"
+
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+
+using namespace llvm;
+using namespace pmfix;
+
+bool ptmodel::Scope::hides(const Value *v) const {
+    if (hidden.empty()) return false;
+    if (auto *a = dyn_cast<Argument>(v)) return hidden.count(a->getParent());
+    if (auto *i = dyn_cast<Instruction>(v)) return hidden.count(i->getFunction());
+    return false;
+}
+
+bool ptmodel::Scope::isObject(const Value *v) const {
+    if (noAllocas && isa<AllocaInst>(v)) return false;
+    return ptmodel::isObject(v);
+}
+
+bool ptmodel::isObject(const Value *v) {
+    return isa<AllocaInst>(v) || isa<GlobalVariable>(v) || isa<Function>(v);
+}
+
+bool ptmodel::returnsFirstArg(const Function *f) {
+    if (f->isIntrinsic()) return true;
+
+    StringRef name = f->getName();
+    return name == "memcpy" || name == "memmove" || name == "memset" ||
+           name == "strcpy" || name == "strncpy" || name == "strcat" ||
+           name == "strncat";
+}
+
+bool ptmodel::copiesMemory(const CallBase *cb, const Value *&dst, 
+                           const Value *&src) {
+    if (auto *mt = dyn_cast<MemTransferInst>(cb)) {
+        dst = mt->getRawDest();
+        src = mt->getRawSource();
+        return true;
+    }
+
+    const Function *f = cb->getCalledFunction();
+    if (!f || cb->arg_size() < 2) return false;
+    if (f->getName() == "memcpy" || f->getName() == "memmove") {
+        dst = cb->getArgOperand(0);
+        src = cb->getArgOperand(1);
+        return true;
+    }
+
+    return false;
+}
+
+bool ptmodel::mayHoldPointer(Type *t) {
+    return t->isPointerTy() || t->isAggregateType() || t->isVectorTy();
+}
+
+void ptmodel::constantPointers(const Constant *c, 
+                               std::vector<const Constant*> &out) {
+    if (c->getType()->isPointerTy()) {
+        out.push_back(c);
+    } else if (isa<ConstantAggregate>(c)) {
+        for (const Value *op : c->operand_values()) {
+            constantPointers(cast<Constant>(op), out);
+        }
+    }
+}
+
+static void directCallsThrough(const Function *f, const Value *callee, 
+                               const ptmodel::Scope &scope,
+                               std::vector<const CallBase*> &out) {
+    for (const User *u : callee->users()) {
+        if (auto *cb = dyn_cast<CallBase>(u)) {
+            if (cb->getCalledValue()->stripPointerCasts() == f && 
+                !scope.hides(cb)) {
+                out.push_back(cb);
+            }
+        } else if (auto *ce = dyn_cast<ConstantExpr>(u)) {
+            if (ce->isCast()) directCallsThrough(f, ce, scope, out);
+        }
+    }
+}
+
+void ptmodel::directCalls(const Function *f, const Scope &scope, 
+                          std::vector<const CallBase*> &out) {
+    directCallsThrough(f, f, scope, out);
+}
+
+void ptmodel::returnValues(const Function *f, std::vector<const Value*> &out) {
+    for (const BasicBlock &b : *f) {
+        auto *ri = dyn_cast<ReturnInst>(b.getTerminator());
+        if (ri && ri->getReturnValue()) out.push_back(ri->getReturnValue());
+    }
+}
+
+const Value *ptmodel::loadSource(const Value *v) {
+    if (auto *li = dyn_cast<LoadInst>(v)) return li->getPointerOperand();
+    if (auto *cx = dyn_cast<AtomicCmpXchgInst>(v)) return cx->getPointerOperand();
+    if (auto *rmw = dyn_cast<AtomicRMWInst>(v)) return rmw->getPointerOperand();
+    return nullptr;
+}
+
+void ptmodel::copySources(const Value *v, SmallVectorImpl<const Value*> &out) {
+    if (auto *ga = dyn_cast<GlobalAlias>(v)) {
+        out.push_back(ga->getAliasee());
+    } else if (auto *ce = dyn_cast<ConstantExpr>(v)) {
+        if (ce->getOpcode() == Instruction::Select) {
+            out.push_back(ce->getOperand(1));
+            out.push_back(ce->getOperand(2));
+        } else if ((ce->isCast() && ce->getOpcode() != Instruction::IntToPtr) ||
+                   ce->getOpcode() == Instruction::GetElementPtr) {
+            out.push_back(ce->getOperand(0));
+        }
+    } else if (auto *ci = dyn_cast<CastInst>(v)) {
+        // inttoptr could be anything, and Andersen's doesn't say either.
+        if (!isa<IntToPtrInst>(ci)) out.push_back(ci->getOperand(0));
+    } else if (auto *gep = dyn_cast<GetElementPtrInst>(v)) {
+        out.push_back(gep->getPointerOperand());
+    } else if (auto *phi = dyn_cast<PHINode>(v)) {
+        for (const Value *in : phi->incoming_values()) out.push_back(in);
+    } else if (auto *sel = dyn_cast<SelectInst>(v)) {
+        out.push_back(sel->getTrueValue());
+        out.push_back(sel->getFalseValue());
+    } else if (isa<ExtractValueInst>(v) || isa<ExtractElementInst>(v)) {
+        out.push_back(cast<Instruction>(v)->getOperand(0));
+    } else if (isa<InsertValueInst>(v) || isa<InsertElementInst>(v) ||
+               isa<ShuffleVectorInst>(v)) {
+        out.push_back(cast<Instruction>(v)->getOperand(0));
+        out.push_back(cast<Instruction>(v)->getOperand(1));
+    }
+}
+
+void ptmodel::collectStores(
+    Module &m, const Scope &scope,
+    std::vector<std::pair<const Value*, const Value*>> &out) {
+
+    std::vector<const Constant*> inits;
+    for (const GlobalVariable &g : m.globals()) {
+        if (!g.hasInitializer()) continue;
+
+        inits.clear();
+        constantPointers(g.getInitializer(), inits);
+        for (const Constant *c : inits) out.emplace_back(&g, c);
+    }
+
+    for (const Function &f : m) {
+        if (!scope.hasBody(&f)) continue;
+
+        for (const BasicBlock &b : f) {
+            for (const Instruction &i : b) {
+                if (auto *si = dyn_cast<StoreInst>(&i)) {
+                    const Value *val = si->getValueOperand();
+                    if (mayHoldPointer(val->getType())) {
+                        out.emplace_back(si->getPointerOperand(), val);
+                    }
+                } else if (auto *cx = dyn_cast<AtomicCmpXchgInst>(&i)) {
+                    const Value *val = cx->getNewValOperand();
+                    if (mayHoldPointer(val->getType())) {
+                        out.emplace_back(cx->getPointerOperand(), val);
+                    }
+                }
+            }
+        }
+    }
+}
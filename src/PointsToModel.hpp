@@ -0,0 +1,109 @@
+#pragma once
+/**
+ * How the in-tree points-to analyses (DemandAA and InclusionAA) read the IR.
+ * They must agree for -verify-parallel-aa and so that switching between them
+ * only changes how long the analysis takes, so the rules live here.
+ *
+ * Both are field- and context-insensitive, like Andersen's. An abstract 
+ * object is an alloca, a global, a function, or the result of a call to an 
+ * external function (which is how PM gets mapped in).
+ */
+
+#include <vector>
+
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/Module.h"
+
+namespace pmfix {
+namespace ptmodel {
+
+    /**
+     * The part of the module an analysis looks at. The trace-based analyses
+     * (-trace-aa, -reduced-aa) look at a slice of the module through this
+     * rather than at a trimmed copy of it. The default is everything.
+     */
+    struct Scope {
+        // Functions whose bodies are ignored, as if they were declarations.
+        llvm::DenseSet<const llvm::Function*> hidden;
+        // Allocas aren't objects, so nothing points to the stack.
+        bool noAllocas = false;
+
+        bool hasBody(const llvm::Function *f) const {
+            return !f->isDeclaration() && !hidden.count(f);
+        }
+
+        /**
+         * True for the arguments and instructions of hidden bodies, which
+         * the analysis knows nothing about.
+         */
+        bool hides(const llvm::Value *v) const;
+
+        /**
+         * Allocas, globals and functions, which point to themselves.
+         */
+        bool isObject(const llvm::Value *v) const;
+    };
+
+    /**
+     * Allocas, globals and functions, which point to themselves.
+     */
+    bool isObject(const llvm::Value *v);
+
+    /**
+     * External functions that return their first argument rather than new 
+     * memory.
+     */
+    bool returnsFirstArg(const llvm::Function *f);
+
+    /**
+     * Calls that copy memory, which is storing whatever src points to into
+     * whatever dst points to.
+     */
+    bool copiesMemory(const llvm::CallBase *cb, 
+                      const llvm::Value *&dst, const llvm::Value *&src);
+
+    bool mayHoldPointer(llvm::Type *t);
+
+    /**
+     * The pointers in a global initializer.
+     */
+    void constantPointers(const llvm::Constant *c, 
+                          std::vector<const llvm::Constant*> &out);
+
+    /**
+     * Direct calls to f, including through casts of f, from the bodies in 
+     * scope.
+     */
+    void directCalls(const llvm::Function *f, const Scope &scope,
+                     std::vector<const llvm::CallBase*> &out);
+
+    /**
+     * Returned values of f.
+     */
+    void returnValues(const llvm::Function *f, 
+                      std::vector<const llvm::Value*> &out);
+
+    /**
+     * If v is read from memory (loads, atomics), the pointer it's read from.
+     */
+    const llvm::Value *loadSource(const llvm::Value *v);
+
+    /**
+     * Values v is a copy of: casts, GEPs, phis, selects, aggregates, aliases.
+     */
+    void copySources(const llvm::Value *v, 
+                     llvm::SmallVectorImpl<const llvm::Value*> &out);
+
+    /**
+     * Stores of pointers in the bodies in scope: (where, what). memcpy is 
+     * reported through copiesMemory instead.
+     */
+    void collectStores(
+        llvm::Module &m, const Scope &scope,
+        std::vector<std::pair<const llvm::Value*, const llvm::Value*>> &out);
+
+}
+}
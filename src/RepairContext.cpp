@@ -0,0 +1,138 @@
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "yaml-cpp/yaml.h"
+
+#include "RepairContext.hpp"
+#include "BinaryTrace.hpp"
+#include "PmemcheckLog.hpp"
+#include "BugFixer.hpp"
+
+using namespace llvm;
+
+namespace pmfix {
+
+#pragma region Options
+
+enum TraceFormat { AutoFormat, YamlFormat, BinaryFormat };
+
+cl::opt<TraceFormat> TraceFormatOpt("trace-format", 
+    cl::desc("Format of the trace file"),
+    cl::values(
+        clEnumValN(AutoFormat, "auto", "Detect from the file header (default)"),
+        clEnumValN(YamlFormat, "yaml", "YAML trace from tools/parse-trace"),
+        clEnumValN(BinaryFormat, "binary", "Binary trace from tools/convert-trace")),
+    cl::init(AutoFormat));
+
+enum TraceKind { ReportKind, PmemcheckLogKind };
+
+cl::opt<TraceKind> TraceKindOpt("trace-kind",
+    cl::desc("What the trace file holds"),
+    cl::values(
+        clEnumValN(ReportKind, "report", 
+                   "Report from tools/parse-trace or convert-trace (default)"),
+        clEnumValN(PmemcheckLogKind, "pmemcheck-log", 
+                   "Raw pmemcheck output, parsed in the pass")),
+    cl::init(ReportKind));
+
+cl::opt<bool> StreamTrace("stream-trace", cl::init(false),
+    cl::desc("Stream the trace through a bounded window instead of loading it "
+             "all into memory. Only memory-bounded for binary traces and raw "
+             "pmemcheck logs: YAML traces are still loaded whole"));
+
+cl::list<std::string> Immutables("immutable-fns", cl::desc("Something"), 
+                                 cl::ZeroOrMore, cl::CommaSeparated);
+
+cl::opt<std::string> SummaryFile("fix-summary-file", cl::init("fix_summary.txt"),
+    cl::desc("Where to output the fix summary"));
+
+#pragma endregion
+
+#pragma region RepairContext
+
+RepairContext::RepairContext(Module &m) 
+    : m_(m), mapper_(new BugLocationMapper(m)), alias_(nullptr),
+      summaryFile_(SummaryFile) {}
+
+AliasInfo::Shared RepairContext::alias(void) {
+    if (!alias_) {
+        alias_ = AliasInfo::create(m_);
+    }
+
+    return alias_;
+}
+
+static Error traceError(const std::string &traceFile, const char *what) {
+    return make_error<StringError>(traceFile + ": " + what, 
+                                   inconvertibleErrorCode());
+}
+
+static bool repairWith(BugFixer &fixer) {
+    errs() << "fixer built!\n";
+    for (const std::string &fnName : Immutables) {
+        fixer.addImmutableFunction(fnName);
+    } 
+
+    bool modified = fixer.doRepair();
+
+    if (modified)
+        errs() << "Modified!\n";
+    else
+        errs() << "Not modified!\n";   
+
+    return modified;
+}
+
+Expected<bool> RepairContext::repair(const std::string &traceFile) {
+    bool rawLog = TraceKindOpt == PmemcheckLogKind;
+    bool binary = !rawLog && (TraceFormatOpt == BinaryFormat ||
+        (TraceFormatOpt == AutoFormat && 
+         BinaryTraceFile::isBinaryTrace(traceFile)));
+
+    std::unique_ptr<BinaryTraceFile> file;
+    std::unique_ptr<PmemcheckLog> log;
+    YAML::Node trace_info_doc;
+    if (rawLog) {
+        log = PmemcheckLog::create(traceFile);
+        if (!log) return traceError(traceFile, "could not load pmemcheck log");
+    } else if (binary) {
+        file = BinaryTraceFile::create(traceFile);
+        if (!file) return traceError(traceFile, "could not load binary trace");
+    } else {
+        if (StreamTrace) {
+            errs() << "Warning: -stream-trace with a YAML trace still loads "
+                "the whole document; convert it to a binary trace to bound "
+                "memory\n";
+        }
+        try {
+            trace_info_doc = YAML::LoadFile(traceFile);
+        } catch (const YAML::Exception &e) {
+            return traceError(traceFile, e.what());
+        }
+    }
+
+    TraceInfoBuilder builder = 
+        rawLog ? TraceInfoBuilder(*mapper_, *log) :
+        binary ? TraceInfoBuilder(*mapper_, *file) :
+                 TraceInfoBuilder(*mapper_, trace_info_doc);
+
+    if (StreamTrace) {
+        BugFixer fixer(*this, builder);
+        return repairWith(fixer);
+    }
+
+    TraceInfo ti = builder.build();
+    // errs() << "TraceInfo string:\n" << ti.str() << '\n';
+    if (ti.empty()) {
+        errs() << "Err: trace is empty!!!\n";;
+        return traceError(traceFile, "trace is empty");
+    }
+    
+    // Construct bug fixer
+    BugFixer fixer(*this, ti);
+    return repairWith(fixer);
+}
+
+#pragma endregion
+
+}
@@ -0,0 +1,60 @@
+#pragma once
+/**
+ * The state behind the repair of one module.
+ */
+
+#include <memory>
+#include <string>
+
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Error.h"
+
+#include "BugReports.hpp"
+#include "FlowAnalyzer.hpp"
+
+namespace pmfix {
+
+/**
+ * Owns everything that lives for the repair of one module rather than for one
+ * BugFixer: the source location index and the alias analysis results.
+ * 
+ * Contexts share nothing mutable (the command line options are only read), 
+ * so one process can repair several modules at once, each on its own thread 
+ * with its own context and LLVMContext. See batch/PmBatchFixer.cpp.
+ */
+class RepairContext final {
+private:
+    llvm::Module &m_;
+    std::unique_ptr<BugLocationMapper> mapper_;
+    // Andersen results for m_, built on first use.
+    AliasInfo::Shared alias_;
+    std::string summaryFile_;
+
+public:
+    RepairContext(llvm::Module &m);
+
+    RepairContext(const RepairContext &) = delete;
+
+    llvm::Module &module(void) const { return m_; }
+
+    BugLocationMapper &mapper(void) const { return *mapper_; }
+
+    AliasInfo::Shared alias(void);
+
+    /**
+     * Where the fix summary goes, -fix-summary-file by default.
+     */
+    const std::string &summaryFile(void) const { return summaryFile_; }
+
+    void setSummaryFile(const std::string &path) { summaryFile_ = path; }
+
+    /**
+     * Loads the trace (as -trace-kind and -trace-format say) and repairs the
+     * module with it. Returns true if the module was modified, or an error
+     * if the trace couldn't be loaded (or holds nothing), in which case the
+     * module is left alone.
+     */
+    llvm::Expected<bool> repair(const std::string &traceFile);
+};
+
+}
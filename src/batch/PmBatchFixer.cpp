@@ -0,0 +1,139 @@
+/**
+ * Repairs several modules in one process.
+ *
+ * Each input is a bitcode module and the trace to repair it with, given as
+ * "module.bc:trace". Modules are parsed into their own LLVMContext and 
+ * repaired on their own thread with their own RepairContext, so they share no
+ * mutable state; the fixer options (-trace-aa, -stream-trace, etc.) apply to 
+ * all of them. The repaired module is written next to the input, with 
+ * -out-suffix appended, along with its fix summary.
+ *
+ * The fixer logs to stderr as it goes, so with more than one job the logs of 
+ * different modules are interleaved.
+ */
+
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "RepairContext.hpp"
+
+using namespace llvm;
+
+namespace pmbatch {
+
+cl::list<std::string> Inputs(cl::Positional, cl::OneOrMore,
+    cl::desc("<module.bc:trace>..."));
+
+cl::opt<std::string> OutSuffix("out-suffix", cl::init(".fixed.bc"),
+    cl::desc("Appended to each input module's path to name its output"));
+
+cl::opt<unsigned> Jobs("jobs", cl::init(0),
+    cl::desc("Number of modules to repair at once (0 = all of them)"));
+
+struct Job {
+    std::string module;
+    std::string trace;
+    // Filled in by run().
+    bool ok = false;
+    bool modified = false;
+    std::string error;
+
+    void run(void);
+};
+
+void Job::run(void) {
+    LLVMContext context;
+    SMDiagnostic diag;
+    std::unique_ptr<Module> m = parseIRFile(module, diag, context);
+    if (!m) {
+        raw_string_ostream os(error);
+        diag.print("pm-batch-fix", os);
+        return;
+    }
+
+    std::string output = module + OutSuffix;
+
+    pmfix::RepairContext ctx(*m);
+    ctx.setSummaryFile(output + ".summary.txt");
+    Expected<bool> repaired = ctx.repair(trace);
+    if (!repaired) {
+        // The module is untouched, so there is no .fixed.bc to write.
+        error = toString(repaired.takeError());
+        return;
+    }
+    modified = *repaired;
+
+    raw_string_ostream os(error);
+    if (verifyModule(*m, &os)) {
+        return;
+    }
+
+    std::error_code ec;
+    raw_fd_ostream out(output, ec, sys::fs::F_None);
+    if (ec) {
+        error = output + ": " + ec.message();
+        return;
+    }
+    WriteBitcodeToFile(*m, out);
+    ok = true;
+}
+
+}
+
+using namespace pmbatch;
+
+int main(int argc, char **argv) {
+    InitLLVM X(argc, argv);
+    cl::ParseCommandLineOptions(argc, argv,
+        "Repairs persistent memory bugs in several modules at once\n");
+
+    std::vector<Job> jobs(Inputs.size());
+    for (size_t i = 0; i < Inputs.size(); ++i) {
+        StringRef module, trace;
+        std::tie(module, trace) = StringRef(Inputs[i]).rsplit(':');
+        if (trace.empty()) {
+            errs() << "Err: expected <module.bc:trace>, got " << Inputs[i] << "\n";
+            return 1;
+        }
+        jobs[i].module = module;
+        jobs[i].trace = trace;
+    }
+
+    size_t nthreads = Jobs ? std::min<size_t>(Jobs, jobs.size()) : jobs.size();
+    std::atomic<size_t> next(0);
+    auto worker = [&] {
+        for (size_t i = next++; i < jobs.size(); i = next++) jobs[i].run();
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < nthreads; ++t) threads.emplace_back(worker);
+    for (std::thread &t : threads) t.join();
+
+    int ret = 0;
+    for (const Job &job : jobs) {
+        if (job.ok) {
+            outs() << job.module << ": " 
+                   << (job.modified ? "modified" : "not modified") << "\n";
+        } else {
+            outs() << job.module << ": FAILED\n" << job.error << "\n";
+            ret = 1;
+        }
+    }
+
+    return ret;
+}
@@ -0,0 +1,50 @@
+#include "CacheFile.hpp"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+namespace pmfix {
+namespace utils {
+
+bool writeFileAtomically(const std::string &path, StringRef data,
+                         StringRef what) {
+    std::error_code ec = sys::fs::create_directories(
+        sys::path::parent_path(path));
+    int fd;
+    SmallString<128> tmpPath;
+    if (!ec) ec = sys::fs::createUniqueFile(path + ".tmp-%%%%%%", fd, tmpPath);
+    if (ec) {
+        errs() << "Could not write " << what << " " << path << ": "
+            << ec.message() << "\n";
+        return false;
+    }
+
+    {
+        raw_fd_ostream os(fd, /*shouldClose=*/true);
+        os << data;
+        os.close();
+        if (os.has_error()) {
+            errs() << "Could not write " << what << " " << tmpPath << "\n";
+            os.clear_error();
+            sys::fs::remove(tmpPath);
+            return false;
+        }
+    }
+
+    ec = sys::fs::rename(tmpPath, path);
+    if (ec) {
+        errs() << "Could not write " << what << " " << path << ": "
+            << ec.message() << "\n";
+        sys::fs::remove(tmpPath);
+        return false;
+    }
+
+    return true;
+}
+
+}
+}
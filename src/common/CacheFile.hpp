@@ -0,0 +1,69 @@
+#pragma once
+/**
+ * Reading and writing the fixer's flat files (the location index, the alias
+ * results and binary traces): a fixed header, then arrays of plain structs,
+ * each starting 8-byte aligned. Readers map the file and point into it.
+ */
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+namespace pmfix {
+namespace utils {
+
+/**
+ * True if [first, first + count) lies within [0, size), without overflowing.
+ */
+inline bool sliceFits(uint64_t first, uint64_t count, uint64_t size) {
+    return first <= size && count <= size - first;
+}
+
+/**
+ * Pads out to the next section boundary.
+ */
+inline void alignSection(std::string &out) {
+    out.resize((out.size() + 7) & ~(size_t)7, '\0');
+}
+
+/**
+ * Appends vals as a section.
+ */
+template<typename T>
+void putArray(std::string &out, const std::vector<T> &vals) {
+    out.append(reinterpret_cast<const char*>(vals.data()),
+               vals.size() * sizeof(T));
+    alignSection(out);
+}
+
+/**
+ * Points out at count Ts at offset in buf. Returns false if they aren't 
+ * aligned or run past the end of the file.
+ */
+template<typename T>
+bool section(const llvm::MemoryBuffer &buf, uint64_t offset, uint64_t count,
+             llvm::ArrayRef<T> &out) {
+    uint64_t size = buf.getBufferSize();
+    if (offset % alignof(T)) return false;
+    if (offset > size) return false;
+    if (count > (size - offset) / sizeof(T)) return false;
+
+    out = llvm::makeArrayRef(
+        reinterpret_cast<const T*>(buf.getBufferStart() + offset), count);
+    return true;
+}
+
+/**
+ * Writes data to path, creating its directory, through a temporary file 
+ * that's then renamed over it, so concurrent runs never see half a file.
+ * Returns false (with a message naming what the file holds) on failure.
+ */
+bool writeFileAtomically(const std::string &path, llvm::StringRef data,
+                         llvm::StringRef what);
+
+}
+}
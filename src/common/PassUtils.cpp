@@ -1,9 +1,17 @@
 #include "PassUtils.hpp"
 
+#include <atomic>
 #include <cxxabi.h>
+#include <thread>
+
+#include "llvm/Support/CommandLine.h"
 
 using namespace pmfix;
 
+static cl::opt<unsigned> FixerThreads("fixer-threads", cl::init(0),
+    cl::desc("Number of worker threads for the parallel parts of the fixer "
+             "(0 = one per core)"));
+
 #pragma region PMFix
 
 std::string utils::demangle(const char *name) {
@@ -34,6 +42,30 @@ const Function *utils::getFlush(const CallBase *cb) {
     return nullptr;
 }
 
+unsigned utils::numThreads(void) {
+    if (FixerThreads) return FixerThreads;
+    unsigned n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+}
+
+void utils::parallelFor(size_t n, const std::function<void(size_t)> &fn) {
+    size_t nthreads = std::min<size_t>(numThreads(), n);
+    if (nthreads <= 1) {
+        for (size_t i = 0; i < n; ++i) fn(i);
+        return;
+    }
+
+    std::atomic<size_t> next(0);
+    auto worker = [&] {
+        for (size_t i = next++; i < n; i = next++) fn(i);
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < nthreads; ++t) threads.emplace_back(worker);
+    worker();
+    for (std::thread &t : threads) t.join();
+}
+
 std::list<Value*> utils::getConditionVariables(BasicBlock *bb) {
     std::list<BasicBlock*> frontier = {bb};
     std::unordered_set<BasicBlock*> traversed;
@@ -10,6 +10,7 @@
 #include <unordered_set>
 #include <queue>
 #include <list>
+#include <functional>
 
 #include "llvm/Pass.h"
 #include "llvm/IR/Function.h"
@@ -48,6 +49,18 @@ namespace utils {
      */
     std::list<Value*> getConditionVariables(BasicBlock *bb);
 
+    /**
+     * Number of worker threads to use (-fixer-threads, or all the cores).
+     */
+    unsigned numThreads(void);
+
+    /**
+     * Runs fn(0), ..., fn(n - 1) on numThreads() threads and waits for them.
+     * Indices are handed out one at a time, so uneven work balances out. fn
+     * must be safe to run concurrently with itself.
+     */
+    void parallelFor(size_t n, const std::function<void(size_t)> &fn);
+
     /**
      * 
      */
@@ -0,0 +1,205 @@
+/**
+ * Batch symbolizer for PMTest stack frames.
+ *
+ * PMTest prints frames as "binary(function+offset) [address]". To get a source
+ * location out of that we need the address of the function in the binary's
+ * symbol table, then the line table entry at function + offset. parse-trace
+ * used to run readelf and addr2line for every frame of every event; this
+ * loads each binary's symbol table once (and LLVMSymbolizer keeps its DWARF
+ * around), and caches every frame it has resolved.
+ *
+ * Reads one frame per line on stdin, and writes one line per frame on stdout:
+ *  function<TAB>file<TAB>line
+ * or, if the frame can't be resolved:
+ *  ERROR<TAB>message
+ */
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/DebugInfo/Symbolize/Symbolize.h"
+#include "llvm/Object/Binary.h"
+#include "llvm/Object/ELFObjectFile.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <string>
+
+using namespace llvm;
+using namespace llvm::object;
+
+namespace pmsymbolize {
+
+cl::opt<bool> CacheStats("cache-stats", cl::init(false),
+    cl::desc("Print cache statistics to stderr when done"));
+
+struct FrameInfo {
+    std::string function;
+    std::string file;
+    int64_t line = -1;
+    // If set, the frame could not be resolved and this says why.
+    std::string error;
+};
+
+class FrameSymbolizer {
+private:
+    symbolize::LLVMSymbolizer symbolizer_;
+    // binary -> (symbol name -> address). Empty if the binary can't be read.
+    StringMap<StringMap<uint64_t>> symbols_;
+    // raw frame -> resolved frame
+    StringMap<FrameInfo> frames_;
+
+    size_t nlookups_ = 0;
+
+    static symbolize::LLVMSymbolizer::Options options(void) {
+        symbolize::LLVMSymbolizer::Options opts;
+        // PMTest frames use the symbol table names.
+        opts.PrintFunctions = symbolize::FunctionNameKind::LinkageName;
+        opts.Demangle = false;
+        return opts;
+    }
+
+    /**
+     * Same as readelf -s: dynamic symbols, then the static ones. The first
+     * definition of a name wins.
+     */
+    const StringMap<uint64_t> &symbols(StringRef binary) {
+        auto it = symbols_.find(binary);
+        if (it != symbols_.end()) return it->second;
+
+        StringMap<uint64_t> &table = symbols_[binary];
+
+        auto binOrErr = createBinary(binary);
+        if (!binOrErr) {
+            errs() << "Could not open " << binary << ": "
+                << toString(binOrErr.takeError()) << "\n";
+            return table;
+        }
+
+        auto *obj = dyn_cast<ObjectFile>(binOrErr->getBinary());
+        if (!obj) return table;
+
+        auto add = [&table] (const SymbolRef &sym) {
+            Expected<StringRef> name = sym.getName();
+            Expected<uint64_t> addr = sym.getAddress();
+            if (!name || !addr) {
+                consumeError(name.takeError());
+                consumeError(addr.takeError());
+                return;
+            }
+            if (name->empty() || !*addr) return;
+            table.insert({*name, *addr});
+        };
+
+        if (auto *elf = dyn_cast<ELFObjectFileBase>(obj)) {
+            for (const SymbolRef &sym : elf->getDynamicSymbolIterators()) {
+                add(sym);
+            }
+        }
+        for (const SymbolRef &sym : obj->symbols()) {
+            add(sym);
+        }
+
+        return table;
+    }
+
+    FrameInfo resolve(StringRef frame) {
+        FrameInfo fi;
+
+        // binary(function+offset) [address]
+        size_t open = frame.rfind('(');
+        size_t close = frame.rfind(')');
+        if (open == StringRef::npos || close == StringRef::npos || close < open) {
+            fi.error = ("Malformed frame \"" + frame + "\"").str();
+            return fi;
+        }
+
+        StringRef binary = frame.substr(0, open);
+        StringRef fn, offsetStr;
+        std::tie(fn, offsetStr) = frame.slice(open + 1, close).rsplit('+');
+        uint64_t offset;
+        if (!offsetStr.consume_front("0x")) offsetStr.consume_front("0X");
+        if (fn.empty() || offsetStr.getAsInteger(16, offset)) {
+            fi.error = ("Malformed frame \"" + frame + "\"").str();
+            return fi;
+        }
+
+        // Given the function and offset, we need to find the real address.
+        // This is because of dynamic linking.
+        const StringMap<uint64_t> &table = symbols(binary);
+        auto sym = table.find(fn);
+        if (sym == table.end()) {
+            fi.error = ("Could not find symbol " + fn + " in " + binary).str();
+            return fi;
+        }
+
+        nlookups_++;
+        auto infoOrErr = symbolizer_.symbolizeCode(binary.str(), sym->second + offset);
+        if (!infoOrErr) {
+            fi.error = toString(infoOrErr.takeError());
+            std::replace(fi.error.begin(), fi.error.end(), '\n', ' ');
+            return fi;
+        }
+
+        fi.function = fn;
+        // Same as addr2line's "??:?".
+        if (infoOrErr->FileName == DILineInfo::BadString) {
+            fi.file = "??";
+        } else {
+            fi.file = infoOrErr->FileName;
+        }
+        fi.line = infoOrErr->Line ? (int64_t)infoOrErr->Line : -1;
+        return fi;
+    }
+
+public:
+    FrameSymbolizer() : symbolizer_(options()) {}
+
+    const FrameInfo &get(StringRef frame) {
+        auto it = frames_.find(frame);
+        if (it == frames_.end()) {
+            it = frames_.insert({frame, resolve(frame)}).first;
+        }
+        return it->second;
+    }
+
+    void printStats(size_t nframes) const {
+        errs() << "Symbolized " << nframes << " frames: "
+            << frames_.size() << " distinct, " << nlookups_
+            << " line table lookups, " << symbols_.size() << " binaries\n";
+    }
+};
+
+}
+
+using namespace pmsymbolize;
+
+int main(int argc, char **argv) {
+    InitLLVM X(argc, argv);
+    cl::ParseCommandLineOptions(argc, argv,
+        "Resolves PMTest stack frames to source locations\n");
+
+    FrameSymbolizer symbolizer;
+    size_t nframes = 0;
+
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        StringRef frame = StringRef(line).trim();
+        if (frame.empty()) continue;
+        nframes++;
+
+        const FrameInfo &fi = symbolizer.get(frame);
+        if (!fi.error.empty()) {
+            outs() << "ERROR\t" << fi.error << "\n";
+        } else {
+            outs() << fi.function << "\t" << fi.file << "\t" << fi.line << "\n";
+        }
+    }
+
+    if (CacheStats) symbolizer.printStats(nframes);
+
+    return 0;
+}
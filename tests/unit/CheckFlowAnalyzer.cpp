@@ -0,0 +1,432 @@
+/**
+ * Checks the redundant flush analysis (FlowAnalyzer, for -perf-fixes) on a
+ * small module: each function maps PM, flushes it (the original flush) and
+ * flushes it again (the redundant one) after some code in between. The
+ * analysis is run between the two flushes as the bug handler would, with
+ * -mmap-aa so the mapping is known to be PM without Andersen's. The context
+ * graphs it runs on are checked against the CFG as well, along with how they
+ * share nodes and function contexts.
+ *
+ * Usage: CheckFlowAnalyzer
+ */
+
+#include <cstdio>
+#include <algorithm>
+#include <list>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "BugReports.hpp"
+#include "FlowAnalyzer.hpp"
+#include "PmSummary.hpp"
+
+using namespace llvm;
+using namespace pmfix;
+
+extern cl::opt<bool> EnableMmapAA;
+
+/**
+ * Each line the checks refer to is a DILocation of its own, in flow.c.
+ */
+static const char *FlowModule = R"IR(
+declare i8* @pmem_map_file(i8*)
+declare i8* @malloc(i64)
+declare void @llvm.x86.sse2.clflush(i8*)
+
+define void @straight() !dbg !10 {
+  %p = call i8* @pmem_map_file(i8* null)
+  call void @llvm.x86.sse2.clflush(i8* %p), !dbg !DILocation(line: 11, scope: !10)
+  call void @llvm.x86.sse2.clflush(i8* %p), !dbg !DILocation(line: 12, scope: !10)
+  ret void
+}
+
+define void @spoil() !dbg !20 {
+  %p = call i8* @pmem_map_file(i8* null)
+  call void @llvm.x86.sse2.clflush(i8* %p), !dbg !DILocation(line: 21, scope: !20)
+  store i8 1, i8* %p
+  call void @llvm.x86.sse2.clflush(i8* %p), !dbg !DILocation(line: 23, scope: !20)
+  ret void
+}
+
+define void @loop() !dbg !30 {
+entry:
+  %p = call i8* @pmem_map_file(i8* null)
+  call void @llvm.x86.sse2.clflush(i8* %p), !dbg !DILocation(line: 31, scope: !30)
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %n, %loop ]
+  %n = add i32 %i, 1
+  %c = icmp ult i32 %n, 10
+  br i1 %c, label %loop, label %exit
+exit:
+  call void @llvm.x86.sse2.clflush(i8* %p), !dbg !DILocation(line: 35, scope: !30)
+  ret void
+}
+
+define void @loopspoil() !dbg !40 {
+entry:
+  %p = call i8* @pmem_map_file(i8* null)
+  call void @llvm.x86.sse2.clflush(i8* %p), !dbg !DILocation(line: 41, scope: !40)
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %n, %loop ]
+  store i8 1, i8* %p
+  %n = add i32 %i, 1
+  %c = icmp ult i32 %n, 10
+  br i1 %c, label %loop, label %exit
+exit:
+  call void @llvm.x86.sse2.clflush(i8* %p), !dbg !DILocation(line: 45, scope: !40)
+  ret void
+}
+
+define void @diamond(i1 %c) !dbg !50 {
+entry:
+  %p = call i8* @pmem_map_file(i8* null)
+  call void @llvm.x86.sse2.clflush(i8* %p), !dbg !DILocation(line: 51, scope: !50)
+  br i1 %c, label %left, label %right
+left:
+  store i8 1, i8* %p
+  br label %join
+right:
+  br label %join
+join:
+  call void @llvm.x86.sse2.clflush(i8* %p), !dbg !DILocation(line: 55, scope: !50)
+  ret void
+}
+
+define void @clean() {
+  %a = alloca i8
+  store i8 0, i8* %a
+  ret void
+}
+
+define void @dirty(i8* %q) {
+  store i8 1, i8* %q
+  ret void
+}
+
+define void @callclean() !dbg !60 {
+  %p = call i8* @pmem_map_file(i8* null)
+  call void @llvm.x86.sse2.clflush(i8* %p), !dbg !DILocation(line: 61, scope: !60)
+  call void @clean()
+  call void @llvm.x86.sse2.clflush(i8* %p), !dbg !DILocation(line: 63, scope: !60)
+  ret void
+}
+
+define void @calldirty() !dbg !70 {
+  %p = call i8* @pmem_map_file(i8* null)
+  call void @llvm.x86.sse2.clflush(i8* %p), !dbg !DILocation(line: 71, scope: !70)
+  call void @dirty(i8* %p)
+  call void @llvm.x86.sse2.clflush(i8* %p), !dbg !DILocation(line: 73, scope: !70)
+  ret void
+}
+
+define void @twodirty() {
+  %x = call i8* @malloc(i64 8)
+  %y = call i8* @malloc(i64 8)
+  call void @dirty(i8* %x)
+  call void @dirty(i8* %y)
+  ret void
+}
+
+!llvm.dbg.cu = !{!0}
+!llvm.module.flags = !{!1}
+!0 = distinct !DICompileUnit(language: DW_LANG_C99, file: !2, isOptimized: false, runtimeVersion: 0, emissionKind: FullDebug)
+!1 = !{i32 2, !"Debug Info Version", i32 3}
+!2 = !DIFile(filename: "flow.c", directory: "/tmp")
+!3 = !DISubroutineType(types: !{null})
+!10 = distinct !DISubprogram(name: "straight", scope: !2, file: !2, line: 10, type: !3, isDefinition: true, unit: !0)
+!20 = distinct !DISubprogram(name: "spoil", scope: !2, file: !2, line: 20, type: !3, isDefinition: true, unit: !0)
+!30 = distinct !DISubprogram(name: "loop", scope: !2, file: !2, line: 30, type: !3, isDefinition: true, unit: !0)
+!40 = distinct !DISubprogram(name: "loopspoil", scope: !2, file: !2, line: 40, type: !3, isDefinition: true, unit: !0)
+!50 = distinct !DISubprogram(name: "diamond", scope: !2, file: !2, line: 50, type: !3, isDefinition: true, unit: !0)
+!60 = distinct !DISubprogram(name: "callclean", scope: !2, file: !2, line: 60, type: !3, isDefinition: true, unit: !0)
+!70 = distinct !DISubprogram(name: "calldirty", scope: !2, file: !2, line: 70, type: !3, isDefinition: true, unit: !0)
+)IR";
+
+static int failures = 0;
+
+static void check(bool ok, const std::string &what) {
+    if (ok) return;
+    fprintf(stderr, "FAILED: %s\n", what.c_str());
+    failures++;
+}
+
+/**
+ * The module and everything the analysis needs to look up trace events.
+ */
+struct Fixture {
+    LLVMContext context;
+    std::unique_ptr<Module> m;
+    std::unique_ptr<BugLocationMapper> mapper;
+    std::unique_ptr<TraceTables> tables;
+    AliasInfo::Shared alias;
+
+    bool init(void) {
+        SMDiagnostic diag;
+        m = parseAssemblyString(FlowModule, diag, context);
+        if (!m) {
+            diag.print("CheckFlowAnalyzer", errs());
+            return false;
+        }
+        mapper.reset(new BugLocationMapper(*m));
+        tables.reset(new TraceTables(*mapper));
+        alias = AliasInfo::create(*m);
+        return true;
+    }
+
+    /**
+     * A flush event at the given line of function, called from nowhere.
+     */
+    TraceEvent flush(const std::string &function, int64_t line) {
+        LocationInfo li;
+        li.function = function;
+        li.file = "flow.c";
+        li.line = line;
+
+        TraceEvent te;
+        te.source = TraceEvent::GENERIC;
+        te.type = TraceEvent::FLUSH;
+        te.timestamp = line;
+        te.isBug = false;
+        AddressInfo ai;
+        ai.address = 0x1000;
+        ai.length = AddressInfo::cacheLineSize();
+        te.addresses.push_back(ai);
+        te.tables = tables.get();
+        te.locationId = tables->internLocation(li);
+        te.stackId = tables->internStack({te.locationId});
+        return te;
+    }
+
+    /**
+     * Where the redundant paths start: the first instruction of each of the
+     * named blocks of function, or the redundant flush itself (an empty
+     * name).
+     */
+    std::list<Instruction*> starts(const std::string &function,
+                                   const std::vector<std::string> &blocks,
+                                   TraceEvent &redundant) {
+        std::list<Instruction*> insts;
+        Function *f = m->getFunction(function);
+        for (const std::string &name : blocks) {
+            if (name.empty()) {
+                insts.push_back(mapper->insts(redundant.location()).front());
+                continue;
+            }
+            for (BasicBlock &b : *f) {
+                if (b.getName() == name) {
+                    insts.push_back(b.getFirstNonPHIOrDbgOrLifetime());
+                }
+            }
+        }
+        return insts;
+    }
+};
+
+/**
+ * Runs the analysis from the flush at line original to the one at line
+ * redundant, and checks its verdicts.
+ */
+static void checkFlow(Fixture &fx, const std::string &function,
+                      int64_t original, int64_t redundant,
+                      bool alwaysRedundant,
+                      const std::vector<std::string> &redundantBlocks) {
+    TraceEvent orig = fx.flush(function, original);
+    TraceEvent redt = fx.flush(function, redundant);
+
+    FlowAnalyzer flow(*fx.m, *fx.mapper, fx.alias, orig, redt);
+    check(flow.canAnalyze(), function + ": can't analyze");
+    if (!flow.canAnalyze()) return;
+
+    check(flow.alwaysRedundant() == alwaysRedundant,
+          function + ": alwaysRedundant()");
+    check(flow.redundantPaths() == fx.starts(function, redundantBlocks, redt),
+          function + ": redundantPaths()");
+}
+
+/**
+ * Where the graph should go after block: the caller's next instruction after
+ * a return, the callee's entry (or the next instruction, for calls stepped
+ * over), or the first instruction of each successor block.
+ */
+static std::set<const Instruction*> cfgSuccessors(Fixture &fx,
+                                                  const ContextBlock &block) {
+    std::set<const Instruction*> succs;
+    Instruction *last = block.last;
+    if (isa<ReturnInst>(last)) {
+        if (block.ctx->canReturn()) {
+            succs.insert(block.ctx->caller()->getNextNonDebugInstruction());
+        }
+    } else if (auto *cb = dyn_cast<CallBase>(last)) {
+        Function *f = cb->getCalledFunction();
+        if (block.ctx->contains(cb) ||
+            PmSummaries::get(*fx.alias)->isClean(f)) {
+            succs.insert(cb->getNextNonDebugInstruction());
+        } else {
+            succs.insert(&f->getEntryBlock().front());
+        }
+    } else {
+        for (BasicBlock *succ : successors(last->getParent())) {
+            succs.insert(succ->getFirstNonPHIOrDbgOrLifetime());
+        }
+    }
+    return succs;
+}
+
+/**
+ * Builds the context graph from the flush at line original to the one at
+ * line redundant, and checks that each node's children are where the CFG
+ * goes from its block, in the right contexts, and that the parents are the
+ * children turned around. Joins and loop heads are found in the node cache
+ * (hits of them) rather than built again.
+ */
+static void checkGraph(Fixture &fx, const std::string &function,
+                       int64_t original, int64_t redundant, size_t nodes,
+                       size_t hits) {
+    typedef ContextGraph<bool>::NodeId NodeId;
+    TraceEvent orig = fx.flush(function, original);
+    TraceEvent redt = fx.flush(function, redundant);
+
+    ContextGraph<bool> graph(*fx.mapper, fx.alias, orig, redt);
+    check(graph.roots.size() == 1 && graph.leaves.size() == 1,
+          function + ": one root and one leaf");
+    check(graph.size() == nodes, function + ": graph size");
+    check(graph.cacheHits() == hits, function + ": node cache hits");
+    if (graph.roots.size() != 1) return;
+
+    size_t nchildren = 0, nparents = 0;
+    for (NodeId n = 0; n < graph.size(); ++n) {
+        const ContextBlock &block = graph[n].block;
+        ArrayRef<NodeId> children = graph.children(n);
+        nchildren += children.size();
+        check(graph[n].constructed, function + ": unconstructed node");
+
+        if (graph[n].isEnd) {
+            check(children.empty(), function + ": end node has children");
+            check(std::find(graph.leaves.begin(), graph.leaves.end(), n) !=
+                  graph.leaves.end(), function + ": end node isn't a leaf");
+        } else {
+            std::set<const Instruction*> firsts;
+            for (NodeId c : children) {
+                const ContextBlock &child = graph[c].block;
+                firsts.insert(child.first);
+
+                // Same context, unless we called or returned.
+                auto *cb = dyn_cast<CallBase>(block.last);
+                if (isa<ReturnInst>(block.last)) {
+                    check(child.ctx != block.ctx,
+                          function + ": return stays in the callee");
+                } else if (cb && child.first == &cb->getCalledFunction()
+                                                    ->getEntryBlock().front()) {
+                    check(child.ctx->caller() == cb,
+                          function + ": callee context has the wrong caller");
+                } else {
+                    check(child.ctx == block.ctx,
+                          function + ": child changed context");
+                }
+
+                ArrayRef<NodeId> ps = graph.parents(c);
+                check(std::count(ps.begin(), ps.end(), n) == 1,
+                      function + ": child doesn't have its parent");
+            }
+            check(firsts.size() == children.size() &&
+                  firsts == cfgSuccessors(fx, block),
+                  function + ": children don't follow the CFG");
+        }
+
+        for (NodeId p : graph.parents(n)) {
+            ArrayRef<NodeId> cs = graph.children(p);
+            check(std::count(cs.begin(), cs.end(), n) == 1,
+                  function + ": parent doesn't have its child");
+        }
+        nparents += graph.parents(n).size();
+    }
+    check(nchildren == nparents, function + ": edge counts differ");
+    // Every other edge made the node it leads to.
+    check(nchildren == graph.size() - 1 + hits,
+          function + ": edges that neither added a node nor hit the cache");
+    // None of the loops go back to the original flush.
+    check(graph.parents(graph.roots.front()).empty(),
+          function + ": root has parents");
+}
+
+/**
+ * Calling through the same call site from the same context again gives the
+ * same context, which also learns what the second caller knows about PM.
+ * Another call site gets a context of its own.
+ */
+static void checkInterning(Fixture &fx) {
+    BasicBlock &entry = fx.m->getFunction("twodirty")->getEntryBlock();
+    std::vector<Instruction*> insts;
+    for (Instruction &i : entry) insts.push_back(&i);
+    Value *x = insts[0], *y = insts[1];
+    auto *first = cast<CallBase>(insts[2]), *second = cast<CallBase>(insts[3]);
+    Function *dirty = first->getCalledFunction();
+
+    FnContext::Shared root = FnContext::create(fx.alias);
+    FnContext::Shared callee = root->doCall(dirty, first);
+    callee->pm().addKnownPmValue(x);
+    check(!root->pm().pointsToPm(x), "callee's PM leaked to the caller");
+
+    root->pm().addKnownPmValue(y);
+    check(!callee->pm().pointsToPm(y), "caller's PM reached the callee early");
+
+    FnContext::Shared again = root->doCall(dirty, first);
+    check(again == callee, "same call site gave a new context");
+    check(callee->pm().pointsToPm(x) && callee->pm().pointsToPm(y),
+          "interned context doesn't have both paths' PM");
+    check(callee->caller() == first, "interned context has the wrong caller");
+
+    FnContext::Shared other = root->doCall(dirty, second);
+    check(other != callee, "another call site shares the context");
+    check(other->caller() == second, "new context has the wrong caller");
+}
+
+int main(int argc, char *argv[]) {
+    // Provenance is enough here, and doesn't need Andersen's.
+    EnableMmapAA = true;
+
+    Fixture fx;
+    if (!fx.init()) return 1;
+
+    // Nothing in between: one block, redundant everywhere.
+    checkFlow(fx, "straight", 11, 12, true, {});
+    // A store to the line in between.
+    checkFlow(fx, "spoil", 21, 23, false, {});
+    // A loop that never touches PM, which is redundant from the loop on.
+    checkFlow(fx, "loop", 31, 35, true, {"loop"});
+    checkFlow(fx, "loopspoil", 41, 45, false, {});
+    // Only redundant on the path that doesn't store.
+    checkFlow(fx, "diamond", 51, 55, false, {"right"});
+    // A PM-clean call is stepped over, a storing one isn't.
+    checkFlow(fx, "callclean", 61, 63, true, {""});
+    checkFlow(fx, "calldirty", 71, 73, false, {});
+
+    // The flush blocks, the blocks in between, and for calldirty the
+    // callee's body and the rest of the caller after it returns.
+    checkGraph(fx, "straight", 11, 12, 1, 0);
+    checkGraph(fx, "loop", 31, 35, 3, 1);
+    checkGraph(fx, "diamond", 51, 55, 4, 1);
+    checkGraph(fx, "callclean", 61, 63, 2, 0);
+    checkGraph(fx, "calldirty", 71, 73, 3, 0);
+
+    checkInterning(fx);
+
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("flow checks ok\n");
+    return 0;
+}
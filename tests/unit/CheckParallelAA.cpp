@@ -0,0 +1,187 @@
+/**
+ * Checks that InclusionAA's parallel solver (-parallel-aa) finds exactly the
+ * serial solution, on random modules full of copy cycles (stores and loads
+ * through shared globals), recursive call SCCs, indirect calls, memcpys and
+ * PM mappings, both whole and with part of the module hidden.
+ *
+ * Usage: CheckParallelAA [seed] [rounds]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "InclusionAA.hpp"
+
+using namespace llvm;
+using namespace pmfix;
+
+/**
+ * Every function is i8* (i8*, i8*) and calls the others at random, directly
+ * and through @fp, so the call graph is mostly one big SCC.
+ */
+static std::string randomModule(std::mt19937_64 &rng, unsigned nfuncs,
+                                 unsigned ninsts) {
+    std::ostringstream ir;
+    unsigned nglobals = nfuncs * 2;
+    for (unsigned g = 0; g < nglobals; ++g) {
+        ir << "@g" << g << " = global i8* null\n";
+    }
+    ir << "@fp = global i8* (i8*, i8*)* null\n"
+       << "declare i8* @pmem_map_file(i8*)\n"
+       << "declare i8* @malloc(i64)\n"
+       << "declare void @llvm.memcpy.p0i8.p0i8.i64(i8*, i8*, i64, i1)\n";
+
+    const char *fnType = "i8* (i8*, i8*)*";
+    for (unsigned f = 0; f < nfuncs; ++f) {
+        ir << "define i8* @f" << f << "(i8* %a0, i8* %a1) {\nentry:\n";
+        std::vector<std::string> vals = {"%a0", "%a1"};
+        auto val = [&] { return vals[rng() % vals.size()]; };
+        auto global = [&] { return "@g" + std::to_string(rng() % nglobals); };
+        auto callee = [&] { return "@f" + std::to_string(rng() % nfuncs); };
+
+        for (unsigned n = 0; n < ninsts; ++n) {
+            std::string t = "%v" + std::to_string(n);
+            switch (rng() % 11) {
+            case 0:
+                ir << "  " << t << "s = alloca i8*\n"
+                   << "  " << t << " = bitcast i8** " << t << "s to i8*\n";
+                vals.push_back(t);
+                break;
+            case 1:
+                ir << "  " << t << " = call i8* @pmem_map_file(i8* null)\n";
+                vals.push_back(t);
+                break;
+            case 2:
+                ir << "  " << t << " = call i8* @malloc(i64 8)\n";
+                vals.push_back(t);
+                break;
+            case 3:
+                ir << "  " << t << "p = bitcast i8* " << val() << " to i8**\n"
+                   << "  store i8* " << val() << ", i8** " << t << "p\n";
+                break;
+            case 4:
+                ir << "  " << t << "p = bitcast i8* " << val() << " to i8**\n"
+                   << "  " << t << " = load i8*, i8** " << t << "p\n";
+                vals.push_back(t);
+                break;
+            case 5:
+                ir << "  store i8* " << val() << ", i8** " << global() << "\n";
+                break;
+            case 6:
+                ir << "  " << t << " = load i8*, i8** " << global() << "\n";
+                vals.push_back(t);
+                break;
+            case 7:
+                ir << "  " << t << " = call i8* " << callee() << "(i8* "
+                   << val() << ", i8* " << val() << ")\n";
+                vals.push_back(t);
+                break;
+            case 8:
+                ir << "  store " << fnType << " " << callee() << ", "
+                   << fnType << "* @fp\n"
+                   << "  " << t << "f = load " << fnType << ", "
+                   << fnType << "* @fp\n"
+                   << "  " << t << " = call i8* " << t << "f(i8* " << val()
+                   << ", i8* " << val() << ")\n";
+                vals.push_back(t);
+                break;
+            case 9:
+                ir << "  " << t << " = select i1 undef, i8* " << val()
+                   << ", i8* " << val() << "\n";
+                vals.push_back(t);
+                break;
+            default:
+                ir << "  call void @llvm.memcpy.p0i8.p0i8.i64(i8* " << val()
+                   << ", i8* " << val() << ", i64 8, i1 false)\n";
+                break;
+            }
+        }
+        ir << "  ret i8* " << val() << "\n}\n";
+    }
+
+    return ir.str();
+}
+
+/**
+ * Compares the sets value by value, as well as with sameAs(), so a bug in
+ * sameAs() can't hide one in the solver.
+ */
+static bool agree(Module &m, const InclusionAA &serial,
+                  const InclusionAA &parallel) {
+    std::vector<const Value*> vals;
+    for (const GlobalVariable &g : m.globals()) vals.push_back(&g);
+    for (const Function &f : m) {
+        for (const Argument &a : f.args()) vals.push_back(&a);
+        for (const BasicBlock &b : f) {
+            for (const Instruction &i : b) vals.push_back(&i);
+        }
+    }
+
+    for (const Value *v : vals) {
+        std::vector<const Value*> a, b;
+        bool ra = serial.getPointsToSet(v, a);
+        bool rb = parallel.getPointsToSet(v, b);
+        if (ra != rb || std::set<const Value*>(a.begin(), a.end()) !=
+                        std::set<const Value*>(b.begin(), b.end())) {
+            errs() << "Sets differ for " << *v << "\n";
+            return false;
+        }
+    }
+
+    return serial.sameAs(parallel);
+}
+
+int main(int argc, char *argv[]) {
+    std::mt19937_64 rng(argc > 1 ? atoi(argv[1]) : 1);
+    int rounds = argc > 2 ? atoi(argv[2]) : 20;
+
+    int failures = 0;
+    for (int round = 0; round < rounds; ++round) {
+        // Alternate small modules with ones big enough for the parallel
+        // solver to actually split its levels across threads.
+        unsigned nfuncs = round % 2 ? 40 : 2 + rng() % 8;
+        unsigned ninsts = round % 2 ? 60 : 5 + rng() % 30;
+        std::string ir = randomModule(rng, nfuncs, ninsts);
+
+        LLVMContext context;
+        SMDiagnostic diag;
+        std::unique_ptr<Module> m = parseAssemblyString(ir, diag, context);
+        if (!m) {
+            diag.print("CheckParallelAA", errs());
+            return 1;
+        }
+
+        ptmodel::Scope hidden;
+        hidden.hidden.insert(m->getFunction("f0"));
+        hidden.noAllocas = true;
+
+        for (const ptmodel::Scope &scope : {ptmodel::Scope(), hidden}) {
+            InclusionAA serial(*m, scope), parallel(*m, scope);
+            serial.solve(false);
+            parallel.solve(true);
+            if (!agree(*m, serial, parallel)) {
+                fprintf(stderr, "round %d (%s): solutions differ\n", round,
+                        scope.hidden.empty() ? "whole" : "hidden");
+                failures++;
+            }
+        }
+    }
+
+    if (failures) {
+        fprintf(stderr, "%d mismatches\n", failures);
+        return 1;
+    }
+    printf("%d rounds ok\n", rounds);
+    return 0;
+}
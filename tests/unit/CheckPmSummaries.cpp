@@ -0,0 +1,170 @@
+/**
+ * Checks the per-function PM summaries (-pm-summaries) the redundant flush
+ * analysis uses to step over calls: clean leaves, effects inherited through
+ * callees and recursive cycles, and calls to code we can't see. Uses
+ * -mmap-aa, so only the mapping and what it can't rule out may be PM.
+ *
+ * Usage: CheckPmSummaries
+ */
+
+#include <cstdio>
+#include <memory>
+#include <string>
+
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "PmSummary.hpp"
+
+using namespace llvm;
+using namespace pmfix;
+
+extern cl::opt<bool> EnableMmapAA;
+
+static const char *SummaryModule = R"IR(
+declare i8* @pmem_map_file(i8*)
+declare void @pmem_persist(i8*, i64)
+declare void @llvm.x86.sse2.clflush(i8*)
+declare void @llvm.x86.sse.sfence()
+
+define void @leaf() {
+  %a = alloca i8
+  store i8 0, i8* %a
+  ret void
+}
+
+define void @callsleaf() {
+  call void @leaf()
+  ret void
+}
+
+define void @storer(i8* %q) {
+  store i8 1, i8* %q
+  ret void
+}
+
+define void @flusher(i8* %q) {
+  call void @llvm.x86.sse2.clflush(i8* %q)
+  ret void
+}
+
+define void @fencer() {
+  call void @llvm.x86.sse.sfence()
+  ret void
+}
+
+define void @ping(i32 %n) {
+  %c = icmp eq i32 %n, 0
+  br i1 %c, label %done, label %more
+more:
+  %m = sub i32 %n, 1
+  call void @pong(i32 %m)
+  br label %done
+done:
+  ret void
+}
+
+define void @pong(i32 %n) {
+  %p = call i8* @pmem_map_file(i8* null)
+  call void @storer(i8* %p)
+  call void @ping(i32 %n)
+  ret void
+}
+
+define void @callsflusher(i8* %q) {
+  call void @flusher(i8* %q)
+  call void @fencer()
+  ret void
+}
+
+define void @persistpm() {
+  %p = call i8* @pmem_map_file(i8* null)
+  call void @pmem_persist(i8* %p, i64 8)
+  ret void
+}
+
+define void @persiststack() {
+  %a = alloca i8
+  call void @pmem_persist(i8* %a, i64 1)
+  ret void
+}
+
+define i8* @mapper() {
+  %p = call i8* @pmem_map_file(i8* null)
+  ret i8* %p
+}
+
+define void @callsmapper() {
+  %p = call i8* @mapper()
+  ret void
+}
+)IR";
+
+static int failures = 0;
+
+static void check(bool ok, const std::string &what) {
+    if (ok) return;
+    fprintf(stderr, "FAILED: %s\n", what.c_str());
+    failures++;
+}
+
+int main(int argc, char *argv[]) {
+    EnableMmapAA = true;
+
+    LLVMContext context;
+    SMDiagnostic diag;
+    std::unique_ptr<Module> m = parseAssemblyString(SummaryModule, diag,
+                                                    context);
+    if (!m) {
+        diag.print("CheckPmSummaries", errs());
+        return 1;
+    }
+
+    AliasInfo::Shared alias = AliasInfo::create(*m);
+    PmSummaries sums(*m, *alias);
+    auto sum = [&](const char *name) { return sums[m->getFunction(name)]; };
+
+    // Only touches the stack, directly or through a callee.
+    check(sums.isClean(m->getFunction("leaf")), "leaf is clean");
+    check(sums.isClean(m->getFunction("callsleaf")), "callsleaf is clean");
+
+    // An argument may be PM.
+    check(sum("storer").mayStorePm, "storer stores PM");
+    check(!sum("storer").mayFlush && !sum("storer").mayFence,
+          "storer neither flushes nor fences");
+
+    // ping only reaches storer through pong, which it is a cycle with.
+    check(sum("pong").mayStorePm, "pong stores PM");
+    check(sum("ping").mayStorePm, "ping stores PM (through its SCC)");
+    check(!sums.isClean(m->getFunction("ping")), "ping isn't clean");
+
+    check(sum("callsflusher").mayFlush, "callsflusher flushes");
+    check(sum("callsflusher").mayFence, "callsflusher fences");
+    check(!sum("callsflusher").mayStorePm, "callsflusher doesn't store PM");
+
+    // Code we can't see writes through the pointers it's given.
+    check(sum("persistpm").mayStorePm, "persistpm stores PM");
+    check(sums.isClean(m->getFunction("persiststack")),
+          "persiststack is clean");
+
+    // Returning PM is the function's own, not its callers'.
+    check(sum("mapper").mayReturnPm, "mapper returns PM");
+    check(!sums.isClean(m->getFunction("mapper")), "mapper isn't clean");
+    check(sums.isClean(m->getFunction("callsmapper")),
+          "callsmapper is clean");
+
+    // Nothing is known about declarations.
+    check(!sums.isClean(m->getFunction("pmem_persist")),
+          "pmem_persist isn't clean");
+
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("summary checks ok\n");
+    return 0;
+}
@@ -0,0 +1,176 @@
+/**
+ * Checks that run compression (-trace-max-run-period) doesn't change the
+ * trace: random traces, built with and without runs, must agree on every
+ * event, the bugs, and what the address index reports.
+ *
+ * Usage: CheckTraceRuns [seed] [rounds]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "BugReports.hpp"
+
+using namespace pmfix;
+
+static TraceEvent makeEvent(TraceEvent::Type type, uint64_t address,
+                            uint64_t length, uint64_t timestamp,
+                            uint32_t stack, bool isBug = false) {
+    TraceEvent e;
+    e.source = TraceEvent::GENERIC;
+    e.type = type;
+    e.timestamp = timestamp;
+    e.isBug = isBug;
+    e.stackId = stack;
+    e.locationId = stack;
+    if (type != TraceEvent::FENCE) {
+        AddressInfo ai;
+        ai.address = address;
+        ai.length = length;
+        e.addresses.push_back(ai);
+    }
+    return e;
+}
+
+/**
+ * Loops (which runs should catch) mixed with bugs, two-address asserts and
+ * stray operations (which they shouldn't).
+ */
+static std::vector<TraceEvent> randomTrace(std::mt19937_64 &rng) {
+    std::vector<TraceEvent> events;
+    uint64_t ts = 0;
+    auto addr = [&](unsigned n) { return 0x1000 + (rng() % n) * 8; };
+
+    int nsegments = 1 + rng() % 12;
+    for (int s = 0; s < nsegments; ++s) {
+        switch (rng() % 4) {
+        case 0: {
+            int period = 1 + rng() % 4;
+            int iters = 1 + rng() % 40;
+            uint64_t base = addr(64);
+            int64_t stride = (int64_t)(rng() % 5) * 8 - 8;
+            // Sometimes stop partway through the last iteration.
+            int cut = rng() % period;
+            for (int it = 0; it < iters; ++it) {
+                for (int j = 0; j < period; ++j) {
+                    if (it == iters - 1 && cut && j >= cut) break;
+                    events.push_back(makeEvent((TraceEvent::Type)(j % 3),
+                        base + j * 8 + stride * it, 8 << (j % 2), ts++,
+                        100 + s * 10 + j));
+                }
+            }
+            break;
+        }
+        case 1: {
+            auto type = rng() % 2 ? TraceEvent::ASSERT_PERSISTED
+                                  : TraceEvent::REQUIRED_FLUSH;
+            events.push_back(makeEvent(type, addr(96), 8 * (1 + rng() % 3),
+                                       ts++, 1 + rng() % 5, true));
+            break;
+        }
+        case 2: {
+            TraceEvent e = makeEvent(TraceEvent::ASSERT_ORDERED, addr(96), 8,
+                                     ts++, 9, rng() % 2);
+            AddressInfo ai;
+            ai.address = addr(96);
+            ai.length = 16;
+            e.addresses.push_back(ai);
+            events.push_back(e);
+            break;
+        }
+        default: {
+            int n = rng() % 6;
+            for (int k = 0; k < n; ++k) {
+                events.push_back(makeEvent((TraceEvent::Type)(rng() % 3),
+                    addr(96), 8, ts++, 50 + rng() % 3));
+            }
+            break;
+        }
+        }
+    }
+
+    events.push_back(makeEvent(TraceEvent::ASSERT_PERSISTED, addr(96), 8,
+                               ts++, 7, true));
+    return events;
+}
+
+static bool sameEvent(const TraceEvent &a, const TraceEvent &b) {
+    if (a.type != b.type || a.timestamp != b.timestamp ||
+        a.stackId != b.stackId || a.isBug != b.isBug ||
+        a.addresses.size() != b.addresses.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.addresses.size(); ++i) {
+        if (a.addresses[i].address != b.addresses[i].address ||
+            a.addresses[i].length != b.addresses[i].length) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * The events walkBack finds that really overlap addr.
+ */
+static std::vector<int> overlapping(const TraceInfo &ti,
+                                    const AddressInfo &addr, int before) {
+    std::vector<int> found;
+    auto walk = ti.addressIndex().walkBack(addr, before);
+    for (int i = walk.next(); i >= 0; i = walk.next()) {
+        if (ti[i].address().overlaps(addr)) found.push_back(i);
+    }
+    return found;
+}
+
+int main(int argc, char *argv[]) {
+    std::mt19937_64 rng(argc > 1 ? atoi(argv[1]) : 1);
+    int rounds = argc > 2 ? atoi(argv[2]) : 200;
+
+    int failures = 0;
+    auto check = [&](bool ok, int round, const char *what) {
+        if (ok) return;
+        if (++failures <= 10) fprintf(stderr, "round %d: %s\n", round, what);
+    };
+
+    for (int round = 0; round < rounds; ++round) {
+        std::vector<TraceEvent> events = randomTrace(rng);
+        TraceInfo runs = TraceInfo::fromEvents(TraceEvent::GENERIC, events, 8);
+        TraceInfo plain = TraceInfo::fromEvents(TraceEvent::GENERIC, events, 0);
+
+        check(runs.size() == events.size() && plain.size() == events.size(),
+              round, "size");
+        check(runs.bugs() == plain.bugs(), round, "bugs");
+        for (size_t i = 0; i < events.size(); ++i) {
+            check(sameEvent(runs[i], events[i]), round, "event");
+        }
+
+        int n = (int)events.size();
+        for (int q = 0; q < 50; ++q) {
+            int from = (int)(rng() % (n + 1)) - 1;
+            int to = rng() % (n + 1);
+            check(runs.addressIndex().fencesBetween(from, to) ==
+                  plain.addressIndex().fencesBetween(from, to),
+                  round, "fencesBetween");
+
+            AddressInfo addr;
+            addr.address = 0x1000 + (rng() % 100) * 4;
+            addr.length = 1 + rng() % 40;
+            check(overlapping(runs, addr, to) == overlapping(plain, addr, to),
+                  round, "walkBack");
+        }
+
+        if (round == 0) {
+            printf("round 0: stored %zu of %zu events, %zu runs\n",
+                   runs.events().size(), runs.size(), runs.runs().size());
+        }
+    }
+
+    if (failures) {
+        fprintf(stderr, "%d mismatches\n", failures);
+        return 1;
+    }
+    printf("%d rounds ok\n", rounds);
+    return 0;
+}
@@ -0,0 +1,128 @@
+/**
+ * Checks that the bug contexts of the streaming window (TraceWindow) keep
+ * what the REQUIRED_FLUSH handler looks for: walking back from the bug, the
+ * redundant flush and the flush before it, even across a whole-line flush.
+ * Random traces of stores, line and multi-line flushes and fences on a few
+ * cache lines must give the same pair in the context as in the full trace.
+ *
+ * Usage: CheckTraceWindow [seed] [rounds]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "BugReports.hpp"
+
+using namespace pmfix;
+
+static TraceEvent makeEvent(TraceEvent::Type type, uint64_t address,
+                            uint64_t length, uint64_t timestamp,
+                            bool isBug = false) {
+    TraceEvent e;
+    e.source = TraceEvent::GENERIC;
+    e.type = type;
+    e.timestamp = timestamp;
+    e.isBug = isBug;
+    e.stackId = 1;
+    e.locationId = 1;
+    if (type != TraceEvent::FENCE) {
+        AddressInfo ai;
+        ai.address = address;
+        ai.length = length;
+        e.addresses.push_back(ai);
+    }
+    return e;
+}
+
+static std::vector<TraceEvent> randomTrace(std::mt19937_64 &rng) {
+    std::vector<TraceEvent> events;
+    uint64_t clSize = AddressInfo::cacheLineSize();
+    uint64_t base = 0x1000;
+    int n = 20 + rng() % 80;
+    for (uint64_t ts = 0; ts < (uint64_t)n; ++ts) {
+        uint64_t line = base + (rng() % 3) * clSize;
+        switch (rng() % 6) {
+        case 0:
+        case 1:
+            events.push_back(makeEvent(TraceEvent::STORE,
+                line + (rng() % (clSize / 8)) * 8, 8, ts));
+            break;
+        case 2:
+            events.push_back(makeEvent(TraceEvent::FLUSH, line, clSize, ts));
+            break;
+        case 3:
+            events.push_back(makeEvent(TraceEvent::FLUSH, base,
+                (2 + rng() % 2) * clSize, ts));
+            break;
+        case 4:
+            events.push_back(makeEvent(TraceEvent::FENCE, 0, 0, ts));
+            break;
+        default:
+            events.push_back(makeEvent(TraceEvent::REQUIRED_FLUSH, line,
+                                       clSize, ts, true));
+            break;
+        }
+    }
+    return events;
+}
+
+/**
+ * The timestamps of the redundant and the original flush, found the way
+ * BugFixer::handleRequiredFlush finds them (-1 if missing, -2 if it gives
+ * up on a partial flush).
+ */
+static std::pair<int64_t, int64_t> flushPair(const TraceInfo &ti, int bug) {
+    AddressInfo addr = ti[bug].address();
+    int64_t redundant = -1, original = -1;
+    auto walk = ti.addressIndex().walkBack(addr, bug);
+    for (int i = walk.next(); i >= 0; i = walk.next()) {
+        TraceEventView e = ti[i];
+        if (!e.numAddresses() || e.type() != TraceEvent::FLUSH) continue;
+        if (e.address() == addr && redundant == -1) {
+            redundant = e.timestamp();
+        } else if (e.address().overlaps(addr)) {
+            if (redundant == -1) return {-2, -2};
+            original = e.timestamp();
+            break;
+        }
+    }
+    return {redundant, original};
+}
+
+int main(int argc, char *argv[]) {
+    std::mt19937_64 rng(argc > 1 ? atoi(argv[1]) : 1);
+    int rounds = argc > 2 ? atoi(argv[2]) : 200;
+
+    int failures = 0, nbugs = 0;
+    for (int round = 0; round < rounds; ++round) {
+        std::vector<TraceEvent> events = randomTrace(rng);
+        TraceInfo full = TraceInfo::fromEvents(TraceEvent::GENERIC, events, 0);
+        TraceWindow window(TraceEvent::GENERIC, nullptr);
+
+        for (size_t i = 0; i < events.size(); ++i) {
+            if (events[i].isBug) {
+                TraceInfo context = window.context(events[i]);
+                auto expected = flushPair(full, i);
+                auto got = flushPair(context, context.size() - 1);
+                nbugs++;
+                if (expected != got && ++failures <= 10) {
+                    fprintf(stderr, "round %d, event %zu: flushes at %ld and "
+                            "%ld, but %ld and %ld in the context\n", round, i,
+                            (long)expected.first, (long)expected.second,
+                            (long)got.first, (long)got.second);
+                }
+            }
+            window.add(TraceEvent(events[i]));
+        }
+    }
+
+    if (failures) {
+        fprintf(stderr, "%d mismatches\n", failures);
+        return 1;
+    }
+    printf("%d rounds, %d bugs ok\n", rounds, nbugs);
+    return 0;
+}
@@ -7,6 +7,8 @@ from pathlib import Path
 
 import collections
 import re
+import struct
+import zlib
 
 # https://pyyaml.org/wiki/PyYAMLDocumentation
 import yaml
@@ -332,10 +334,16 @@ class BugReport:
         self.trace = new_trace
         
     
-    def dump(self):
+    def dump(self, fmt='yaml'):
         self._validate_metadata()
         self._optimize()
         print(f'Prepare to dump.\n\tNum items: {len(self.trace)}')
+        if fmt != 'yaml':
+            writer = BinaryTraceWriter(compress=(fmt == 'binary-zlib'))
+            writer.write(self.output_file, self.trace, self.metadata)
+            print(f'Report written to {str(self.output_file)}')
+            return
+
         report = {'trace': self.trace, 'metadata': self.metadata}
         raw = yaml.dump(report, None, Dumper=Dumper)
         print('Prepare to write.')
@@ -347,6 +355,132 @@ class BugReport:
     def __getitem__(self, a):
         return self.trace[a]
 
+class BinaryTraceWriter:
+    '''
+        Writes the binary trace format read by src/BinaryTrace.cpp. See
+        src/BinaryTrace.hpp for the layout; keep the two in sync.
+    '''
+    MAGIC = b'PMFXTRC\0'
+    VERSION = 1
+    FLAG_COMPRESSED = 1
+    EVENT_IS_BUG = 1
+
+    HEADER = struct.Struct('<8sIIIIQQQQQQQQQQQ')
+    LOCATION = struct.Struct('<IIq')
+    STACK = struct.Struct('<QII')
+    BLOCK = struct.Struct('<QQQQ')
+    EVENT = struct.Struct('<BBHIIIQQQQQ')
+
+    # Must match TraceEvent::Source and TraceEvent::Type.
+    SOURCES = {'PMTEST': 0, 'GENERIC': 1}
+    TYPES = {'STORE': 0, 'FLUSH': 1, 'FENCE': 2, 'ASSERT_PERSISTED': 3,
+             'ASSERT_ORDERED': 4, 'REQUIRED_FLUSH': 5}
+
+    def __init__(self, compress=False, events_per_block=65536):
+        self.compress = compress
+        self.events_per_block = events_per_block
+        self.strings = {}
+        self.locations = {}
+        self.stacks = {}
+        self.frames = []
+
+    def _string(self, s):
+        if s not in self.strings:
+            self.strings[s] = len(self.strings)
+        return self.strings[s]
+
+    def _location(self, function, file, line):
+        key = (self._string(function), self._string(file), line)
+        if key not in self.locations:
+            self.locations[key] = len(self.locations)
+        return self.locations[key]
+
+    def _stack(self, stack):
+        key = tuple(self._location(sf['function'], sf['file'], sf['line'])
+                    for sf in stack)
+        if key not in self.stacks:
+            self.stacks[key] = (len(self.stacks), len(self.frames))
+            self.frames += key
+        return self.stacks[key][0]
+
+    def _encode_event(self, te):
+        if te['event'] == 'ASSERT_ORDERED':
+            addrs = (te['address_a'], te['length_a'],
+                     te['address_b'], te['length_b'])
+        elif 'address' in te:
+            addrs = (te['address'], te['length'], 0, 0)
+        else:
+            addrs = (0, 0, 0, 0)
+
+        return self.EVENT.pack(
+            self.TYPES[te['event']],
+            self.EVENT_IS_BUG if te['is_bug'] else 0, 0,
+            self._location(te['function'], te['file'], te['line']),
+            self._stack(te['stack']), 0,
+            te['timestamp'], *addrs)
+
+    @staticmethod
+    def _pad(buf):
+        buf += b'\0' * (-len(buf) % 8)
+        return buf
+
+    def write(self, output_file, trace, metadata):
+        # Encode the events first, which fills in the tables.
+        blocks = []
+        for start in range(0, len(trace), self.events_per_block):
+            chunk = trace[start:start + self.events_per_block]
+            raw = b''.join(self._encode_event(te) for te in chunk)
+            if self.compress:
+                raw = zlib.compress(raw)
+            blocks += [(start, len(chunk), raw)]
+
+        body = bytearray()
+        offset = self.HEADER.size
+
+        strings_offset = offset
+        data = b''.join(s.encode('utf-8') + b'\0' for s in self.strings)
+        str_offsets = [0]
+        for s in self.strings:
+            str_offsets += [str_offsets[-1] + len(s.encode('utf-8')) + 1]
+        body += struct.pack(f'<{len(str_offsets)}Q', *str_offsets) + data
+        self._pad(body)
+
+        locations_offset = offset + len(body)
+        for function, file, line in self.locations:
+            body += self.LOCATION.pack(function, file, line)
+
+        stacks_offset = offset + len(body)
+        for key, (_, first) in self.stacks.items():
+            body += self.STACK.pack(first, len(key), 0)
+
+        frames_offset = offset + len(body)
+        body += struct.pack(f'<{len(self.frames)}I', *self.frames)
+        self._pad(body)
+
+        blocks_offset = offset + len(body)
+        data_offset = blocks_offset + len(blocks) * self.BLOCK.size
+        block_data = bytearray()
+        for first, count, raw in blocks:
+            body += self.BLOCK.pack(data_offset + len(block_data), len(raw),
+                                    first, count)
+            block_data += raw
+            self._pad(block_data)
+        body += block_data
+
+        header = self.HEADER.pack(
+            self.MAGIC, self.VERSION,
+            self.FLAG_COMPRESSED if self.compress else 0,
+            self.SOURCES[metadata['source']], self.events_per_block,
+            len(trace), len(self.strings), strings_offset,
+            len(self.locations), locations_offset,
+            len(self.stacks), stacks_offset,
+            len(self.frames), frames_offset,
+            len(blocks), blocks_offset)
+
+        with output_file.open('wb') as f:
+            f.write(header)
+            f.write(body)
+
 class TraceUtils:
     COLOR_RE = re.compile('\\033\[\d+m')
 